@@ -157,6 +157,46 @@ void test_static1() {
 	assert(sv == "Hello");
 }
 
+void test_slice1() {
+	//Test views that share the memory
+	HeapByteBuffer b(128);
+
+	b.put("Hello Wonderful World");
+	b.flip();
+	b.position(6);
+
+	auto slice = b.slice();
+
+	assert(slice.array() == b.array() + 6);
+	assert(slice.position() == 0);
+	assert(slice.capacity() == 15);
+	assert(slice.to_string_view() == "Wonderful World");
+
+	std::string_view sv{};
+
+	slice.get(sv, 9);
+
+	assert(sv == "Wonderful");
+	//The original buffer does not move
+	assert(b.position() == 6);
+
+	auto word = b.slice(16, 5);
+
+	assert(word.to_string_view() == "World");
+
+	//Writes through a view are seen by the original
+	word.put('w');
+
+	auto dup = b.duplicate();
+
+	assert(dup.position() == 6 && dup.limit() == b.limit());
+	assert(dup.to_string_view() == "Wonderful world");
+
+	dup.position(dup.limit());
+
+	assert(b.remaining() == 15);
+}
+
 int main()
 {
 	test_put1();
@@ -166,4 +206,5 @@ int main()
 	test_wrapped1();
 	test_get5();
 	test_static1();
+	test_slice1();
 }
@@ -0,0 +1,1860 @@
+#include <iostream>
+#include <velar.h>
+#include <cassert>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <string>
+
+/*
+* These tests run a server and its clients on the same Selector
+* over the loopback interface.
+*/
+
+const int TEST_PORT = 9580;
+
+void test_echo() {
+    Selector sel;
+    StaticByteBuffer<128> out_buff, in_buff;
+    bool done = false;
+
+    sel.start_server(TEST_PORT, nullptr);
+    auto client = sel.start_client("127.0.0.1", TEST_PORT, nullptr);
+
+    out_buff.put("Hello Velar");
+    out_buff.flip();
+
+    for (int i = 0; i < 100 && !done; ++i) {
+        int n = sel.select(1);
+
+        assert(n > 0);
+
+        for (auto& s : sel.sockets()) {
+            if (s->is_acceptable()) {
+                auto peer = sel.accept(s, nullptr);
+
+                peer->report_readable(true);
+            }
+            else if (s->is_connection_success()) {
+                s->report_writable(true);
+            }
+            else if (s->is_writable()) {
+                if (out_buff.has_remaining()) {
+                    assert(s->write(out_buff) > 0);
+                }
+                else {
+                    s->report_writable(false);
+                }
+            }
+            else if (s->is_readable()) {
+                int sz = s->read(in_buff);
+
+                assert(sz > 0);
+
+                if (in_buff.position() == out_buff.limit()) {
+                    done = true;
+                }
+            }
+        }
+    }
+
+    assert(done);
+
+    in_buff.flip();
+
+    assert(in_buff.to_string_view() == "Hello Velar");
+}
+
+/*
+* Opens more connections than FD_SETSIZE permits with select().
+*/
+void test_many_sockets() {
+#ifdef VELAR_USE_EPOLL
+    const int num_clients = 600;
+    Selector sel;
+    int num_started = 0, num_accepted = 0, num_connected = 0;
+
+    sel.start_server(TEST_PORT, nullptr);
+
+    while (num_accepted < num_clients || num_connected < num_clients) {
+        //Don't overflow the listen backlog
+        while (num_started < num_clients && num_started - num_accepted < 5) {
+            sel.start_client("127.0.0.1", TEST_PORT, nullptr);
+
+            ++num_started;
+        }
+
+        assert(sel.select(1) > 0);
+
+        for (auto& s : sel.sockets()) {
+            if (s->is_acceptable()) {
+                sel.accept(s, nullptr);
+
+                ++num_accepted;
+            }
+            else if (s->is_connection_success()) {
+                ++num_connected;
+            }
+
+            assert(!s->is_connection_failed());
+        }
+    }
+
+    assert(num_accepted == num_clients);
+    assert(num_connected == num_clients);
+
+    //The newest sockets have descriptors above FD_SETSIZE
+    SOCKET max_fd = 0;
+
+    for (auto& s : sel.sockets()) {
+        max_fd = std::max(max_fd, s->fd());
+    }
+
+    assert(max_fd >= FD_SETSIZE);
+#endif
+}
+
+/*
+* Sockets are added to the list by select() and removed
+* from it after they are canceled.
+*/
+void test_cancel() {
+    Selector sel;
+    std::vector<std::shared_ptr<Socket>> clients;
+
+    sel.start_server(TEST_PORT, nullptr);
+
+    for (int i = 0; i < 8; ++i) {
+        clients.push_back(sel.start_client("127.0.0.1", TEST_PORT, nullptr));
+    }
+
+    //New sockets are not visible until the next select()
+    assert(sel.sockets().size() == 0);
+
+    sel.select(1);
+
+    assert(sel.sockets().size() == 9);
+
+    for (int i = 0; i < 8; i += 2) {
+        sel.cancel_socket(clients[i]);
+        //Canceling more than once is harmless
+        sel.cancel_socket(clients[i]);
+    }
+
+    sel.select(1);
+
+    assert(sel.sockets().size() == 5);
+
+    for (int i = 0; i < 8; ++i) {
+        bool found = std::find(sel.sockets().begin(), sel.sockets().end(), clients[i]) != sel.sockets().end();
+
+        assert(found == (i % 2 == 1));
+    }
+}
+
+/*
+* Only the sockets with events are in the ready list.
+*/
+void test_ready() {
+    Selector sel;
+    StaticByteBuffer<128> buff;
+    std::vector<std::shared_ptr<Socket>> clients, peers;
+
+    sel.start_server(TEST_PORT, nullptr);
+
+    for (int i = 0; i < 3; ++i) {
+        clients.push_back(sel.start_client("127.0.0.1", TEST_PORT, nullptr));
+    }
+
+    size_t num_connected = 0;
+
+    while (peers.size() < clients.size() || num_connected < clients.size()) {
+        assert(sel.select(1) > 0);
+
+        for (auto& s : sel.ready()) {
+            if (s->is_acceptable()) {
+                auto peer = sel.accept(s, nullptr);
+
+                peer->report_readable(true);
+                peers.push_back(peer);
+            }
+            else if (s->is_connection_success()) {
+                ++num_connected;
+            }
+        }
+    }
+
+    buff.put("Hello");
+    buff.flip();
+
+    assert(clients[1]->write(buff) > 0);
+
+    assert(sel.select(1) > 0);
+    assert(sel.ready().size() == 1);
+
+    auto& s = sel.ready()[0];
+
+    assert(s->is_readable());
+    assert(std::find(peers.begin(), peers.end(), s) != peers.end());
+}
+
+/*
+* Reads and writes are performed by the io_uring engine.
+*/
+void test_io_uring(bool fixed_buffers) {
+#ifdef VELAR_USE_IO_URING
+    Selector sel;
+    HeapByteBuffer server_buff(128), client_buff(128);
+    std::shared_ptr<Socket> peer;
+    bool done = false;
+
+    if (fixed_buffers) {
+        sel.register_buffers({ &server_buff, &client_buff });
+    }
+
+    auto server = sel.start_server(TEST_PORT, nullptr);
+    auto client = sel.start_client("127.0.0.1", TEST_PORT, nullptr);
+
+    sel.submit_accept(server);
+
+    for (int i = 0; i < 100 && !done; ++i) {
+        assert(sel.select(1) > 0);
+
+        for (auto& s : sel.sockets()) {
+            if (s->is_acceptable()) {
+                peer = sel.accept(s, nullptr);
+
+                sel.submit_read(peer, server_buff);
+            }
+            else if (s->is_connection_success()) {
+                client_buff.put("Hello Velar");
+                client_buff.flip();
+
+                sel.submit_write(s, client_buff);
+            }
+            else if (s->is_write_complete()) {
+                assert(s->write_result() > 0);
+
+                if (s == client) {
+                    //Wait for the echo
+                    client_buff.clear();
+
+                    sel.submit_read(s, client_buff);
+                }
+            }
+            else if (s->is_read_complete()) {
+                assert(s->read_result() > 0);
+
+                if (s == peer) {
+                    //Echo back what we got
+                    server_buff.flip();
+
+                    sel.submit_write(s, server_buff);
+                }
+                else {
+                    done = true;
+                }
+            }
+        }
+    }
+
+    assert(done);
+
+    client_buff.flip();
+
+    assert(client_buff.to_string_view() == "Hello Velar");
+
+    //Cancel a socket with a read in flight
+    client_buff.clear();
+    sel.submit_read(client, client_buff);
+    sel.cancel_socket(client);
+    sel.cancel_socket(peer);
+
+    sel.select(1);
+#else
+    (void) fixed_buffers;
+#endif
+}
+
+/*
+* Timers expire with sub-second select() timeouts.
+*/
+void test_timers() {
+    Selector sel;
+    Timer once, periodic, canceled;
+    int num_once = 0, num_periodic = 0, num_canceled = 0;
+
+    sel.schedule(once, std::chrono::milliseconds(20), [&]() { ++num_once; });
+    sel.schedule(periodic, std::chrono::milliseconds(5), [&]() { ++num_periodic; }, std::chrono::milliseconds(5));
+    sel.schedule(canceled, std::chrono::milliseconds(10), [&]() { ++num_canceled; });
+
+    sel.cancel_timer(canceled);
+    assert(!canceled.is_scheduled());
+
+    auto start = std::chrono::steady_clock::now();
+
+    while (num_once == 0) {
+        sel.select(std::chrono::milliseconds(100));
+    }
+
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    assert(elapsed >= std::chrono::milliseconds(20));
+    assert(elapsed < std::chrono::milliseconds(100));
+    assert(num_once == 1);
+    assert(num_periodic >= 3);
+    assert(num_canceled == 0);
+    assert(!once.is_scheduled());
+    assert(periodic.is_scheduled());
+
+    sel.cancel_timer(periodic);
+}
+
+/*
+* An idle socket is reported with a timeout flag.
+*/
+void test_idle_timeout() {
+    Selector sel;
+
+    sel.start_server(TEST_PORT, nullptr);
+
+    auto client = sel.start_client("127.0.0.1", TEST_PORT, nullptr);
+    std::shared_ptr<Socket> peer;
+
+    while (!peer) {
+        sel.select(1);
+
+        for (auto& s : sel.ready()) {
+            if (s->is_acceptable()) {
+                peer = sel.accept(s, nullptr);
+            }
+        }
+    }
+
+    sel.set_idle_timeout(peer, std::chrono::milliseconds(30));
+
+    bool timed_out = false;
+    auto start = std::chrono::steady_clock::now();
+
+    while (!timed_out) {
+        sel.select(1);
+
+        for (auto& s : sel.ready()) {
+            if (s->is_idle_timeout()) {
+                assert(s == peer);
+
+                timed_out = true;
+            }
+        }
+    }
+
+    assert(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(30));
+    assert(std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+}
+
+struct LoopState : public SocketAttachment {
+    int num_accepted = 0;
+};
+
+/*
+* Connections are spread across the loops of a group.
+*/
+void test_event_loop_group() {
+    const int NUM_CLIENTS = 32;
+    EventLoopGroup group(4);
+    std::atomic<int> num_accepted{ 0 };
+
+    group.start(TEST_PORT, [&](EventLoop& loop) {
+        auto state = loop.get_state<LoopState>();
+
+        for (auto& s : loop.selector.ready()) {
+            if (s->is_acceptable()) {
+                loop.selector.accept(s, nullptr);
+
+                ++state->num_accepted;
+                ++num_accepted;
+            }
+        }
+    }, [](EventLoop& loop) {
+        loop.state = std::make_shared<LoopState>();
+    });
+
+    Selector sel;
+    std::vector<std::shared_ptr<Socket>> clients;
+
+    for (int i = 0; i < NUM_CLIENTS; ++i) {
+        clients.push_back(sel.start_client("127.0.0.1", TEST_PORT, nullptr));
+    }
+
+    for (int i = 0; i < 100 && num_accepted < NUM_CLIENTS; ++i) {
+        sel.select(std::chrono::milliseconds(10));
+    }
+
+    group.stop();
+    group.join();
+
+    assert(num_accepted == NUM_CLIENTS);
+
+    int num_busy_loops = 0;
+
+    for (size_t i = 0; i < group.size(); ++i) {
+        if (group.loop(i).get_state<LoopState>()->num_accepted > 0) {
+            ++num_busy_loops;
+        }
+    }
+
+#ifdef __linux__
+    assert(num_busy_loops > 1);
+#endif
+}
+
+/*
+* Tasks posted from other threads wake up a blocked select().
+*/
+void test_post() {
+    const int NUM_THREADS = 4;
+    const int NUM_TASKS = 1000;
+    Selector sel;
+    std::vector<std::thread> threads;
+    int num_run = 0;
+
+    for (int i = 0; i < NUM_THREADS; ++i) {
+        threads.emplace_back([&sel, &num_run]() {
+            for (int j = 0; j < NUM_TASKS; ++j) {
+                //Only the selector's thread touches num_run
+                sel.post([&num_run]() { ++num_run; });
+            }
+        });
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    while (num_run < NUM_THREADS * NUM_TASKS) {
+        //Wait indefinitely. Only the wakeups can end the wait.
+        sel.select(std::chrono::microseconds(-1));
+    }
+
+    assert(std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    //A wakeup without a task
+    std::thread waker([&sel]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+        sel.wakeup();
+    });
+
+    start = std::chrono::steady_clock::now();
+
+    assert(sel.select(std::chrono::seconds(5)) == 0);
+    assert(std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+
+    waker.join();
+}
+
+/*
+* All waiting clients are accepted in one go.
+*/
+void test_accept_all() {
+    const size_t NUM_CLIENTS = 20;
+    Selector sel;
+    std::vector<std::shared_ptr<Socket>> clients, peers;
+
+    auto server = sel.start_server(TEST_PORT, nullptr, 64);
+
+    //Don't accept until all the clients are connected
+    server->report_accpeptable(false);
+
+    for (size_t i = 0; i < NUM_CLIENTS; ++i) {
+        clients.push_back(sel.start_client("127.0.0.1", TEST_PORT, nullptr));
+    }
+
+    size_t num_connected = 0;
+
+    while (num_connected < NUM_CLIENTS) {
+        assert(sel.select(1) > 0);
+
+        for (auto& s : sel.ready()) {
+            assert(s->is_connection_success());
+
+            ++num_connected;
+        }
+    }
+
+    assert(sel.accept_all(server, peers, 5) == 5);
+    assert(sel.accept_all(server, peers) == NUM_CLIENTS - 5);
+    assert(peers.size() == NUM_CLIENTS);
+
+    //Nothing is left in the queue
+    assert(sel.accept_all(server, peers) == 0);
+
+    sel.select(std::chrono::microseconds(0));
+
+    assert(sel.sockets().size() == 1 + 2 * NUM_CLIENTS);
+}
+
+struct EchoHandler : public SocketHandler {
+    StaticByteBuffer<128> buff;
+
+    void on_accept(Selector& sel, const std::shared_ptr<Socket>& server) override {
+        auto peer = sel.accept(server, nullptr);
+
+        //Share the handler with the peer
+        peer->handler(server->handler());
+        peer->report_readable(true);
+    }
+
+    void on_readable(Selector& sel, const std::shared_ptr<Socket>& socket) override {
+        buff.clear();
+
+        if (socket->read(buff) < 0) {
+            sel.cancel_socket(socket);
+
+            return;
+        }
+
+        buff.flip();
+        socket->write(buff);
+    }
+};
+
+struct ClientHandler : public SocketHandler {
+    StaticByteBuffer<128> in_buff;
+    bool connected = false;
+    bool done = false;
+
+    void on_connected(Selector& /*sel*/, const std::shared_ptr<Socket>& socket) override {
+        StaticByteBuffer<128> out_buff;
+
+        connected = true;
+
+        out_buff.put("Hello Velar");
+        out_buff.flip();
+
+        assert(socket->write(out_buff) > 0);
+
+        socket->report_readable(true);
+    }
+
+    void on_readable(Selector& /*sel*/, const std::shared_ptr<Socket>& socket) override {
+        assert(socket->read(in_buff) > 0);
+
+        if (in_buff.position() == 11) {
+            done = true;
+        }
+    }
+
+    void on_error(Selector& /*sel*/, const std::shared_ptr<Socket>& /*socket*/) override {
+        assert(false);
+    }
+};
+
+/*
+* Events are delivered to the socket handlers.
+*/
+void test_dispatch() {
+    Selector sel;
+    auto client_handler = std::make_shared<ClientHandler>();
+
+    auto server = sel.start_server(TEST_PORT, nullptr);
+
+    server->handler(std::make_shared<EchoHandler>());
+
+    auto client = sel.start_client("127.0.0.1", TEST_PORT, nullptr);
+
+    client->handler(client_handler);
+
+    for (int i = 0; i < 100 && !client_handler->done; ++i) {
+        sel.select(1);
+
+        assert(sel.dispatch() > 0);
+    }
+
+    assert(client_handler->connected);
+    assert(client_handler->done);
+
+    client_handler->in_buff.flip();
+
+    assert(client_handler->in_buff.to_string_view() == "Hello Velar");
+}
+
+#ifdef VELAR_HAS_COROUTINES
+Task<> echo_session(Selector& sel, std::shared_ptr<Socket> peer) {
+    StaticByteBuffer<128> buff;
+
+    while (true) {
+        buff.clear();
+
+        if (co_await peer->async_read(buff) < 0) {
+            sel.cancel_socket(peer);
+
+            co_return;
+        }
+
+        buff.flip();
+
+        co_await peer->async_write(buff);
+    }
+}
+
+Task<> echo_server(Selector& sel, std::shared_ptr<Socket> server, int num_clients) {
+    for (int i = 0; i < num_clients; ++i) {
+        auto peer = co_await sel.async_accept(server);
+
+        sel.spawn(echo_session(sel, peer));
+    }
+}
+
+Task<std::string> echo_request(Selector& sel, std::string message) {
+    auto client = co_await sel.async_connect("127.0.0.1", TEST_PORT);
+    StaticByteBuffer<128> out_buff, in_buff;
+
+    out_buff.put(message.c_str());
+    out_buff.flip();
+
+    assert(co_await client->async_write(out_buff) == (int) message.size());
+
+    while (in_buff.position() < message.size()) {
+        assert(co_await client->async_read(in_buff) > 0);
+    }
+
+    sel.cancel_socket(client);
+
+    in_buff.flip();
+
+    co_return std::string(in_buff.to_string_view());
+}
+
+Task<> echo_client(Selector& sel, int& num_done) {
+    std::string reply = co_await echo_request(sel, "Hello Velar");
+
+    assert(reply == "Hello Velar");
+
+    ++num_done;
+}
+
+Task<> failed_client(Selector& sel, bool& failed) {
+    try {
+        //Nobody listens here
+        co_await sel.async_connect("127.0.0.1", TEST_PORT + 1);
+    }
+    catch (std::runtime_error&) {
+        failed = true;
+    }
+}
+#endif
+
+/*
+* Straight line protocol code with coroutines.
+*/
+void test_coroutines() {
+#ifdef VELAR_HAS_COROUTINES
+    const int NUM_CLIENTS = 5;
+    Selector sel;
+    int num_done = 0;
+    bool failed = false;
+
+    auto server = sel.start_server(TEST_PORT, nullptr);
+
+    sel.spawn(echo_server(sel, server, NUM_CLIENTS));
+
+    for (int i = 0; i < NUM_CLIENTS; ++i) {
+        sel.spawn(echo_client(sel, num_done));
+    }
+
+    sel.spawn(failed_client(sel, failed));
+
+    for (int i = 0; i < 100 && (num_done < NUM_CLIENTS || !failed); ++i) {
+        sel.select(1);
+    }
+
+    assert(num_done == NUM_CLIENTS);
+    assert(failed);
+
+    //The selector destroys the sessions that are still waiting
+#endif
+}
+
+/*
+* Returns true if the system can resolve "localhost". Not every
+* host has an entry for it.
+*/
+static bool has_localhost() {
+    struct addrinfo hints {}, * res{};
+
+    hints.ai_socktype = SOCK_STREAM;
+
+    bool found = ::getaddrinfo("localhost", NULL, &hints, &res) == 0;
+
+    if (res != NULL) {
+        ::freeaddrinfo(res);
+    }
+
+    return found;
+}
+
+/*
+* Host names are resolved without blocking the loop. "localhost" is
+* only used if the system can resolve it.
+*/
+void test_resolve() {
+    Selector sel;
+    StaticByteBuffer<128> buff;
+    bool use_localhost = has_localhost();
+    std::shared_ptr<Socket> client, canceled_client;
+    std::shared_ptr<DatagramClientSocket> udp_client;
+
+    sel.start_server(TEST_PORT, nullptr);
+    auto udp_server = sel.start_udp_server(TEST_PORT, nullptr);
+
+    udp_server->report_readable(true);
+
+    auto bad_client = sel.start_client("bad..name", TEST_PORT, nullptr);
+
+    if (use_localhost) {
+        client = sel.start_client("localhost", TEST_PORT, nullptr);
+        udp_client = sel.start_udp_client("localhost", TEST_PORT, nullptr);
+        canceled_client = sel.start_client("localhost", TEST_PORT, nullptr);
+
+        //Nothing can happen before the lookup is done
+        assert(client->is_connection_pending());
+        assert(udp_client->is_connection_pending());
+
+        sel.cancel_socket(canceled_client);
+    }
+
+    assert(bad_client->is_connection_pending());
+
+    bool connected = false, failed = false, received = false, accepted = false;
+    auto done = [&]() {
+        return failed && (!use_localhost || (connected && received && accepted));
+    };
+
+    for (int i = 0; i < 100 && !done(); ++i) {
+        sel.select(1);
+
+        for (auto& s : sel.ready()) {
+            if (s->is_acceptable()) {
+                sel.accept(s, nullptr);
+
+                accepted = true;
+            }
+            else if (s->is_connection_success()) {
+                if (s == client) {
+                    connected = true;
+                }
+                else {
+                    assert(s == udp_client);
+
+                    buff.clear();
+                    buff.put("Hello Velar");
+                    buff.flip();
+
+                    assert(udp_client->sendto(buff) > 0);
+                }
+            }
+            else if (s->is_connection_failed()) {
+                assert(s == bad_client);
+
+                failed = true;
+            }
+            else if (s->is_readable() && s == udp_server) {
+                buff.clear();
+
+                assert(s->recvfrom(buff, nullptr, nullptr) > 0);
+
+                received = true;
+            }
+        }
+    }
+
+    assert(done());
+
+    if (!use_localhost) {
+        //Only the servers
+        assert(sel.sockets().size() == 2);
+
+        return;
+    }
+
+    assert(!canceled_client->is_connection_success());
+
+    //Admit the accepted peer
+    sel.select(std::chrono::microseconds(0));
+
+    //Only the servers, the two clients and the accepted peer
+    assert(sel.sockets().size() == 5);
+}
+
+/*
+* Repeated lookups are answered from the cache. "bad..name" is not a valid
+* host name and fails the same way everywhere. "localhost" is only used
+* if the system can resolve it.
+*/
+void test_dns_cache() {
+    Selector sel;
+    int num_connected = 0, num_failed = 0;
+    bool use_localhost = has_localhost();
+    int per_round = use_localhost ? 2 : 1;
+
+    DnsCache::clear();
+
+    sel.start_server(TEST_PORT, nullptr);
+
+    for (int round = 0; round < 2; ++round) {
+        if (use_localhost) {
+            sel.start_client("localhost", TEST_PORT, nullptr);
+        }
+
+        sel.start_client("bad..name", TEST_PORT, nullptr);
+
+        for (int i = 0; i < 100 && num_connected + num_failed < per_round * (round + 1); ++i) {
+            sel.select(1);
+
+            for (auto& s : sel.ready()) {
+                if (s->is_acceptable()) {
+                    sel.accept(s, nullptr);
+                }
+                else if (s->is_connection_success()) {
+                    ++num_connected;
+                }
+                else if (s->is_connection_failed()) {
+                    ++num_failed;
+                }
+            }
+        }
+
+        assert(num_connected == (use_localhost ? round + 1 : 0));
+        assert(num_failed == round + 1);
+        //The address and the missing name
+        assert(DnsCache::size() == (size_t) per_round);
+    }
+
+    DnsCache::clear();
+
+    assert(DnsCache::size() == 0);
+}
+
+static struct addrinfo* numeric_address(const char* ip, int port) {
+    struct addrinfo hints {}, *res{};
+    std::string port_str = std::to_string(port);
+
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    hints.ai_socktype = SOCK_STREAM;
+
+    assert(::getaddrinfo(ip, port_str.c_str(), &hints, &res) == 0);
+
+    return res;
+}
+
+/*
+* The first address to answer wins.
+*/
+void test_connect_race() {
+    Selector sel;
+
+    sel.start_server(TEST_PORT, nullptr);
+
+    //An address that does not answer, one that refuses and one that works
+    struct addrinfo* silent = numeric_address("10.255.255.1", TEST_PORT);
+    struct addrinfo* refused = numeric_address("127.0.0.1", TEST_PORT + 1);
+    struct addrinfo* good = numeric_address("127.0.0.1", TEST_PORT);
+
+    silent->ai_next = refused;
+    refused->ai_next = good;
+
+    auto client = sel.start_client(silent, nullptr);
+
+    //The refused one alone
+    refused->ai_next = NULL;
+
+    auto bad_client = sel.start_client(refused, nullptr);
+
+    silent->ai_next = NULL;
+
+    ::freeaddrinfo(silent);
+    ::freeaddrinfo(refused);
+    ::freeaddrinfo(good);
+
+    bool connected = false, failed = false;
+    int num_accepted = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    while (!(connected && failed && num_accepted > 0)) {
+        assert(std::chrono::steady_clock::now() - start < std::chrono::seconds(2));
+
+        sel.select(1);
+
+        for (auto& s : sel.ready()) {
+            if (s->is_acceptable()) {
+                sel.accept(s, nullptr);
+
+                ++num_accepted;
+            }
+            else if (s->is_connection_success()) {
+                assert(s == client);
+
+                connected = true;
+            }
+            else if (s->is_connection_failed()) {
+                assert(s == bad_client);
+
+                failed = true;
+            }
+        }
+    }
+
+    //Let the losers be purged
+    sel.select(std::chrono::milliseconds(10));
+
+    assert(num_accepted == 1);
+    assert(client->fd() != INVALID_SOCKET);
+    //The server, the client and the accepted peer
+    assert(sel.sockets().size() == 3);
+}
+
+/*
+* Connections given back to the pool are handed out again
+* and the ones closed by the server are evicted.
+*/
+void test_connection_pool() {
+    Selector sel;
+    ConnectionPool pool(sel, 1);
+    std::vector<std::shared_ptr<Socket>> peers;
+
+    sel.start_server(TEST_PORT, nullptr);
+
+    auto wait_for_connection = [&](std::shared_ptr<Socket>& client, bool reused) {
+        bool connected = false;
+
+        for (int i = 0; i < 100 && !(connected && !peers.empty()); ++i) {
+            sel.select(1);
+
+            for (auto& s : sel.ready()) {
+                if (pool.handle_idle(s)) {
+                    continue;
+                }
+
+                if (s->is_acceptable()) {
+                    peers.push_back(sel.accept(s, nullptr));
+                }
+                else if (s->is_connection_success()) {
+                    assert(s == client);
+                    assert(s->is_connection_reused() == reused);
+
+                    connected = true;
+                }
+            }
+        }
+
+        assert(connected);
+    };
+
+    auto client = pool.acquire("127.0.0.1", TEST_PORT, nullptr);
+
+    wait_for_connection(client, false);
+
+    //Only one connection per host is allowed
+    assert(pool.acquire("127.0.0.1", TEST_PORT, nullptr) == nullptr);
+
+    pool.release(client);
+
+    assert(pool.idle_count() == 1);
+
+    //The same connection comes back and is reported as connected again
+    auto reused = pool.acquire("127.0.0.1", TEST_PORT, nullptr);
+
+    assert(reused == client);
+    assert(pool.idle_count() == 0);
+
+    //Reported without asking the kernel whether the connect has finished
+    assert(!reused->is_connection_pending());
+
+    wait_for_connection(reused, true);
+
+    assert(peers.size() == 1);
+
+    pool.release(reused);
+
+    //The server hangs up on the idle connection
+    sel.cancel_socket(peers[0]);
+    peers.clear();
+
+    for (int i = 0; i < 100 && pool.idle_count() > 0; ++i) {
+        sel.select(1);
+        sel.dispatch();
+    }
+
+    assert(pool.idle_count() == 0);
+
+    //A new connection is made
+    client = pool.acquire("127.0.0.1", TEST_PORT, nullptr);
+
+    assert(client != nullptr && client != reused);
+
+    wait_for_connection(client, false);
+
+    assert(peers.size() == 1);
+}
+
+/*
+* A header and a body are sent and received with one call
+* over TCP and UDP.
+*/
+void test_scatter_gather() {
+#ifdef VELAR_HAS_SPAN
+    Selector sel;
+    StaticByteBuffer<16> header;
+    StaticByteBuffer<128> body;
+    StaticByteBuffer<4> in_header;
+    StaticByteBuffer<128> in_body;
+    ByteBuffer* out[] = { &header, &body };
+    ByteBuffer* in[] = { &in_header, &in_body };
+
+    header.put("HEAD");
+    header.flip();
+    body.put("Hello Velar");
+    body.flip();
+
+    sel.start_server(TEST_PORT, nullptr);
+
+    auto client = sel.start_client("127.0.0.1", TEST_PORT, nullptr);
+
+    for (int i = 0; i < 100 && in_body.position() < body.limit(); ++i) {
+        sel.select(1);
+
+        for (auto& s : sel.ready()) {
+            if (s->is_acceptable()) {
+                auto peer = sel.accept(s, nullptr);
+
+                peer->report_readable(true);
+            }
+            else if (s->is_connection_success()) {
+                assert(s->write(out) == 15);
+            }
+            else if (s->is_readable()) {
+                assert(s->read(in) > 0);
+            }
+        }
+    }
+
+    //Both buffers are drained and the first one is filled before the second
+    assert(!header.has_remaining() && !body.has_remaining());
+    assert(!in_header.has_remaining());
+
+    in_header.flip();
+    in_body.flip();
+
+    assert(in_header.to_string_view() == "HEAD");
+    assert(in_body.to_string_view() == "Hello Velar");
+
+    auto udp_server = sel.start_udp_server(TEST_PORT + 2, nullptr);
+    auto udp_client = sel.start_udp_client("127.0.0.1", TEST_PORT + 2, nullptr);
+
+    header.rewind();
+    body.rewind();
+    in_header.clear();
+    in_body.clear();
+
+    assert(udp_client->sendto(out) == 15);
+
+    bool received = false;
+
+    for (int i = 0; i < 100 && !received; ++i) {
+        sel.select(1);
+
+        for (auto& s : sel.ready()) {
+            if (s == udp_server && s->is_readable()) {
+                struct sockaddr_storage from;
+                int from_len = sizeof(from);
+
+                assert(s->recvfrom(in, (sockaddr*) &from, &from_len) == 15);
+                assert(from_len > 0);
+
+                received = true;
+            }
+        }
+    }
+
+    assert(received);
+
+    in_header.flip();
+    in_body.flip();
+
+    assert(in_header.to_string_view() == "HEAD");
+    assert(in_body.to_string_view() == "Hello Velar");
+#endif
+}
+
+/*
+* Buffers of the same size class reuse the same memory.
+*/
+void test_buffer_pool() {
+    BufferPool::trim();
+
+    char* first = nullptr;
+
+    {
+        PooledByteBuffer b(1000);
+
+        assert(b.capacity() == 1000);
+        assert(((uintptr_t) b.array()) % BufferPool::CACHE_LINE == 0);
+
+        b.put("Hello Velar");
+        b.flip();
+
+        assert(b.to_string_view() == "Hello Velar");
+
+        first = b.array();
+    }
+
+    assert(BufferPool::cached_count() == 1);
+
+    {
+        //Same size class
+        PooledByteBuffer b(1024);
+
+        assert(b.array() == first);
+        assert(BufferPool::cached_count() == 0);
+    }
+
+    {
+        PooledByteBuffer b(1000, BufferPool::PAGE);
+
+        assert(((uintptr_t) b.array()) % BufferPool::PAGE == 0);
+    }
+
+    {
+        //Too large to be pooled
+        PooledByteBuffer b(4 * 1024 * 1024);
+    }
+
+    assert(BufferPool::cached_count() == 2);
+
+    {
+        //Heap buffers come from the pool too
+        HeapByteBuffer b(1000);
+
+        assert(b.array() == first);
+    }
+
+    {
+        auto lease = BufferPool::acquire(1000);
+
+        //Same block as the first buffer
+        assert(lease.data() == first);
+        assert(lease.size() == 1000);
+        assert(BufferPool::cached_count() == 1);
+
+        auto moved = std::move(lease);
+
+        assert(!lease);
+        assert(moved.data() == first);
+    }
+
+    assert(BufferPool::cached_count() == 2);
+
+    BufferPool::trim();
+
+    assert(BufferPool::cached_count() == 0);
+
+    /*
+    * The holder is created before the thread's free lists, so it is
+    * destroyed after them and frees its buffer when they are gone.
+    */
+    std::thread([]() {
+        static thread_local std::unique_ptr<HeapByteBuffer> holder;
+
+        holder = std::make_unique<HeapByteBuffer>(1000);
+    }).join();
+}
+
+/*
+* Partly read data is kept by compact() without copying. Data
+* written past the end of the memory shows up at the start.
+*/
+void test_ring_buffer() {
+    RingByteBuffer b(1000);
+    size_t capacity = b.capacity();
+    char expected = 0, next = 0;
+
+    //Fill and consume in uneven pieces so that the data wraps around many times
+    for (int round = 0; round < 50; ++round) {
+        while (b.remaining() > 7) {
+            b.put(next++);
+        }
+
+        b.flip();
+
+        size_t num_read = b.remaining() - 3;
+
+        for (size_t i = 0; i < num_read; ++i) {
+            char ch;
+
+            b.get(ch);
+
+            assert(ch == expected++);
+        }
+
+        const char* unread = b.array() + b.position();
+
+        b.compact();
+
+        //The unread bytes stay where they are, in one mapping or the other
+        assert(b.array() == unread || b.array() == unread - capacity);
+        assert(b.position() == 3);
+        assert(b.limit() == capacity);
+    }
+
+    b.flip();
+
+    for (size_t i = 0; i < 3; ++i) {
+        char ch;
+
+        b.get(ch);
+
+        assert(ch == expected++);
+    }
+
+    //Regular buffers copy the unread data
+    StaticByteBuffer<16> sb;
+
+    sb.put("Hello Velar");
+    sb.flip();
+    sb.position(6);
+    sb.compact();
+
+    assert(sb.position() == 5);
+    assert(sb.limit() == 16);
+
+    sb.flip();
+
+    assert(sb.to_string_view() == "Velar");
+}
+
+/*
+* A chained buffer grows one segment at a time and sends and
+* receives all its segments with one system call.
+*/
+void test_chained_buffer() {
+    ChainedByteBuffer b(64);
+    std::string message;
+
+    for (int i = 0; i < 1000; ++i) {
+        message += (char) ('a' + i % 26);
+    }
+
+    b.put(message);
+
+    assert(b.size() == 1000);
+    assert(b.segment_count() == 16);
+    assert(b.segment(0) == message.substr(0, 64));
+    assert(b.segment(15) == message.substr(960));
+
+    char head[100];
+
+    b.get(head, sizeof(head));
+
+    assert(std::string_view(head, sizeof(head)) == message.substr(0, 100));
+    //The first segment was fully read and went back to the pool
+    assert(b.segment_count() == 15);
+    assert(b.segment(0) == message.substr(100, 28));
+
+    Selector sel;
+    ChainedByteBuffer in(64);
+    size_t expected = b.size();
+
+    sel.start_server(TEST_PORT, nullptr);
+
+    auto client = sel.start_client("127.0.0.1", TEST_PORT, nullptr);
+
+    for (int i = 0; i < 100 && in.size() < expected; ++i) {
+        sel.select(1);
+
+        for (auto& s : sel.ready()) {
+            if (s->is_acceptable()) {
+                auto peer = sel.accept(s, nullptr);
+
+                peer->report_readable(true);
+            }
+            else if (s->is_connection_success()) {
+                while (!b.empty()) {
+                    assert(s->write(b) > 0);
+                }
+            }
+            else if (s->is_readable()) {
+                assert(s->read(in, 200) > 0);
+            }
+        }
+    }
+
+    assert(in.size() == expected);
+
+    std::string received;
+
+    for (size_t i = 0; i < in.segment_count(); ++i) {
+        received += in.segment(i);
+    }
+
+    assert(received == message.substr(100));
+
+    in.consume(in.size());
+
+    assert(in.empty() && in.segment_count() == 0);
+}
+
+/*
+* One payload is written to many sockets through cursors. The
+* payload is freed when the last cursor is destroyed.
+*/
+void test_shared_payload() {
+    Selector sel;
+    auto payload = std::make_shared<SharedPayload>("Hello Velar");
+    std::weak_ptr<SharedPayload> weak = payload;
+    std::vector<std::unique_ptr<PayloadCursor>> cursors;
+    const int NUM_CLIENTS = 5;
+    int num_connected = 0, num_received = 0;
+
+    sel.start_server(TEST_PORT, nullptr);
+
+    for (int i = 0; i < NUM_CLIENTS; ++i) {
+        sel.start_client("127.0.0.1", TEST_PORT, nullptr);
+    }
+
+    for (int i = 0; i < 100 && num_received < NUM_CLIENTS; ++i) {
+        sel.select(1);
+
+        for (auto& s : sel.ready()) {
+            if (s->is_acceptable()) {
+                auto peer = sel.accept(s, nullptr);
+                auto cursor = std::make_unique<PayloadCursor>(payload);
+
+                assert(cursor->array() == payload->data().data());
+                assert(peer->write(*cursor) == 11);
+
+                cursors.push_back(std::move(cursor));
+            }
+            else if (s->is_connection_success()) {
+                ++num_connected;
+
+                s->report_readable(true);
+            }
+            else if (s->is_readable()) {
+                StaticByteBuffer<32> in;
+
+                assert(s->read(in) == 11);
+
+                in.flip();
+
+                assert(in.to_string_view() == "Hello Velar");
+
+                ++num_received;
+            }
+        }
+    }
+
+    assert(num_connected == NUM_CLIENTS && num_received == NUM_CLIENTS);
+
+    {
+        //The shared payload can't be changed through a cursor or its views
+        PayloadCursor cursor(payload);
+        bool refused = false;
+
+        try {
+            cursor.slice().put('X');
+        }
+        catch (const std::runtime_error&) {
+            refused = true;
+        }
+
+        assert(refused && cursor.is_read_only());
+        assert(payload->data() == "Hello Velar");
+    }
+
+    payload.reset();
+
+    assert(!weak.expired());
+
+    cursors.clear();
+
+    assert(weak.expired());
+}
+
+/*
+* Data that the peer is too slow to take is queued and written by
+* select(). The watermarks report when the queue fills and drains.
+*/
+void test_write_queue() {
+    Selector sel;
+    std::shared_ptr<Socket> peer;
+    std::string message(32 * 1024 * 1024, 0);
+    std::string received;
+    bool drained = false;
+
+    for (size_t i = 0; i < message.size(); ++i) {
+        message[i] = (char) ('a' + i % 26);
+    }
+
+    sel.start_server(TEST_PORT, nullptr);
+
+    auto client = sel.start_client("127.0.0.1", TEST_PORT, nullptr);
+
+    for (int i = 0; i < 100 && !peer; ++i) {
+        sel.select(1);
+
+        for (auto& s : sel.ready()) {
+            if (s->is_acceptable()) {
+                peer = sel.accept(s, nullptr);
+            }
+        }
+    }
+
+    assert(peer);
+
+    peer->set_write_watermarks(1024, 1024 * 1024);
+
+    //Too much for the socket buffers. Most of it is queued.
+    int n = peer->send(message);
+
+    assert(n >= 0 && (size_t) n < message.size());
+    assert(peer->queued_bytes() == message.size() - n);
+    assert(peer->is_write_queue_full());
+
+    client->report_readable(true);
+
+    for (int i = 0; i < 1000 && received.size() < message.size(); ++i) {
+        sel.select(1);
+
+        for (auto& s : sel.ready()) {
+            //The queue's own writable events are not reported
+            assert(!s->is_writable());
+            assert(s != peer || s->is_write_queue_drained());
+
+            if (s->is_write_queue_drained()) {
+                assert(s == peer && !peer->is_write_queue_full());
+
+                drained = true;
+            }
+            if (s->is_readable()) {
+                StaticByteBuffer<65536> in;
+
+                while (s->read(in) > 0) {
+                    in.flip();
+                    received += in.to_string_view();
+                    in.clear();
+                }
+            }
+        }
+    }
+
+    assert(drained);
+    assert(received == message);
+    assert(peer->queued_bytes() == 0);
+    assert(!peer->is_report_writable());
+}
+
+/*
+* drain() reads until the socket would block and reports
+* a closed connection in the same call.
+*/
+void test_drain() {
+    Selector sel;
+    std::shared_ptr<Socket> peer;
+    std::string message(256 * 1024, 0);
+    std::string received;
+    ChainedByteBuffer chained;
+    bool closed = false;
+
+    for (size_t i = 0; i < message.size(); ++i) {
+        message[i] = (char) ('a' + i % 26);
+    }
+
+    sel.start_server(TEST_PORT, nullptr);
+
+    auto client = sel.start_client("127.0.0.1", TEST_PORT, nullptr);
+
+    for (int i = 0; i < 100 && !peer; ++i) {
+        sel.select(1);
+
+        for (auto& s : sel.ready()) {
+            if (s->is_acceptable()) {
+                peer = sel.accept(s, nullptr);
+            }
+        }
+    }
+
+    assert(peer);
+    assert(client->send(message) >= 0);
+
+    peer->report_readable(true);
+
+    StaticByteBuffer<1000> in;
+    int num_events = 0;
+
+    for (int i = 0; i < 1000 && received.size() + in.position() < message.size(); ++i) {
+        sel.select(1);
+
+        if (!peer->is_readable()) {
+            continue;
+        }
+
+        ++num_events;
+
+        auto result = peer->drain(in, 64 * 1024, [&](ByteBuffer& b) {
+            //Leave a partial record behind
+            size_t n = b.remaining() - b.remaining() % 7;
+            std::string_view sv;
+
+            if (n > 0) {
+                b.get(sv, n);
+                received += sv;
+            }
+        });
+
+        assert(!result.closed);
+        assert(result.bytes_read <= 64 * 1024);
+    }
+
+    in.flip();
+    received += in.to_string_view();
+
+    assert(received == message);
+    //Far fewer events than the number of times the buffer was filled
+    assert(num_events < (int) (message.size() / in.capacity()));
+
+    //The peer sends data and closes the connection
+    assert(peer->send("Goodbye") == 7);
+
+    sel.cancel_socket(peer);
+    peer.reset();
+
+    client->report_readable(true);
+
+    for (int i = 0; i < 100 && !closed; ++i) {
+        sel.select(1);
+
+        if (client->is_readable()) {
+            auto result = client->drain(chained);
+
+            closed = result.closed;
+        }
+    }
+
+    assert(closed);
+    assert(chained.size() == 7 && chained.segment(0) == "Goodbye");
+}
+
+/*
+* An edge triggered socket is not reported again while the application
+* leaves data unread, except when drain() stopped at its budget.
+*/
+void test_edge_triggered() {
+    Selector sel;
+    std::shared_ptr<Socket> peer;
+    std::string message(10000, 'x');
+    auto wait = std::chrono::milliseconds(50);
+
+    sel.start_server(TEST_PORT, nullptr);
+
+    auto client = sel.start_client("127.0.0.1", TEST_PORT, nullptr);
+
+    for (int i = 0; i < 100 && !peer; ++i) {
+        sel.select(1);
+
+        for (auto& s : sel.ready()) {
+            if (s->is_acceptable()) {
+                peer = sel.accept(s, nullptr);
+            }
+        }
+    }
+
+    assert(peer);
+
+    peer->set_edge_triggered(true);
+    peer->report_readable(true);
+
+    assert(client->send(message) == (int) message.size());
+
+    for (int i = 0; i < 100 && !peer->is_readable(); ++i) {
+        sel.select(wait);
+    }
+
+    assert(peer->is_readable());
+
+    //Read a little and back off
+    StaticByteBuffer<100> small;
+
+    assert(peer->read(small) == 100);
+
+#ifdef VELAR_USE_EPOLL
+    sel.select(wait);
+
+    assert(!peer->is_readable());
+#endif
+
+    peer->rearm();
+    sel.select(wait);
+
+    assert(peer->is_readable());
+
+    //Stopping at the budget reports the socket again right away
+    HeapByteBuffer in(message.size());
+    auto result = peer->drain(in, 1000);
+
+    assert(result.more && result.bytes_read == 1000);
+
+    sel.select(wait);
+
+    assert(peer->is_readable());
+
+    result = peer->drain(in);
+
+    assert(!result.more && !result.closed);
+    assert(in.position() == message.size() - 100);
+
+    sel.select(wait);
+
+    assert(!peer->is_readable());
+}
+
+/*
+* A file is sent from an offset in several steps as the
+* socket becomes writable.
+*/
+void test_transfer_from() {
+    const char* file_name = "__transfer.dat";
+    std::string content(8 * 1024 * 1024, 0);
+
+    for (size_t i = 0; i < content.size(); ++i) {
+        content[i] = (char) ('a' + i % 26);
+    }
+
+    {
+        MappedByteBuffer file{ file_name, false, content.size() };
+
+        file.put(content);
+    }
+
+    Selector sel;
+    FileRegion region(file_name, 10);
+    std::string received;
+
+    assert(region.remaining() == content.size() - 10);
+
+    sel.start_server(TEST_PORT, nullptr);
+
+    auto client = sel.start_client("127.0.0.1", TEST_PORT, nullptr);
+
+    for (int i = 0; i < 1000 && received.size() < content.size() - 10; ++i) {
+        sel.select(1);
+
+        for (auto& s : sel.ready()) {
+            if (s->is_acceptable()) {
+                auto peer = sel.accept(s, nullptr);
+
+                peer->report_writable(true);
+            }
+            else if (s->is_connection_success()) {
+                s->report_readable(true);
+            }
+            else if (s->is_writable()) {
+                assert(s->transfer_from(region) >= 0);
+
+                if (!region.has_remaining()) {
+                    s->report_writable(false);
+                }
+            }
+            else if (s->is_readable()) {
+                StaticByteBuffer<65536> in;
+
+                while (s->read(in) > 0) {
+                    in.flip();
+                    received += in.to_string_view();
+                    in.clear();
+                }
+            }
+        }
+    }
+
+    assert(region.offset() == content.size());
+    assert(received == content.substr(10));
+
+    FileRegion shrunk(file_name), rest(file_name, 0, 16);
+
+    //The file becomes shorter than the region
+    ::fclose(::fopen(file_name, "w"));
+
+    assert(client->transfer_from(shrunk) == -1);
+
+    //Queued data must go out first
+    client->send(std::string(32 * 1024 * 1024, 'x'));
+
+    assert(client->queued_bytes() > 0);
+
+    bool thrown = false;
+
+    try {
+        client->transfer_from(rest);
+    }
+    catch (std::runtime_error&) {
+        thrown = true;
+    }
+
+    assert(thrown);
+
+    ::remove(file_name);
+}
+
+/*
+* A client talks to a backend server through a relay. The end of the
+* client's data is passed on to the backend, which answers and closes.
+*/
+void test_relay() {
+    Selector sel;
+    std::string request(4 * 1024 * 1024, 0), received_request, received_response;
+    std::shared_ptr<Socket> backend_peer, relay_peer, backend_client;
+    bool sent = false, shut_down = false, relay_closed = false, client_eof = false, relay_started = false;
+
+    for (size_t i = 0; i < request.size(); ++i) {
+        request[i] = (char) ('a' + i % 26);
+    }
+
+    auto backend = sel.start_server(TEST_PORT, nullptr);
+    auto relay_server = sel.start_server(TEST_PORT + 1, nullptr);
+    auto client = sel.start_client("127.0.0.1", TEST_PORT + 1, nullptr);
+
+    for (int i = 0; i < 1000 && !(relay_closed && client_eof); ++i) {
+        sel.select(1);
+
+        for (auto& s : sel.ready()) {
+            //The relay's own events are not reported
+            assert(!relay_started || (s != relay_peer && s != backend_client));
+
+            if (s == backend) {
+                backend_peer = sel.accept(s, nullptr);
+                backend_peer->report_readable(true);
+            }
+            else if (s == relay_server) {
+                relay_peer = sel.accept(s, nullptr);
+                backend_client = sel.start_client("127.0.0.1", TEST_PORT, nullptr);
+
+                //Not connected yet
+                bool thrown = false;
+
+                try {
+                    sel.start_relay(relay_peer, backend_client);
+                }
+                catch (std::invalid_argument&) {
+                    thrown = true;
+                }
+
+                assert(thrown);
+            }
+            else if (s == backend_client && s->is_connection_success()) {
+                sel.start_relay(relay_peer, backend_client, [&]() {
+                    //Let the canceled sockets close
+                    relay_peer.reset();
+                    backend_client.reset();
+
+                    relay_closed = true;
+                });
+
+                relay_started = true;
+
+                //The client may send now
+                client->report_writable(true);
+            }
+            else if (s == client && s->is_connection_success()) {
+                s->report_readable(true);
+            }
+            else if (s == client && s->is_writable()) {
+                s->report_writable(false);
+
+                assert(s->send(request) >= 0);
+
+                sent = true;
+            }
+            else if (s == backend_peer && s->is_readable()) {
+                StaticByteBuffer<65536> in;
+                int n;
+
+                while ((n = s->read(in)) > 0) {
+                    in.flip();
+                    received_request += in.to_string_view();
+                    in.clear();
+                }
+
+                if (n < 0) {
+                    //The end of the client's data has come through the relay
+                    assert(s->send("DONE") == 4);
+
+                    sel.cancel_socket(s);
+                    backend_peer.reset();
+                }
+            }
+            else if (s == client && s->is_readable()) {
+                StaticByteBuffer<128> in;
+
+                if (s->read(in) < 0) {
+                    client_eof = true;
+                }
+
+                in.flip();
+                received_response += in.to_string_view();
+            }
+        }
+
+        //Once all the data is out, tell the other side that no more is coming
+        if (sent && !shut_down && client->queued_bytes() == 0) {
+#ifdef _WIN32
+            ::shutdown(client->fd(), SD_SEND);
+#else
+            ::shutdown(client->fd(), SHUT_WR);
+#endif
+
+            shut_down = true;
+        }
+    }
+
+    assert(received_request == request);
+    assert(received_response == "DONE");
+    assert(client_eof && relay_closed);
+}
+
+int main()
+{
+    test_echo();
+    test_many_sockets();
+    test_cancel();
+    test_ready();
+    test_io_uring(false);
+    test_io_uring(true);
+    test_timers();
+    test_idle_timeout();
+    test_event_loop_group();
+    test_post();
+    test_accept_all();
+    test_dispatch();
+    test_coroutines();
+    test_resolve();
+    test_dns_cache();
+    test_connect_race();
+    test_connection_pool();
+    test_scatter_gather();
+    test_buffer_pool();
+    test_ring_buffer();
+    test_chained_buffer();
+    test_shared_payload();
+    test_write_queue();
+    test_drain();
+    test_edge_triggered();
+    test_transfer_from();
+    test_relay();
+
+    return 0;
+}
@@ -1,4 +1,13 @@
 #include <iostream>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <string>
+#include <map>
+#include <tuple>
+#include <new>
+#include <cctype>
 #include "velar.h"
 
 #ifdef _WIN32
@@ -28,11 +37,31 @@ static WSInit __wsa_init;
 #include <arpa/inet.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#endif
+
+#ifdef VELAR_USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <signal.h>
 #endif
 
 ByteBuffer::~ByteBuffer() {}
 
 void ByteBuffer::put(const char* from, size_t offset, size_t length) {
+    if (m_read_only) {
+        throw std::runtime_error("Buffer is read only.");
+    }
+
     if (length > remaining()) {
         throw std::out_of_range("Insufficient space remaining.");
     }
@@ -47,6 +76,10 @@ void ByteBuffer::put(std::string_view sv) {
 }
 
 void ByteBuffer::put(char ch) {
+    if (m_read_only) {
+        throw std::runtime_error("Buffer is read only.");
+    }
+
     if (!has_remaining()) {
         throw std::out_of_range("Insufficient space remaining.");
     }
@@ -172,13 +205,28 @@ void ByteBuffer::get(uint64_t& i) {
 #endif
 }
 
-HeapByteBuffer::HeapByteBuffer(size_t sz) {
-    m_array = (char*) ::malloc(sz);
+void ByteBuffer::compact() {
+    if (m_read_only) {
+        throw std::runtime_error("Buffer is read only.");
+    }
 
-    if (m_array == NULL) {
-        throw std::runtime_error("malloc() failed.");
+    size_t unread = remaining();
+
+    if (unread > 0 && m_position > 0) {
+        ::memmove(m_array, m_array + m_position, unread);
     }
 
+    m_position = unread;
+    m_limit = m_capacity;
+}
+
+/*
+* The memory comes from the BufferPool, so the buffers that are created
+* for every connection or message are recycled. BufferPool::allocate()
+* throws std::bad_alloc if there is no memory.
+*/
+HeapByteBuffer::HeapByteBuffer(size_t sz) {
+    m_array = BufferPool::allocate(sz);
     m_capacity = sz;
     m_position = 0;
     m_limit = sz;
@@ -186,12 +234,314 @@ HeapByteBuffer::HeapByteBuffer(size_t sz) {
 
 HeapByteBuffer::~HeapByteBuffer() {
     if (m_array != NULL) {
-        ::free(m_array);
+        BufferPool::deallocate(m_array, m_capacity);
+
+        m_array = NULL;
+    }
+}
+
+/*
+* Blocks are grouped in power of two size classes, each with a list for
+* cache line aligned and one for page aligned blocks. A list keeps at most
+* BUFFER_CACHE_BYTES worth of blocks, but no fewer than two and no more
+* than BUFFER_CACHE_LIMIT. Buffers and coroutine frames share the lists.
+*/
+static const size_t MIN_BUFFER_SHIFT = 6;
+static const size_t BUFFER_SIZE_CLASSES = 15;
+static const size_t BUFFER_CACHE_BYTES = 1024 * 1024;
+static const size_t BUFFER_CACHE_LIMIT = 256;
+
+/*
+* Blocks can be freed by destructors that run after the free lists of the
+* thread are gone. The flag is kept outside the lists since a destroyed
+* object can't be looked at. Being trivially destructible it stays valid
+* until the thread has ended.
+*/
+static thread_local bool buffer_free_lists_alive = true;
+
+struct BufferFreeLists {
+    //Indexed by [page aligned][size class]
+    std::vector<char*> m_lists[2][BUFFER_SIZE_CLASSES];
+
+    ~BufferFreeLists() {
+        BufferPool::trim();
+
+        buffer_free_lists_alive = false;
+    }
+};
+
+static thread_local BufferFreeLists buffer_free_lists;
+
+/*
+* Returns the size class of a block or BUFFER_SIZE_CLASSES if the
+* block is too large to be pooled.
+*/
+static size_t buffer_size_class(size_t size) {
+    size_t size_class = 0;
+
+    while (size_class < BUFFER_SIZE_CLASSES && ((size_t) 1 << (size_class + MIN_BUFFER_SHIFT)) < size) {
+        ++size_class;
+    }
+
+    return size_class;
+}
+
+/*
+* Pooled blocks are either cache line or page aligned. The alignment of
+* blocks that are not pooled is the one asked for.
+*/
+static size_t buffer_block_alignment(size_t size_class, size_t alignment) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        throw std::invalid_argument("Alignment must be a power of two.");
+    }
+
+    if (size_class == BUFFER_SIZE_CLASSES || alignment > BufferPool::PAGE) {
+        return std::max(alignment, BufferPool::CACHE_LINE);
+    }
+
+    return alignment > BufferPool::CACHE_LINE ? BufferPool::PAGE : BufferPool::CACHE_LINE;
+}
+
+char* BufferPool::allocate(size_t size, size_t alignment) {
+    size_t size_class = buffer_size_class(size);
+    size_t block_alignment = buffer_block_alignment(size_class, alignment);
+
+    if (size_class == BUFFER_SIZE_CLASSES || block_alignment > PAGE) {
+        return (char*) ::operator new(std::max(size, (size_t) 1), std::align_val_t(block_alignment));
+    }
+
+    if (buffer_free_lists_alive) {
+        auto& list = buffer_free_lists.m_lists[block_alignment == PAGE][size_class];
+
+        if (!list.empty()) {
+            char* p = list.back();
+
+            list.pop_back();
+
+            return p;
+        }
+    }
+
+    return (char*) ::operator new((size_t) 1 << (size_class + MIN_BUFFER_SHIFT), std::align_val_t(block_alignment));
+}
+
+void BufferPool::deallocate(char* p, size_t size, size_t alignment) {
+    size_t size_class = buffer_size_class(size);
+    size_t block_alignment = buffer_block_alignment(size_class, alignment);
+
+    if (size_class == BUFFER_SIZE_CLASSES || block_alignment > PAGE || !buffer_free_lists_alive) {
+        ::operator delete(p, std::align_val_t(block_alignment));
+
+        return;
+    }
+
+    size_t block_size = (size_t) 1 << (size_class + MIN_BUFFER_SHIFT);
+    size_t limit = std::clamp(BUFFER_CACHE_BYTES / block_size, (size_t) 2, BUFFER_CACHE_LIMIT);
+    auto& list = buffer_free_lists.m_lists[block_alignment == PAGE][size_class];
+
+    if (list.size() >= limit) {
+        ::operator delete(p, std::align_val_t(block_alignment));
+    }
+    else {
+        list.push_back(p);
+    }
+}
+
+void BufferPool::trim() {
+    if (!buffer_free_lists_alive) {
+        return;
+    }
+
+    for (size_t a = 0; a < 2; ++a) {
+        for (auto& list : buffer_free_lists.m_lists[a]) {
+            for (char* p : list) {
+                ::operator delete(p, std::align_val_t(a ? PAGE : CACHE_LINE));
+            }
+
+            list.clear();
+        }
+    }
+}
+
+BufferPool::Lease BufferPool::acquire(size_t size, size_t alignment) {
+    return Lease(allocate(size, alignment), size, alignment);
+}
+
+size_t BufferPool::cached_count() {
+    size_t count = 0;
+
+    if (!buffer_free_lists_alive) {
+        return count;
+    }
+
+    for (auto& lists : buffer_free_lists.m_lists) {
+        for (auto& list : lists) {
+            count += list.size();
+        }
+    }
+
+    return count;
+}
+
+PooledByteBuffer::PooledByteBuffer(size_t sz, size_t alignment) : m_alignment(alignment) {
+    m_array = BufferPool::allocate(sz, alignment);
+    m_capacity = sz;
+    m_position = 0;
+    m_limit = sz;
+}
+
+PooledByteBuffer::~PooledByteBuffer() {
+    if (m_array != NULL) {
+        BufferPool::deallocate(m_array, m_capacity, m_alignment);
 
         m_array = NULL;
     }
 }
 
+SharedPayload::SharedPayload(std::string_view data) : m_size(data.size()) {
+    m_data = BufferPool::allocate(m_size);
+
+    ::memcpy(m_data, data.data(), m_size);
+}
+
+/*
+* The last owner may be in any thread. The pool allows that.
+*/
+SharedPayload::~SharedPayload() {
+    BufferPool::deallocate(m_data, m_size);
+}
+
+/*
+* The array is not const, but the cursor is read only, so
+* nothing can write to the payload through it.
+*/
+PayloadCursor::PayloadCursor(std::shared_ptr<const SharedPayload> payload) : m_payload(std::move(payload)) {
+    if (!m_payload) {
+        throw std::invalid_argument("Payload is null.");
+    }
+
+    m_array = const_cast<char*>(m_payload->data().data());
+    m_capacity = m_payload->size();
+    m_limit = m_capacity;
+    m_position = 0;
+    m_read_only = true;
+}
+
+void PayloadCursor::compact() {
+    throw std::runtime_error("Buffer is read only.");
+}
+
+/*
+* Every segment in the chain holds some data. All but the last one are
+* full. Data is added to the last segment and read from the first one.
+*/
+ChainedByteBuffer::ChainedByteBuffer(size_t segment_size) : m_segment_size(segment_size) {
+    if (segment_size == 0) {
+        throw std::invalid_argument("Segment size must not be zero.");
+    }
+}
+
+ChainedByteBuffer::~ChainedByteBuffer() {
+    clear();
+}
+
+void ChainedByteBuffer::add_segment() {
+    m_segments.push_back({ BufferPool::allocate(m_segment_size), 0, 0 });
+}
+
+void ChainedByteBuffer::put(const char* from, size_t length) {
+    while (length > 0) {
+        if (m_segments.empty() || m_segments.back().end == m_segment_size) {
+            add_segment();
+        }
+
+        auto& last = m_segments.back();
+        size_t n = std::min(length, m_segment_size - last.end);
+
+        ::memcpy(last.data + last.end, from, n);
+
+        last.end += n;
+        m_size += n;
+        from += n;
+        length -= n;
+    }
+}
+
+void ChainedByteBuffer::put(std::string_view sv) {
+    put(sv.data(), sv.length());
+}
+
+void ChainedByteBuffer::put(char ch) {
+    put(&ch, 1);
+}
+
+void ChainedByteBuffer::get(char* to, size_t length) {
+    if (m_size < length) {
+        throw std::out_of_range("Insufficient data remaining.");
+    }
+
+    size_t copied = 0;
+
+    for (auto& seg : m_segments) {
+        if (copied == length) {
+            break;
+        }
+
+        size_t n = std::min(length - copied, seg.end - seg.begin);
+
+        ::memcpy(to + copied, seg.data + seg.begin, n);
+
+        copied += n;
+    }
+
+    consume(length);
+}
+
+void ChainedByteBuffer::consume(size_t length) {
+    if (m_size < length) {
+        throw std::out_of_range("Insufficient data remaining.");
+    }
+
+    m_size -= length;
+
+    while (length > 0) {
+        auto& first = m_segments.front();
+        size_t n = std::min(length, first.end - first.begin);
+
+        first.begin += n;
+        length -= n;
+
+        if (first.begin == first.end) {
+            BufferPool::deallocate(first.data, m_segment_size);
+
+            m_segments.pop_front();
+        }
+    }
+}
+
+void ChainedByteBuffer::clear() {
+    for (auto& seg : m_segments) {
+        BufferPool::deallocate(seg.data, m_segment_size);
+    }
+
+    m_segments.clear();
+    m_size = 0;
+}
+
+size_t ChainedByteBuffer::segment_count() {
+    return m_segments.size();
+}
+
+std::string_view ChainedByteBuffer::segment(size_t index) {
+    if (index >= m_segments.size()) {
+        throw std::out_of_range("No such segment.");
+    }
+
+    auto& seg = m_segments[index];
+
+    return std::string_view(seg.data + seg.begin, seg.end - seg.begin);
+}
+
 WrappedByteBuffer::WrappedByteBuffer(char* data, size_t length) {
     m_array = data;
     m_capacity = length;
@@ -199,6 +549,33 @@ WrappedByteBuffer::WrappedByteBuffer(char* data, size_t length) {
     m_position = 0;
 }
 
+WrappedByteBuffer::WrappedByteBuffer(char* data, size_t length, size_t limit, size_t position, bool read_only) : WrappedByteBuffer(data, length) {
+    this->limit(limit);
+    this->position(position);
+
+    m_read_only = read_only;
+}
+
+/*
+* Views are returned by value. That works even though buffers can't be
+* copied or moved because the object is constructed in place.
+*/
+WrappedByteBuffer ByteBuffer::slice() {
+    return WrappedByteBuffer(m_array + m_position, remaining(), remaining(), 0, m_read_only);
+}
+
+WrappedByteBuffer ByteBuffer::slice(size_t offset, size_t length) {
+    if (offset > m_capacity || length > m_capacity - offset) {
+        throw std::out_of_range("Slice is outside the buffer.");
+    }
+
+    return WrappedByteBuffer(m_array + offset, length, length, 0, m_read_only);
+}
+
+WrappedByteBuffer ByteBuffer::duplicate() {
+    return WrappedByteBuffer(m_array, m_capacity, m_limit, m_position, m_read_only);
+}
+
 MappedByteBuffer::MappedByteBuffer(const char* file_name, bool read_only, size_t max_size) {
 #ifdef _WIN32
     file_handle = ::CreateFileA(
@@ -358,631 +735,4936 @@ void MappedByteBuffer::cleanup() {
 #endif
 }
 
+/*
+* The memory of a ring buffer is mapped twice, back to back. A byte at
+* offset i can be reached at both m_base + i and m_base + i + capacity. The
+* window the ByteBuffer methods work on starts anywhere in the first
+* mapping and may run into the second one without wrapping.
+*/
+RingByteBuffer::RingByteBuffer(size_t sz) {
+    if (sz == 0) {
+        throw std::invalid_argument("Size must not be zero.");
+    }
 
-static void set_nonblocking(SOCKET socket) {
 #ifdef _WIN32
-    u_long non_block = 1;
+    SYSTEM_INFO info;
 
-    int status = ::ioctlsocket(socket, FIONBIO, &non_block);
+    ::GetSystemInfo(&info);
 
-    if (status != NO_ERROR) {
-        throw std::runtime_error("Failed to make socket non-blocking.");
-    }
+    //Views must start at a multiple of the allocation granularity
+    size_t granularity = info.dwAllocationGranularity;
 #else
-    int status = ::fcntl(socket, F_SETFL, O_NONBLOCK);
-
-    if (status < 0) {
-        throw std::runtime_error("Failed to make socket non-blocking.");
-    }
+    size_t granularity = (size_t) ::sysconf(_SC_PAGESIZE);
 #endif
-}
 
-static void check_socket_error(int status, const char* msg) {
+    size_t size = (sz + granularity - 1) / granularity * granularity;
+
 #ifdef _WIN32
-    if (status == SOCKET_ERROR) {
-        throw std::runtime_error(msg);
-    }
-#else
-    if (status < 0) {
-        ::perror(msg);
+    map_handle = ::CreateFileMappingA(
+        INVALID_HANDLE_VALUE,
+        NULL,
+        PAGE_READWRITE,
+        (DWORD) ((uint64_t) size >> 32),
+        (DWORD) size,
+        NULL);
 
-        throw std::runtime_error(msg);
+    if (map_handle == NULL) {
+        throw std::system_error(::GetLastError(), std::system_category(), "CreateFileMappingA failed.");
     }
-#endif
-}
 
-void free_addrinfo(struct addrinfo* p) {
-    if (p != NULL) {
-        freeaddrinfo(p);
-    }
-}
+    /*
+    * Find a free address range for both views. Another thread may map
+    * something there before we do, so try a few times.
+    */
+    for (int attempt = 0; attempt < 16 && m_base == NULL; ++attempt) {
+        char* addr = (char*) ::VirtualAlloc(NULL, 2 * size, MEM_RESERVE, PAGE_NOACCESS);
 
-/*
-* Creates a UDP socket. The socket remembers the given server address and port.
-* Any subsequent call to sendto() will use this address. The address of the server
-* can be a hostname, ipv4 or ipv6 address.
-* 
-* After the first call to sendto() a UDP socket gets bound to the server's address and port.
-* Which means, if you call recvfrom() after that the data is read from the server.
-* 
-* Once you no longer need to communicate with the server cancel the socket.
-*/
-std::shared_ptr<DatagramClientSocket> Selector::start_udp_client(const char* address, int port, std::shared_ptr<SocketAttachment> attachment) {
-    char port_str[128];
+        if (addr == NULL) {
+            break;
+        }
 
-    snprintf(port_str, sizeof(port_str), "%d", port);
+        ::VirtualFree(addr, 0, MEM_RELEASE);
 
-    struct addrinfo hints {}, * res{};
+        char* first = (char*) ::MapViewOfFileEx(map_handle, FILE_MAP_ALL_ACCESS, 0, 0, size, addr);
 
-    /*
-    * We take a numeric port number and not a
-    * service name like "http" or "ftp" for port.
-    * This will tell getaddrinfo() not to do any
-    * service name resolution making it slightly faster.
-    */
-    hints.ai_flags = AI_NUMERICSERV;
-    /*
-    * This will cause getaddrinfo() to return both ipv4 and ipv6
-    * address if available.
-    */
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_DGRAM; //UDP
+        if (first == NULL) {
+            continue;
+        }
 
-    int status = ::getaddrinfo(address, port_str, &hints, &res);
+        char* second = (char*) ::MapViewOfFileEx(map_handle, FILE_MAP_ALL_ACCESS, 0, 0, size, addr + size);
 
-    /*
-    * getaddrinfo() is strange in a way since it may return a positive
-    * value in case of an error. Any non-zero value indicates an error.
-    */
-    if (status != 0 || res == NULL) {
-        throw std::runtime_error("Failed to resolve address.");
-    }
+        if (second == NULL) {
+            ::UnmapViewOfFile(first);
 
-    /*
-    * Creating the socket object here willmake sure res gets freed up
-    * no matter what happens.
-    */
-    auto client = std::make_shared<DatagramClientSocket>(res);
+            continue;
+        }
 
-    set_nonblocking(client->fd());
+        m_base = addr;
+    }
 
-    client->attachment(attachment);
+    if (m_base == NULL) {
+        cleanup();
 
-    m_sockets.insert(client);
+        throw std::runtime_error("Failed to map the ring buffer.");
+    }
+#else
+#ifdef __linux__
+    int fd = ::memfd_create("velar-ring", MFD_CLOEXEC);
+#else
+    //An unnamed shared memory object. The name is removed right away.
+    char name[64];
 
-    return client;
-}
+    snprintf(name, sizeof(name), "/velar-ring-%d-%p", (int) ::getpid(), (void*) this);
 
-/*
-* Creates a new TCP socket and connects it to a server listening at the given 
-* address and port. The address can be a host name, ipv4 or ipv6 IP address.
-* The attachment is set for the newly created client socket.
-* 
-* To disconnect from the server gracefully, cancel the client socket.
-*/
-std::shared_ptr<Socket> Selector::start_client(const char* address, int port, std::shared_ptr<SocketAttachment> attachment) {
-    char port_str[128];
+    int fd = ::shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
 
-    snprintf(port_str, sizeof(port_str), "%d", port);
+    if (fd >= 0) {
+        ::shm_unlink(name);
+    }
+#endif
 
-    struct addrinfo hints {}, *res{};
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "Failed to create shared memory");
+    }
 
-    /*
-    * We take a numeric port number and not a 
-    * service name like "http" or "ftp" for port.
-    * This will tell getaddrinfo() not to do any
-    * service name resolution making it slightly faster.
-    */
-    hints.ai_flags = AI_NUMERICSERV;
-    /*
-    * This will cause getaddrinfo() to return both ipv4 and ipv6
-    * address if available.
-    */
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
+    if (::ftruncate(fd, size) == -1) {
+        int err = errno;
 
-    int status = ::getaddrinfo(address, port_str, &hints, &res);
+        ::close(fd);
 
-    /*
-    * getaddrinfo() is strange in a way since it may return a positive 
-    * value in case of an error. Any non-zero value indicates an error.
-    */
-    if (status != 0 || res == NULL) {
-        throw std::runtime_error("Failed to resolve address.");
+        throw std::system_error(err, std::generic_category(), "ftruncate() failed");
     }
 
-    /*
-    * The addrinfo res object is a linked list. It has all
-    * resolved addresses. For example, it will have both ipv4 and ipv6
-    * addresses if available. We can iterate through the addresses using res->next.
-    * Below, we go with the first address in the list, which can be either ipv4 or ipv6.
-    * A more robust implementation will try the next address (res->next) if
-    * connect() fails.
-    */
+    //Reserve the address range and then map the memory over each half of it
+    char* addr = (char*) ::mmap(nullptr, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 
-    /*
-    * Use RAII to free the address. This makes the code below much simpler.
-    */
-    auto addr_resource = std::unique_ptr<struct addrinfo, void(*)(struct addrinfo*)>(res, free_addrinfo);
+    if (addr == MAP_FAILED) {
+        int err = errno;
 
-    auto client = std::make_shared<Socket>(res->ai_family, res->ai_socktype, res->ai_protocol);
+        ::close(fd);
 
-    client->attachment(attachment);
-    client->set_connection_pending(true);
+        throw std::system_error(err, std::generic_category(), "mmap() failed");
+    }
 
-    set_nonblocking(client->fd());
+    if (::mmap(addr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        ::mmap(addr + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        int err = errno;
 
-    status = ::connect(client->fd(), res->ai_addr, res->ai_addrlen);
+        ::munmap(addr, 2 * size);
+        ::close(fd);
 
-    /*
-    * It is normal for a nonblocking socket to not complete connection immediately.
-    * This is indicated by an error but we should not abort.
-    * 
-    * Checking for in progress connection differes between Winsock and BSD socket.
-    */
-    if (status < 0) {
-#ifdef _WIN32
-        auto err = ::WSAGetLastError();
+        throw std::system_error(err, std::generic_category(), "mmap() failed");
+    }
 
-        if (err != WSAEWOULDBLOCK) {
-            throw std::runtime_error("Failed to connect.");
-        }
-#else
-        if (errno != EINPROGRESS) {
-            throw std::runtime_error("Failed to connect.");
-        }
+    //The mappings keep the memory alive
+    ::close(fd);
+
+    m_base = addr;
 #endif
-    }
 
-    m_sockets.insert(client);
+    m_array = m_base;
+    m_capacity = size;
+    m_limit = size;
+    m_position = 0;
+}
 
-    return client;
+RingByteBuffer::~RingByteBuffer() {
+    cleanup();
 }
 
-/*
-* Starts a UDP server and makes it join a multicast group identified by the group's
-* IP address group_ip. The group's address can be any valid ipv4 or ipv6 IP address.
-*/
-std::shared_ptr<Socket> Selector::start_multicast_server(const char* group_ip, int port, std::shared_ptr<SocketAttachment> attachment) {
-    auto receiver = start_udp_server(port, attachment);
+void RingByteBuffer::cleanup() {
+#ifdef _WIN32
+    if (m_base != NULL) {
+        ::UnmapViewOfFile(m_base);
+        ::UnmapViewOfFile(m_base + m_capacity);
 
-    // Join the multicast group
-    struct ipv6_mreq mreq6 {};
-    struct ip_mreq mreq4 {};
+        m_base = NULL;
+    }
 
-    //Set the multicast group address
-    if (inet_pton(AF_INET6, group_ip, &mreq6.ipv6mr_multiaddr) == 1) {
-        mreq6.ipv6mr_interface = 0;
+    if (map_handle != NULL) {
+        ::CloseHandle(map_handle);
 
-        //Join the group
-        int status = ::setsockopt(receiver->fd(), IPPROTO_IPV6, IPV6_JOIN_GROUP, (const char*)&mreq6, sizeof(mreq6));
+        map_handle = NULL;
+    }
+#else
+    if (m_base != NULL) {
+        if (::munmap((void*) m_base, 2 * m_capacity) < 0) {
+            perror("munmap() failed");
+        }
 
-        check_socket_error(status, "Failed to join ipv6 multicast group.");
+        m_base = NULL;
     }
-    else if (inet_pton(AF_INET, group_ip, &mreq4.imr_multiaddr.s_addr) == 1) {
-        mreq4.imr_interface.s_addr = INADDR_ANY;
+#endif
 
-        //Join the group
-        int status = ::setsockopt(receiver->fd(), IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*)&mreq4, sizeof(mreq4));
+    m_array = NULL;
+}
 
-        check_socket_error(status, "Failed to join ipv4 multicast group.");
-    }
-    else {
-        throw std::runtime_error("The group IP address is not a valid ipv6 or ipv4 address.");
+/*
+* The unread data is already followed by free space in the mirror,
+* so only the start of the window moves.
+*/
+void RingByteBuffer::compact() {
+    size_t unread = remaining();
+
+    m_array += m_position;
+
+    if (m_array >= m_base + m_capacity) {
+        m_array -= m_capacity;
     }
 
-    return receiver;
+    m_position = unread;
+    m_limit = m_capacity;
 }
 
+#if defined(VELAR_USE_EPOLL) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+#define VELAR_HAS_EPOLL_PWAIT2
+#endif
+
+#ifdef VELAR_USE_IO_URING
 /*
-* Starts a UDP socket and binds to the given port. Clients should be able to
-* connect to it using either ipv4 or ipv6 address.
-* 
-* The socket's readbility event reporting is enabled by default. Which means,
-* the server can start accepting request messages from clients right away.
+* Size of the io_uring submission queue and the
+* registered file table.
 */
-std::shared_ptr<Socket> Selector::start_udp_server(int port, std::shared_ptr<SocketAttachment> attachment) {
-    // Create a UDP socket
-    auto receiver = std::make_shared<Socket>(AF_INET6, SOCK_DGRAM, 0);
+static const unsigned IO_URING_ENTRIES = 256;
+static const size_t IO_URING_FILE_SLOTS = 4096;
+#endif
 
-    receiver->attachment(attachment);
+/*
+* How long to wait for a connection attempt before starting
+* the next one. The value recommended by RFC 8305.
+*/
+static const std::chrono::milliseconds CONNECTION_ATTEMPT_DELAY{ 250 };
 
-    /*
-    * This will make the socket bind to both ipv6 and ipv4 address.
-    * This way, a client can connect using either ipv4 or ipv6 address.
-    */
-    int optval = 0;
+static void set_nonblocking(SOCKET socket) {
+#ifdef _WIN32
+    u_long non_block = 1;
 
-    int status = ::setsockopt(receiver->fd(), IPPROTO_IPV6, IPV6_V6ONLY, (char*)&optval, sizeof(optval));
+    int status = ::ioctlsocket(socket, FIONBIO, &non_block);
 
-    check_socket_error(status, "Failed to disable IPV6_V6ONLY.");
+    if (status != NO_ERROR) {
+        throw std::runtime_error("Failed to make socket non-blocking.");
+    }
+#else
+    int status = ::fcntl(socket, F_SETFL, O_NONBLOCK);
 
-    int reuse = 1;
+    if (status < 0) {
+        throw std::runtime_error("Failed to make socket non-blocking.");
+    }
+#endif
+}
 
-    status = ::setsockopt(receiver->fd(), SOL_SOCKET, SO_REUSEADDR, (const char*) & reuse, sizeof reuse);
-    
-    check_socket_error(status, "Failed to set SO_REUSEADDR.");
+static void check_socket_error(int status, const char* msg) {
+#ifdef _WIN32
+    if (status == SOCKET_ERROR) {
+        throw std::runtime_error(msg);
+    }
+#else
+    if (status < 0) {
+        ::perror(msg);
 
-#ifndef _WIN32
-    status = ::setsockopt(receiver->fd(), SOL_SOCKET, SO_REUSEPORT, (const char*) &reuse, sizeof reuse);
-    
-    check_socket_error(receiver->fd(), "Failed to set SO_REUSEPORT.");
+        throw std::runtime_error(msg);
+    }
 #endif
+}
 
-    // Bind the socket to the multicast port
-    struct sockaddr_in6 addr {};
+void free_addrinfo(struct addrinfo* p) {
+    if (p != NULL) {
+        freeaddrinfo(p);
+    }
+}
 
-    addr.sin6_family = AF_INET6;
-    addr.sin6_addr = in6addr_any;
-    addr.sin6_port = htons(port);
+/*
+* Resolves a numeric IP address without any name lookup. Returns NULL
+* if the address is a host name. This never blocks.
+*/
+static struct addrinfo* resolve_numeric(const char* address, int port, int socktype) {
+    char port_str[128];
 
-    status = ::bind(receiver->fd(), (const struct sockaddr*) &addr, sizeof(addr));
+    snprintf(port_str, sizeof(port_str), "%d", port);
 
-    check_socket_error(status, "Failed to bind to port.");
+    struct addrinfo hints {}, * res{};
 
-    //Turn this on since all receivers need to read
-    receiver->report_readable(true);
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = socktype;
 
-    m_sockets.insert(receiver);
+    if (::getaddrinfo(address, port_str, &hints, &res) != 0) {
+        return NULL;
+    }
 
-    return receiver;
+    return res;
 }
 
 /*
-* Starts a TCP socket and binds to the given port. Clients should be able to
-* connect to it using either ipv4 or ipv6 address.
+* A pool of threads that run getaddrinfo(). The results are handed back
+* to the selector that asked for them using Selector::post(). That way
+* a slow name lookup never holds up the event loop.
 *
-* The socket's readbility event reporting is enabled by default. Which means,
-* the server can start accepting clients right away.
-* 
-* To shutdown the server just cancel the server socket.
+* getaddrinfo() can not be interrupted. So the threads are detached and
+* the resolver is never destroyed. Otherwise exit() would have to wait
+* for a lookup that is stuck on an unresponsive name server.
 */
-std::shared_ptr<Socket> Selector::start_server(int port, std::shared_ptr<SocketAttachment> attachment) {
-    auto server = std::make_shared<Socket>(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+struct Resolver {
+    static const size_t MAX_THREADS = 4;
 
-    server->attachment(attachment);
+    std::mutex m_lock;
+    std::condition_variable m_cond;
+    std::deque<std::function<void()>> m_jobs;
+    size_t m_num_threads = 0;
+    size_t m_num_idle = 0;
 
-    set_nonblocking(server->fd());
+    static Resolver& instance() {
+        static Resolver* resolver = new Resolver();
 
-    int reuse = 1;
+        return *resolver;
+    }
 
-    int status = ::setsockopt(server->fd(), SOL_SOCKET, SO_REUSEADDR, (const char*) &reuse, sizeof reuse);
-    
-    check_socket_error(status, "Failed to set SO_REUSEADDR.");
+    void submit(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
 
-#ifndef _WIN32
-    status = ::setsockopt(server->fd(), SOL_SOCKET, SO_REUSEPORT, (const char*)&reuse, sizeof reuse);
+            m_jobs.push_back(std::move(job));
 
-    check_socket_error(status, "Failed to set SO_REUSEPORT.");
-#endif
+            //Threads are started as they are needed
+            if (m_num_threads < MAX_THREADS && m_jobs.size() > m_num_idle) {
+                std::thread([this]() { run(); }).detach();
 
-    /*
-    * This will allow IPV4 mapped addresses.
-    */
-    int optval = 0;
-    
-    status = ::setsockopt(server->fd(), IPPROTO_IPV6, IPV6_V6ONLY, (char*)&optval, sizeof(optval));
-    check_socket_error(status, "Failed to disable IPV6_V6ONLY.");
+                ++m_num_threads;
+            }
+        }
 
-    struct sockaddr_in6 addr {}; //Important to zero out the address
+        m_cond.notify_one();
+    }
 
-    addr.sin6_family = AF_INET6;
-    addr.sin6_addr = ::in6addr_any;
-    addr.sin6_port = htons(port);
+    void run() {
+        std::unique_lock<std::mutex> guard(m_lock);
 
-    status = ::bind(server->fd(), (struct sockaddr*) &addr, sizeof(addr));
+        while (true) {
+            ++m_num_idle;
 
-    check_socket_error(status, "Failed to bind to port.");
+            m_cond.wait(guard, [this]() { return !m_jobs.empty(); });
 
-    status = ::listen(server->fd(), 10);
+            --m_num_idle;
 
-    check_socket_error(status, "Failed to listen.");
+            auto job = std::move(m_jobs.front());
 
-    //Turn this on since all servers will need to catch accept event
-    server->report_accpeptable(true);
+            m_jobs.pop_front();
 
-    m_sockets.insert(server);
+            guard.unlock();
 
-    return server;
-}
+            job();
+
+            guard.lock();
+        }
+    }
+};
 
 /*
-* Accepts a client that has connected to the given server's socket.
-* A new client socket is created and the attachment is set for the client.
-* The selector begins monitoring the client socket for events until the client
-* socket is cancelled.
+* getaddrinfo() does not tell us the TTL of the DNS records. So the cache
+* keeps results for a fixed time that can be changed with DnsCache::set_ttl().
+* Names that do not exist are remembered for a shorter time.
 */
-std::shared_ptr<Socket> Selector::accept(std::shared_ptr<Socket> server, std::shared_ptr<SocketAttachment> attachment) {
-    SOCKET client_fd = ::accept(server->fd(), NULL, NULL);
+static const size_t DNS_CACHE_MAX_ENTRIES = 4096;
 
-    if (client_fd == INVALID_SOCKET) {
-        throw std::runtime_error("accept() failed.");
+struct DnsCacheEntry {
+    //Null if the name does not exist
+    std::shared_ptr<struct addrinfo> m_result;
+    std::chrono::steady_clock::time_point m_expires;
+};
+
+struct DnsCacheState {
+    std::mutex m_lock;
+    std::map<std::tuple<std::string, int, int>, DnsCacheEntry> m_entries;
+    std::chrono::seconds m_ttl{ 60 };
+    std::chrono::seconds m_negative_ttl{ 5 };
+
+    static DnsCacheState& instance() {
+        //Never destroyed since the detached resolver threads may still use it at exit
+        static DnsCacheState* state = new DnsCacheState();
+
+        return *state;
     }
+};
 
-    /*
-    * Create the Socket early so RAII can clean it up in
-    * case of a problem.
-    */
-    auto client = std::make_shared<Socket>(client_fd);
+void DnsCache::set_ttl(std::chrono::seconds ttl, std::chrono::seconds negative_ttl) {
+    auto& cache = DnsCacheState::instance();
+    std::lock_guard<std::mutex> guard(cache.m_lock);
 
-    client->attachment(attachment);
+    cache.m_ttl = ttl;
+    cache.m_negative_ttl = negative_ttl;
+}
+
+void DnsCache::clear() {
+    auto& cache = DnsCacheState::instance();
+    std::lock_guard<std::mutex> guard(cache.m_lock);
 
-    set_nonblocking(client_fd);
+    cache.m_entries.clear();
+}
 
-    m_sockets.insert(client);
+size_t DnsCache::size() {
+    auto& cache = DnsCacheState::instance();
+    std::lock_guard<std::mutex> guard(cache.m_lock);
 
-    return client;
+    return cache.m_entries.size();
 }
 
-void Selector::populate_fd_set(fd_set& read_fd_set, fd_set& write_fd_set, fd_set& except_fd_set) {
-    FD_ZERO(&read_fd_set);
-    FD_ZERO(&write_fd_set);
-    FD_ZERO(&except_fd_set);
+/*
+* Returns true if the cache has an answer for the name. The result
+* is null for a name that is known not to exist.
+*/
+static bool dns_cache_lookup(const std::string& host, int port, int socktype, std::shared_ptr<struct addrinfo>& result) {
+    auto& cache = DnsCacheState::instance();
+    std::lock_guard<std::mutex> guard(cache.m_lock);
 
-    for (auto& s : m_sockets) {
-        if (s->is_report_readable() || s->is_report_acceptable()) {
-            FD_SET(s->fd(), &read_fd_set);
-        }
-        if (s->is_report_writable()) {
-            FD_SET(s->fd(), &write_fd_set);
-        }
-        if (s->is_connection_pending()) {
-            /*
-            * Detecting connect() completion status is platform dependent.
-            * In Winsock, we use exception fd set for error and write fd set for success. 
-            * In BSD socket, we query writable event and then test for SO_ERROR.
-            */
-#ifdef _WIN32
-            FD_SET(s->fd(), &except_fd_set);
-#endif
-            FD_SET(s->fd(), &write_fd_set);
+    auto it = cache.m_entries.find(std::make_tuple(host, port, socktype));
 
-        }
+    if (it == cache.m_entries.end()) {
+        return false;
     }
-}
 
-void Selector::purge_sokets() {
-    for (auto& s : m_canceled_sockets) {
-        m_sockets.erase(s);
+    if (it->second.m_expires <= std::chrono::steady_clock::now()) {
+        cache.m_entries.erase(it);
+
+        return false;
+    }
+
+    result = it->second.m_result;
+
+    return true;
+}
+
+static void dns_cache_store(const std::string& host, int port, int socktype, std::shared_ptr<struct addrinfo> result) {
+    auto& cache = DnsCacheState::instance();
+    std::lock_guard<std::mutex> guard(cache.m_lock);
+    auto now = std::chrono::steady_clock::now();
+    auto ttl = result ? cache.m_ttl : cache.m_negative_ttl;
+
+    if (ttl.count() <= 0) {
+        return;
+    }
+
+    if (cache.m_entries.size() >= DNS_CACHE_MAX_ENTRIES) {
+        //Make room by dropping the expired entries or everything if none has expired
+        for (auto it = cache.m_entries.begin(); it != cache.m_entries.end();) {
+            if (it->second.m_expires <= now) {
+                it = cache.m_entries.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+
+        if (cache.m_entries.size() >= DNS_CACHE_MAX_ENTRIES) {
+            cache.m_entries.clear();
+        }
+    }
+
+    auto& entry = cache.m_entries[std::make_tuple(host, port, socktype)];
+
+    entry.m_result = std::move(result);
+    entry.m_expires = now + ttl;
+}
+
+/*
+* Checks the syntax of a host name (RFC 1123). A name that fails can not
+* exist. It is failed right away instead of asking the name servers,
+* whose answer for such names depends on the system configuration.
+*/
+static bool is_valid_host_name(const std::string& host) {
+    size_t length = host.size();
+
+    if (length > 0 && host[length - 1] == '.') {
+        //Fully qualified name
+        --length;
+    }
+
+    if (length == 0 || length > 253) {
+        return false;
+    }
+
+    size_t label_length = 0;
+
+    for (size_t i = 0; i < length; ++i) {
+        char ch = host[i];
+
+        if (ch == '.') {
+            if (label_length == 0) {
+                return false;
+            }
+
+            label_length = 0;
+        }
+        else if (isalnum((unsigned char) ch) || ch == '-' || ch == '_') {
+            if (++label_length > 63) {
+                return false;
+            }
+        }
+        else {
+            return false;
+        }
+    }
+
+    return label_length > 0;
+}
+
+/*
+* Lets the resolver threads find the selector that asked for a lookup.
+* The selector sets the pointer to null when it is destroyed.
+*/
+struct ResolverLink {
+    std::mutex m_lock;
+    Selector* m_selector = nullptr;
+};
+
+/*
+* Looks up the address in a resolver thread. The callback is called from
+* the selector's thread with the result or null if the lookup has failed.
+*/
+void Selector::resolve(const char* address, int port, int socktype, std::function<void(std::shared_ptr<struct addrinfo>)> callback) {
+    std::shared_ptr<struct addrinfo> cached;
+
+    if (dns_cache_lookup(address, port, socktype, cached)) {
+        //No need to involve the resolver threads
+        post([callback = std::move(callback), cached]() {
+            callback(cached);
+        });
+
+        return;
+    }
+
+    if (!is_valid_host_name(address)) {
+        //Same as the name servers answering EAI_NONAME
+        dns_cache_store(address, port, socktype, nullptr);
+
+        post([callback = std::move(callback)]() {
+            callback(nullptr);
+        });
+
+        return;
+    }
+
+    if (!m_resolver_link) {
+        m_resolver_link = std::make_shared<ResolverLink>();
+        m_resolver_link->m_selector = this;
+    }
+
+    Resolver::instance().submit([link = m_resolver_link, host = std::string(address), port, socktype, callback = std::move(callback)]() {
+        char port_str[128];
+
+        snprintf(port_str, sizeof(port_str), "%d", port);
+
+        struct addrinfo hints {}, * res{};
+
+        hints.ai_flags = AI_NUMERICSERV;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = socktype;
+
+        int status = ::getaddrinfo(host.c_str(), port_str, &hints, &res);
+
+        std::shared_ptr<struct addrinfo> result;
+
+        if (status == 0 && res != NULL) {
+            result = std::shared_ptr<struct addrinfo>(res, free_addrinfo);
+
+            dns_cache_store(host, port, socktype, result);
+        }
+        else if (status == EAI_NONAME) {
+            //Temporary failures are not cached
+            dns_cache_store(host, port, socktype, nullptr);
+        }
+
+        std::lock_guard<std::mutex> guard(link->m_lock);
+
+        if (link->m_selector != nullptr) {
+            link->m_selector->post([callback, result]() {
+                callback(result);
+            });
+        }
+    });
+}
+
+/*
+* Sets up a socket for an address that is being resolved. Until the lookup
+* completes the socket has no file descriptor and is not registered.
+*/
+void Selector::start_resolving(std::shared_ptr<Socket> socket) {
+    socket->m_selector = this;
+    socket->m_resolving = true;
+    socket->set_connection_pending(true);
+}
+
+/*
+* Reports that the lookup for a socket or the connection that followed it has failed.
+*/
+void Selector::resolve_failed(std::shared_ptr<Socket> socket) {
+    socket->m_resolving = false;
+    socket->m_selector = nullptr;
+    socket->set_connection_pending(false);
+    socket->set_connection_failed(true);
+
+    add_ready(socket.get());
+}
+
+/*
+* Creates a UDP socket. The socket remembers the given server address and port.
+* Any subsequent call to sendto() will use this address. The address of the server
+* can be a hostname, ipv4 or ipv6 address.
+* 
+* A host name is resolved in the background. Until then the socket is not registered
+* and is_connection_pending() is true. Then is_connection_success() or
+* is_connection_failed() is reported. An IP address is ready to use right away.
+* 
+* After the first call to sendto() a UDP socket gets bound to the server's address and port.
+* Which means, if you call recvfrom() after that the data is read from the server.
+* 
+* Once you no longer need to communicate with the server cancel the socket.
+*/
+std::shared_ptr<DatagramClientSocket> Selector::start_udp_client(const char* address, int port, std::shared_ptr<SocketAttachment> attachment) {
+    struct addrinfo* res = resolve_numeric(address, port, SOCK_DGRAM);
+
+    if (res != NULL) {
+        /*
+        * Creating the socket object here willmake sure res gets freed up
+        * no matter what happens.
+        */
+        auto client = std::make_shared<DatagramClientSocket>(res);
+
+        set_nonblocking(client->fd());
+
+        client->attachment(attachment);
+
+        add_socket(client);
+
+        return client;
+    }
+
+    auto client = std::make_shared<DatagramClientSocket>();
+
+    client->attachment(attachment);
+
+    start_resolving(client);
+
+    resolve(address, port, SOCK_DGRAM, [this, client](std::shared_ptr<struct addrinfo> res) {
+        if (client->m_canceled || !client->is_connection_pending()) {
+            //Canceled or timed out while resolving
+            return;
+        }
+
+        try {
+            if (!res) {
+                throw std::runtime_error("Failed to resolve address.");
+            }
+
+            client->open(res);
+        }
+        catch (std::exception&) {
+            resolve_failed(client);
+
+            return;
+        }
+
+        client->m_resolving = false;
+        client->set_connection_pending(false);
+        client->set_connection_success(true);
+
+        add_socket(client);
+        add_ready(client.get());
+    });
+
+    return client;
+}
+
+/*
+* Creates the socket's file descriptor for the address and starts connecting.
+* Throws an exception if the connection could not be started.
+*/
+void Selector::connect_client(std::shared_ptr<Socket>& client, struct addrinfo* res) {
+    client->m_fd = ::socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+
+    if (client->m_fd == INVALID_SOCKET) {
+        throw std::runtime_error("Failed to create a socket.");
+    }
+
+    client->set_connection_pending(true);
+
+    set_nonblocking(client->fd());
+
+    int status = ::connect(client->fd(), res->ai_addr, (int) res->ai_addrlen);
+
+    /*
+    * It is normal for a nonblocking socket to not complete connection immediately.
+    * This is indicated by an error but we should not abort.
+    * 
+    * Checking for in progress connection differes between Winsock and BSD socket.
+    */
+    if (status < 0) {
+#ifdef _WIN32
+        auto err = ::WSAGetLastError();
+
+        if (err != WSAEWOULDBLOCK) {
+            throw std::runtime_error("Failed to connect.");
+        }
+#else
+        if (errno != EINPROGRESS) {
+            throw std::runtime_error("Failed to connect.");
+        }
+#endif
+    }
+}
+
+/*
+* Creates a new TCP socket and connects it to a server listening at the given 
+* address and port. The address can be a host name, ipv4 or ipv6 IP address.
+* The attachment is set for the newly created client socket.
+* 
+* A host name is resolved in the background so the event loop is never held up.
+* The connection is started once the lookup completes. If the name can not be
+* resolved is_connection_failed() is reported.
+* 
+* To disconnect from the server gracefully, cancel the client socket.
+*/
+std::shared_ptr<Socket> Selector::start_client(const char* address, int port, std::shared_ptr<SocketAttachment> attachment) {
+    auto client = std::make_shared<Socket>(INVALID_SOCKET);
+
+    client->attachment(attachment);
+
+    struct addrinfo* res = resolve_numeric(address, port, SOCK_STREAM);
+
+    if (res != NULL) {
+        /*
+        * Use RAII to free the address. This makes the code below much simpler.
+        */
+        auto addr_resource = std::unique_ptr<struct addrinfo, void(*)(struct addrinfo*)>(res, free_addrinfo);
+
+        connect_client(client, res);
+
+        add_socket(client);
+
+        return client;
+    }
+
+    start_resolving(client);
+
+    resolve(address, port, SOCK_STREAM, [this, client](std::shared_ptr<struct addrinfo> res) mutable {
+        if (client->m_canceled || !client->is_connection_pending()) {
+            //Canceled or timed out while resolving
+            return;
+        }
+
+        if (!res) {
+            resolve_failed(client);
+
+            return;
+        }
+
+        /*
+        * The addrinfo res object is a linked list. It has all
+        * resolved addresses. For example, it will have both ipv4 and ipv6
+        * addresses if available. They are all raced against each other.
+        */
+        race_next(start_race(client, res.get()));
+    });
+
+    return client;
+}
+
+/*
+* Connects to whichever of the addresses answers first. This is the Happy Eyeballs
+* algorithm of RFC 8305. The address families are interleaved and a new attempt
+* is started every CONNECTION_ATTEMPT_DELAY, or right away when an attempt fails.
+* The first attempt to connect wins and the others are canceled.
+*/
+std::shared_ptr<Socket> Selector::start_client(const struct addrinfo* addresses, std::shared_ptr<SocketAttachment> attachment) {
+    if (addresses == NULL) {
+        throw std::runtime_error("No address to connect to.");
+    }
+
+    auto client = std::make_shared<Socket>(INVALID_SOCKET);
+
+    client->attachment(attachment);
+
+    start_resolving(client);
+
+    auto race = start_race(client, addresses);
+
+    //Failures can only be reported from select()
+    post([this, race]() {
+        race_next(race);
+    });
+
+    return client;
+}
+
+/*
+* Every attempt is a separate socket that is registered with the selector.
+* The client socket the application holds gets the winner's file descriptor.
+*/
+struct ConnectRace {
+    struct Address {
+        int family;
+        int socktype;
+        int protocol;
+        struct sockaddr_storage addr;
+        socklen_t addr_len;
+    };
+
+    //Like a registered socket the client is kept alive by the selector. Reset when the race is over.
+    std::shared_ptr<Socket> m_client;
+    //Addresses in the order they are tried
+    std::vector<Address> m_addresses;
+    size_t m_next = 0;
+    //Attempts in progress
+    std::vector<std::shared_ptr<Socket>> m_attempts;
+    //Starts the next attempt
+    Timer m_timer;
+};
+
+std::shared_ptr<ConnectRace> Selector::start_race(std::shared_ptr<Socket> client, const struct addrinfo* addresses) {
+    auto race = std::make_shared<ConnectRace>();
+    std::vector<ConnectRace::Address> primary, secondary;
+
+    /*
+    * getaddrinfo() sorts the addresses by preference. Alternate between the
+    * family of the first address and the other family.
+    */
+    for (auto p = addresses; p != NULL; p = p->ai_next) {
+        ConnectRace::Address a{};
+
+        if (p->ai_addrlen > sizeof(a.addr)) {
+            continue;
+        }
+
+        a.family = p->ai_family;
+        a.socktype = p->ai_socktype;
+        a.protocol = p->ai_protocol;
+        a.addr_len = (socklen_t) p->ai_addrlen;
+
+        ::memcpy(&a.addr, p->ai_addr, p->ai_addrlen);
+
+        (p->ai_family == addresses->ai_family ? primary : secondary).push_back(a);
+    }
+
+    for (size_t i = 0; i < primary.size() || i < secondary.size(); ++i) {
+        if (i < primary.size()) {
+            race->m_addresses.push_back(primary[i]);
+        }
+        if (i < secondary.size()) {
+            race->m_addresses.push_back(secondary[i]);
+        }
+    }
+
+    race->m_client = client;
+    client->m_race = race;
+
+    return race;
+}
+
+/*
+* Starts the next connection attempt. Finishes the race as a failure
+* when every address has been tried and no attempt is in progress.
+*/
+void Selector::race_next(const std::shared_ptr<ConnectRace>& race) {
+    auto client = race->m_client;
+
+    if (!client || client->m_race != race) {
+        //The race is over
+        finish_race(race, nullptr);
+
+        return;
+    }
+
+    while (race->m_next < race->m_addresses.size()) {
+        auto& a = race->m_addresses[race->m_next++];
+        struct addrinfo info {};
+
+        info.ai_family = a.family;
+        info.ai_socktype = a.socktype;
+        info.ai_protocol = a.protocol;
+        info.ai_addr = (struct sockaddr*) &a.addr;
+        info.ai_addrlen = a.addr_len;
+
+        auto attempt = std::make_shared<Socket>(INVALID_SOCKET);
+
+        try {
+            connect_client(attempt, &info);
+        }
+        catch (std::exception&) {
+            //For example the network is unreachable. Try the next address right away.
+            continue;
+        }
+
+        attempt->m_race = race;
+        race->m_attempts.push_back(attempt);
+
+        add_socket(attempt);
+
+        if (race->m_next < race->m_addresses.size()) {
+            std::weak_ptr<ConnectRace> weak_race = race;
+
+            schedule(race->m_timer, CONNECTION_ATTEMPT_DELAY, [this, weak_race]() {
+                if (auto r = weak_race.lock()) {
+                    race_next(r);
+                }
+            });
+        }
+
+        return;
+    }
+
+    if (race->m_attempts.empty()) {
+        finish_race(race, nullptr);
+    }
+}
+
+/*
+* Ends the race. The winner's file descriptor is handed over to the client
+* socket. All other attempts are canceled. A null winner means the
+* connection has failed.
+*/
+void Selector::finish_race(std::shared_ptr<ConnectRace> race, std::shared_ptr<Socket> winner) {
+    auto client = std::move(race->m_client);
+
+    cancel_timer(race->m_timer);
+
+    for (auto& attempt : race->m_attempts) {
+        attempt->m_race = nullptr;
+
+        if (attempt != winner) {
+            cancel_socket(attempt);
+        }
+    }
+
+    race->m_attempts.clear();
+
+    if (!client || client->m_canceled || !client->is_connection_pending()) {
+        //Nobody is waiting for the connection any more
+        if (winner) {
+            cancel_socket(winner);
+        }
+
+        if (client) {
+            client->m_race = nullptr;
+        }
+
+        return;
+    }
+
+    client->m_race = nullptr;
+
+    if (!winner) {
+        resolve_failed(client);
+
+        return;
+    }
+
+#ifdef VELAR_USE_EPOLL
+    if (winner->m_registered_events != 0) {
+        ::epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, winner->fd(), NULL);
+
+        winner->m_registered_events = 0;
+    }
+#endif
+
+    //The winner is left with nothing to register or close
+    winner->set_connection_pending(false);
+    client->m_fd = winner->m_fd;
+    winner->m_fd = INVALID_SOCKET;
+
+    cancel_socket(winner);
+
+    client->m_resolving = false;
+    client->set_connection_pending(false);
+    client->set_connection_success(true);
+
+    add_socket(client);
+    add_ready(client.get());
+}
+
+/*
+* Connection attempts are not visible to the application. Takes them out
+* of the ready list and moves their races forward.
+*/
+void Selector::settle_races() {
+    size_t num_kept = 0;
+
+    for (size_t i = 0; i < m_ready.size(); ++i) {
+        std::shared_ptr<Socket> s = m_ready[i];
+        std::shared_ptr<ConnectRace> race = s->m_race;
+
+        if (!race || race->m_client == s) {
+            m_ready[num_kept++] = s;
+
+            continue;
+        }
+
+        s->m_in_ready_list = false;
+        s->set_writable(false);
+        s->set_readable(false);
+
+        if (s->is_connection_success()) {
+            s->set_connection_success(false);
+
+            finish_race(race, s);
+        }
+        else if (s->is_connection_failed()) {
+            race->m_attempts.erase(std::find(race->m_attempts.begin(), race->m_attempts.end(), s));
+            s->m_race = nullptr;
+
+            cancel_socket(s);
+
+            race_next(race);
+        }
+    }
+
+    m_ready.resize(num_kept);
+}
+
+/*
+* Starts a UDP server and makes it join a multicast group identified by the group's
+* IP address group_ip. The group's address can be any valid ipv4 or ipv6 IP address.
+*/
+std::shared_ptr<Socket> Selector::start_multicast_server(const char* group_ip, int port, std::shared_ptr<SocketAttachment> attachment) {
+    auto receiver = start_udp_server(port, attachment);
+
+    // Join the multicast group
+    struct ipv6_mreq mreq6 {};
+    struct ip_mreq mreq4 {};
+
+    //Set the multicast group address
+    if (inet_pton(AF_INET6, group_ip, &mreq6.ipv6mr_multiaddr) == 1) {
+        mreq6.ipv6mr_interface = 0;
+
+        //Join the group
+        int status = ::setsockopt(receiver->fd(), IPPROTO_IPV6, IPV6_JOIN_GROUP, (const char*)&mreq6, sizeof(mreq6));
+
+        check_socket_error(status, "Failed to join ipv6 multicast group.");
+    }
+    else if (inet_pton(AF_INET, group_ip, &mreq4.imr_multiaddr.s_addr) == 1) {
+        mreq4.imr_interface.s_addr = INADDR_ANY;
+
+        //Join the group
+        int status = ::setsockopt(receiver->fd(), IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*)&mreq4, sizeof(mreq4));
+
+        check_socket_error(status, "Failed to join ipv4 multicast group.");
+    }
+    else {
+        throw std::runtime_error("The group IP address is not a valid ipv6 or ipv4 address.");
+    }
+
+    return receiver;
+}
+
+/*
+* Starts a UDP socket and binds to the given port. Clients should be able to
+* connect to it using either ipv4 or ipv6 address.
+* 
+* The socket's readbility event reporting is enabled by default. Which means,
+* the server can start accepting request messages from clients right away.
+*/
+std::shared_ptr<Socket> Selector::start_udp_server(int port, std::shared_ptr<SocketAttachment> attachment) {
+    // Create a UDP socket
+    auto receiver = std::make_shared<Socket>(AF_INET6, SOCK_DGRAM, 0);
+
+    receiver->attachment(attachment);
+
+    /*
+    * This will make the socket bind to both ipv6 and ipv4 address.
+    * This way, a client can connect using either ipv4 or ipv6 address.
+    */
+    int optval = 0;
+
+    int status = ::setsockopt(receiver->fd(), IPPROTO_IPV6, IPV6_V6ONLY, (char*)&optval, sizeof(optval));
+
+    check_socket_error(status, "Failed to disable IPV6_V6ONLY.");
+
+    int reuse = 1;
+
+    status = ::setsockopt(receiver->fd(), SOL_SOCKET, SO_REUSEADDR, (const char*) & reuse, sizeof reuse);
+    
+    check_socket_error(status, "Failed to set SO_REUSEADDR.");
+
+#ifndef _WIN32
+    status = ::setsockopt(receiver->fd(), SOL_SOCKET, SO_REUSEPORT, (const char*) &reuse, sizeof reuse);
+    
+    check_socket_error(receiver->fd(), "Failed to set SO_REUSEPORT.");
+#endif
+
+    // Bind the socket to the multicast port
+    struct sockaddr_in6 addr {};
+
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(port);
+
+    status = ::bind(receiver->fd(), (const struct sockaddr*) &addr, sizeof(addr));
+
+    check_socket_error(status, "Failed to bind to port.");
+
+    //Turn this on since all receivers need to read
+    receiver->report_readable(true);
+
+    add_socket(receiver);
+
+    return receiver;
+}
+
+/*
+* Starts a TCP socket and binds to the given port. Clients should be able to
+* connect to it using either ipv4 or ipv6 address.
+*
+* The socket's readbility event reporting is enabled by default. Which means,
+* the server can start accepting clients right away.
+* 
+* To shutdown the server just cancel the server socket.
+*/
+std::shared_ptr<Socket> Selector::start_server(int port, std::shared_ptr<SocketAttachment> attachment, int backlog) {
+    auto server = std::make_shared<Socket>(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+
+    server->attachment(attachment);
+
+    set_nonblocking(server->fd());
+
+    int reuse = 1;
+
+    int status = ::setsockopt(server->fd(), SOL_SOCKET, SO_REUSEADDR, (const char*) &reuse, sizeof reuse);
+    
+    check_socket_error(status, "Failed to set SO_REUSEADDR.");
+
+#ifndef _WIN32
+    status = ::setsockopt(server->fd(), SOL_SOCKET, SO_REUSEPORT, (const char*)&reuse, sizeof reuse);
+
+    check_socket_error(status, "Failed to set SO_REUSEPORT.");
+#endif
+
+    /*
+    * This will allow IPV4 mapped addresses.
+    */
+    int optval = 0;
+    
+    status = ::setsockopt(server->fd(), IPPROTO_IPV6, IPV6_V6ONLY, (char*)&optval, sizeof(optval));
+    check_socket_error(status, "Failed to disable IPV6_V6ONLY.");
+
+    struct sockaddr_in6 addr {}; //Important to zero out the address
+
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = ::in6addr_any;
+    addr.sin6_port = htons(port);
+
+    status = ::bind(server->fd(), (struct sockaddr*) &addr, sizeof(addr));
+
+    check_socket_error(status, "Failed to bind to port.");
+
+    status = ::listen(server->fd(), backlog);
+
+    check_socket_error(status, "Failed to listen.");
+
+    //Turn this on since all servers will need to catch accept event
+    server->report_accpeptable(true);
+
+    add_socket(server);
+
+    return server;
+}
+
+/*
+* Accepts a client that has connected to the given server's socket.
+* A new client socket is created and the attachment is set for the client.
+* The selector begins monitoring the client socket for events until the client
+* socket is cancelled.
+*/
+std::shared_ptr<Socket> Selector::accept(std::shared_ptr<Socket> server, std::shared_ptr<SocketAttachment> attachment) {
+#ifdef VELAR_USE_IO_URING
+    if (server->m_accepted_fd != INVALID_SOCKET) {
+        /*
+        * The io_uring engine has already accepted the client. The socket is
+        * non-blocking. Queue up the next accept.
+        */
+        auto client = std::make_shared<Socket>(server->m_accepted_fd);
+
+        server->m_accepted_fd = INVALID_SOCKET;
+        server->set_acceptable(false);
+
+        client->attachment(attachment);
+
+        add_socket(client);
+
+        prepare_accept(server.get());
+
+        return client;
+    }
+#endif
+
+    SOCKET client_fd = accept_fd(server.get());
+
+    if (client_fd == INVALID_SOCKET) {
+        throw std::runtime_error("accept() failed.");
+    }
+
+    auto client = std::make_shared<Socket>(client_fd);
+
+    client->attachment(attachment);
+
+    add_socket(client);
+
+    return client;
+}
+
+/*
+* Accepts a client and makes its socket non-blocking. Returns INVALID_SOCKET
+* if no client is waiting. On Linux accept4() does all of this in a single
+* system call.
+*/
+SOCKET Selector::accept_fd(Socket* server) {
+    while (true) {
+#ifdef __linux__
+        SOCKET client_fd = ::accept4(server->fd(), NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        SOCKET client_fd = ::accept(server->fd(), NULL, NULL);
+#endif
+
+        if (client_fd != INVALID_SOCKET) {
+#ifndef __linux__
+            try {
+                set_nonblocking(client_fd);
+            }
+            catch (...) {
+#ifdef _WIN32
+                ::closesocket(client_fd);
+#else
+                ::close(client_fd);
+#endif
+
+                throw;
+            }
+#endif
+
+            return client_fd;
+        }
+
+#ifdef _WIN32
+        int status = ::WSAGetLastError();
+
+        if (status == WSAEWOULDBLOCK) {
+            return INVALID_SOCKET;
+        }
+        else if (status != WSAECONNRESET) {
+            throw std::runtime_error("accept() failed.");
+        }
+#else
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return INVALID_SOCKET;
+        }
+        else if (errno != ECONNABORTED && errno != EINTR) {
+            throw std::system_error(errno, std::generic_category(), "accept() failed");
+        }
+#endif
+
+        //The client has given up before we got to it. Try the next one.
+    }
+}
+
+size_t Selector::accept_all(std::shared_ptr<Socket> server, std::vector<std::shared_ptr<Socket>>& clients, size_t max_clients) {
+    size_t num_accepted = 0;
+
+#ifdef VELAR_USE_IO_URING
+    if (server->m_accepted_fd != INVALID_SOCKET && max_clients > 0) {
+        //Take the client accepted by the io_uring engine first
+        clients.push_back(accept(server, nullptr));
+
+        ++num_accepted;
+    }
+#endif
+
+    while (num_accepted < max_clients) {
+        SOCKET client_fd = accept_fd(server.get());
+
+        if (client_fd == INVALID_SOCKET) {
+            break;
+        }
+
+        auto client = std::make_shared<Socket>(client_fd);
+
+        add_socket(client);
+        clients.push_back(client);
+
+        ++num_accepted;
+    }
+
+    return num_accepted;
+}
+
+#ifdef VELAR_USE_IO_URING
+/*
+* A minimal io_uring driver. It talks to the kernel directly using the
+* io_uring_setup(2), io_uring_enter(2) and io_uring_register(2) system calls.
+* The submission queue entries are used in order, so the submission queue's
+* index array is an identity map.
+*/
+struct IoUring {
+    /*
+    * The user_data of a completion identifies the operation. For socket
+    * operations it is the Socket pointer with the operation type in the
+    * low bits.
+    */
+    static const uint64_t EPOLL_DATA = 0;
+    static const uint64_t IGNORE_DATA = 7;
+    static const uint64_t OP_READ = 1;
+    static const uint64_t OP_WRITE = 2;
+    static const uint64_t OP_ACCEPT = 3;
+    static const uint64_t OP_MASK = 7;
+
+    int m_fd = -1;
+
+    void* m_sq_ring = MAP_FAILED;
+    size_t m_sq_ring_size = 0;
+    void* m_cq_ring = MAP_FAILED;
+    size_t m_cq_ring_size = 0;
+    struct io_uring_sqe* m_sqes = (struct io_uring_sqe*) MAP_FAILED;
+    size_t m_sqes_size = 0;
+
+    unsigned* m_sq_head = nullptr;
+    unsigned* m_sq_tail = nullptr;
+    unsigned m_sq_mask = 0;
+    unsigned m_sq_entries = 0;
+    //Tail of the entries prepared but not yet handed over to the kernel
+    unsigned m_sq_local_tail = 0;
+    unsigned m_to_submit = 0;
+
+    unsigned* m_cq_head = nullptr;
+    unsigned* m_cq_tail = nullptr;
+    unsigned m_cq_mask = 0;
+    struct io_uring_cqe* m_cqes = nullptr;
+
+    bool m_epoll_armed = false;
+
+    //Free slots in the registered file table
+    std::vector<int> m_free_file_slots;
+    std::vector<ByteBuffer*> m_buffers;
+
+    IoUring(unsigned entries);
+    ~IoUring();
+
+    struct io_uring_sqe* get_sqe();
+    int enter(unsigned min_complete, struct __kernel_timespec* ts);
+    int register_op(unsigned opcode, void* arg, unsigned nr_args);
+    void cleanup();
+};
+
+IoUring::IoUring(unsigned entries) {
+    struct io_uring_params p {};
+
+    m_fd = (int) ::syscall(__NR_io_uring_setup, entries, &p);
+
+    if (m_fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "io_uring_setup() failed");
+    }
+
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        cleanup();
+
+        throw std::runtime_error("The kernel's io_uring does not support IORING_FEAT_EXT_ARG.");
+    }
+
+    m_sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    m_cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        m_sq_ring_size = m_cq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+    }
+
+    m_sq_ring = ::mmap(nullptr, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+
+    if (m_sq_ring == MAP_FAILED) {
+        cleanup();
+
+        throw std::system_error(errno, std::generic_category(), "mmap() failed");
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        m_cq_ring = m_sq_ring;
+    }
+    else {
+        m_cq_ring = ::mmap(nullptr, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+
+        if (m_cq_ring == MAP_FAILED) {
+            cleanup();
+
+            throw std::system_error(errno, std::generic_category(), "mmap() failed");
+        }
+    }
+
+    m_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    m_sqes = (struct io_uring_sqe*) ::mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+
+    if (m_sqes == MAP_FAILED) {
+        cleanup();
+
+        throw std::system_error(errno, std::generic_category(), "mmap() failed");
+    }
+
+    char* sq = (char*) m_sq_ring;
+    char* cq = (char*) m_cq_ring;
+
+    m_sq_head = (unsigned*) (sq + p.sq_off.head);
+    m_sq_tail = (unsigned*) (sq + p.sq_off.tail);
+    m_sq_mask = *(unsigned*) (sq + p.sq_off.ring_mask);
+    m_sq_entries = p.sq_entries;
+    m_sq_local_tail = *m_sq_tail;
+
+    unsigned* sq_array = (unsigned*) (sq + p.sq_off.array);
+
+    for (unsigned i = 0; i < m_sq_entries; ++i) {
+        sq_array[i] = i;
+    }
+
+    m_cq_head = (unsigned*) (cq + p.cq_off.head);
+    m_cq_tail = (unsigned*) (cq + p.cq_off.tail);
+    m_cq_mask = *(unsigned*) (cq + p.cq_off.ring_mask);
+    m_cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+
+    /*
+    * Set up a sparse table of registered files. Operations on a registered
+    * file skip the file descriptor lookup. If the kernel doesn't support it we
+    * simply use plain file descriptors.
+    */
+    struct rlimit rl {};
+
+    ::getrlimit(RLIMIT_NOFILE, &rl);
+
+    size_t num_slots = std::min<size_t>(IO_URING_FILE_SLOTS, rl.rlim_cur);
+    std::vector<int> fds(num_slots, -1);
+
+    if (num_slots > 0 && register_op(IORING_REGISTER_FILES, fds.data(), (unsigned) num_slots) == 0) {
+        m_free_file_slots.reserve(num_slots);
+
+        for (size_t i = num_slots; i > 0; --i) {
+            m_free_file_slots.push_back((int) i - 1);
+        }
+    }
+}
+
+IoUring::~IoUring() {
+    cleanup();
+}
+
+void IoUring::cleanup() {
+    if (m_sqes != MAP_FAILED) {
+        ::munmap(m_sqes, m_sqes_size);
+
+        m_sqes = (struct io_uring_sqe*) MAP_FAILED;
+    }
+
+    if (m_cq_ring != MAP_FAILED && m_cq_ring != m_sq_ring) {
+        ::munmap(m_cq_ring, m_cq_ring_size);
+    }
+
+    m_cq_ring = MAP_FAILED;
+
+    if (m_sq_ring != MAP_FAILED) {
+        ::munmap(m_sq_ring, m_sq_ring_size);
+
+        m_sq_ring = MAP_FAILED;
+    }
+
+    if (m_fd >= 0) {
+        ::close(m_fd);
+
+        m_fd = -1;
+    }
+}
+
+int IoUring::register_op(unsigned opcode, void* arg, unsigned nr_args) {
+    return (int) ::syscall(__NR_io_uring_register, m_fd, opcode, arg, nr_args);
+}
+
+/*
+* Returns a zeroed out submission queue entry. If the queue is full
+* the queued entries are submitted to make room.
+*/
+struct io_uring_sqe* IoUring::get_sqe() {
+    unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+
+    if (m_sq_local_tail - head >= m_sq_entries) {
+        if (enter(0, nullptr) < 0 && errno != EBUSY) {
+            throw std::system_error(errno, std::generic_category(), "io_uring_enter() failed");
+        }
+
+        head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+
+        if (m_sq_local_tail - head >= m_sq_entries) {
+            throw std::runtime_error("io_uring submission queue is full.");
+        }
+    }
+
+    auto sqe = &m_sqes[m_sq_local_tail & m_sq_mask];
+
+    ::memset(sqe, 0, sizeof(*sqe));
+
+    ++m_sq_local_tail;
+    ++m_to_submit;
+
+    return sqe;
+}
+
+/*
+* Submits the prepared entries and optionally waits for at least min_complete
+* completions. A null ts means wait indefinitely.
+*/
+int IoUring::enter(unsigned min_complete, struct __kernel_timespec* ts) {
+    __atomic_store_n(m_sq_tail, m_sq_local_tail, __ATOMIC_RELEASE);
+
+    unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    struct io_uring_getevents_arg arg {};
+
+    if (ts != nullptr) {
+        flags |= IORING_ENTER_EXT_ARG;
+
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = (uint64_t) (uintptr_t) ts;
+    }
+
+    int status = (int) ::syscall(
+        __NR_io_uring_enter,
+        m_fd,
+        m_to_submit,
+        min_complete,
+        flags,
+        ts != nullptr ? (void*) &arg : nullptr,
+        ts != nullptr ? sizeof(arg) : (size_t) _NSIG / 8);
+
+    if (status > 0) {
+        m_to_submit -= std::min<unsigned>(m_to_submit, status);
+    }
+
+    return status;
+}
+
+/*
+* Uses a slot of the registered file table for the socket so that the
+* kernel can skip the file descriptor lookup on every operation.
+*/
+static int get_file_slot(IoUring& ring, SOCKET fd, int& slot) {
+    if (slot >= 0 || ring.m_free_file_slots.empty()) {
+        return slot;
+    }
+
+    int candidate = ring.m_free_file_slots.back();
+    int fds[1] = { fd };
+    struct io_uring_files_update update {};
+
+    update.offset = candidate;
+    update.fds = (uint64_t) (uintptr_t) fds;
+
+    if (ring.register_op(IORING_REGISTER_FILES_UPDATE, &update, 1) == 1) {
+        ring.m_free_file_slots.pop_back();
+
+        slot = candidate;
+    }
+
+    return slot;
+}
+
+void Selector::release_file_slot(Socket* s) {
+    if (s->m_file_slot < 0) {
+        return;
+    }
+
+    /*
+    * The registered file table holds a reference to the socket. It must be
+    * dropped or the connection will not be closed with the socket.
+    */
+    int fds[1] = { -1 };
+    struct io_uring_files_update update {};
+
+    update.offset = s->m_file_slot;
+    update.fds = (uint64_t) (uintptr_t) fds;
+
+    m_ring->register_op(IORING_REGISTER_FILES_UPDATE, &update, 1);
+    m_ring->m_free_file_slots.push_back(s->m_file_slot);
+
+    s->m_file_slot = -1;
+}
+
+static void set_sqe_file(struct io_uring_sqe* sqe, IoUring& ring, Socket* s, int& slot) {
+    if (get_file_slot(ring, s->fd(), slot) >= 0) {
+        sqe->fd = slot;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+    else {
+        sqe->fd = s->fd();
+    }
+}
+
+void Selector::prepare_io(Socket* s, ByteBuffer& b, bool is_read) {
+    auto sqe = m_ring->get_sqe();
+    auto& buffers = m_ring->m_buffers;
+    auto it = std::find(buffers.begin(), buffers.end(), &b);
+
+    set_sqe_file(sqe, *m_ring, s, s->m_file_slot);
+
+    sqe->addr = (uint64_t) (uintptr_t) (b.array() + b.position());
+    sqe->len = (uint32_t) b.remaining();
+
+    if (it != buffers.end()) {
+        //The buffer's pages are already mapped by the kernel
+        sqe->opcode = is_read ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+        sqe->buf_index = (uint16_t) (it - buffers.begin());
+    }
+    else {
+        sqe->opcode = is_read ? IORING_OP_RECV : IORING_OP_SEND;
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+
+    sqe->user_data = (uint64_t) (uintptr_t) s | (is_read ? IoUring::OP_READ : IoUring::OP_WRITE);
+
+    ++s->m_pending_ops;
+}
+
+void Selector::prepare_accept(Socket* server) {
+    auto sqe = m_ring->get_sqe();
+
+    set_sqe_file(sqe, *m_ring, server, server->m_file_slot);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    //The new client is made non-blocking by the kernel
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = (uint64_t) (uintptr_t) server | IoUring::OP_ACCEPT;
+
+    ++server->m_pending_ops;
+}
+
+void Selector::cancel_io(Socket* s) {
+    uint64_t ops[] = { IoUring::OP_READ, IoUring::OP_WRITE, IoUring::OP_ACCEPT };
+
+    for (auto op : ops) {
+        auto sqe = m_ring->get_sqe();
+
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = (uint64_t) (uintptr_t) s | op;
+        sqe->user_data = IoUring::IGNORE_DATA;
+    }
+}
+
+/*
+* Reads and write complete with a negative errno or the number of bytes
+* transferred. Turn that into the values returned by Socket::read() and
+* Socket::write().
+*/
+static int normalize_io_result(int res, ByteBuffer* b) {
+    if (res > 0) {
+        //Forward the position
+        b->position(b->position() + res);
+
+        return res;
+    }
+
+    if (res == -EAGAIN || res == -EWOULDBLOCK) {
+        //Not an error really.
+        return 0;
+    }
+
+    /*
+    * Zero means the other party has disconnected. Anything else is
+    * a real error.
+    */
+    return -1;
+}
+
+/*
+* Processes all available completions. Sets epoll_ready if the epoll
+* descriptor has readiness events waiting. Returns the number of completed
+* socket operations.
+*/
+int Selector::complete_io(bool& epoll_ready) {
+    int num_completions = 0;
+    bool drained = false;
+    unsigned head = *m_ring->m_cq_head;
+    unsigned tail = __atomic_load_n(m_ring->m_cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; ++head) {
+        auto cqe = &m_ring->m_cqes[head & m_ring->m_cq_mask];
+        uint64_t data = cqe->user_data;
+        int res = cqe->res;
+
+        if (data == IoUring::EPOLL_DATA) {
+            epoll_ready = true;
+            m_ring->m_epoll_armed = false;
+
+            continue;
+        }
+
+        if (data == IoUring::IGNORE_DATA) {
+            continue;
+        }
+
+        auto s = (Socket*) (uintptr_t) (data & ~IoUring::OP_MASK);
+        auto op = data & IoUring::OP_MASK;
+
+        --s->m_pending_ops;
+
+        if (s->m_selector == nullptr) {
+            //The socket was canceled. Nobody is interested in the outcome.
+            if (op == IoUring::OP_ACCEPT && res >= 0) {
+                ::close(res);
+            }
+
+            drained = true;
+
+            continue;
+        }
+
+        if (op == IoUring::OP_READ) {
+            s->m_read_result = normalize_io_result(res, s->m_read_buffer);
+            s->m_read_buffer = nullptr;
+            s->set_read_complete(true);
+        }
+        else if (op == IoUring::OP_WRITE) {
+            s->m_write_result = normalize_io_result(res, s->m_write_buffer);
+            s->m_write_buffer = nullptr;
+            s->set_write_complete(true);
+        }
+        else if (op == IoUring::OP_ACCEPT) {
+            if (res >= 0) {
+                s->m_accepted_fd = res;
+                s->set_acceptable(true);
+            }
+            else if (res != -ECANCELED) {
+                //Try again. Most likely a client has given up.
+                prepare_accept(s);
+
+                continue;
+            }
+        }
+
+        add_ready(s);
+
+        ++num_completions;
+    }
+
+    __atomic_store_n(m_ring->m_cq_head, head, __ATOMIC_RELEASE);
+
+    if (drained) {
+        //Let go of the canceled sockets that have nothing in flight
+        auto it = m_draining_sockets.begin();
+
+        while (it != m_draining_sockets.end()) {
+            if ((*it)->m_pending_ops == 0) {
+                release_file_slot(it->get());
+
+                it = m_draining_sockets.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+    }
+
+    return num_completions;
+}
+
+void Selector::submit_read(std::shared_ptr<Socket> socket, ByteBuffer& b) {
+    if (socket->m_read_buffer != nullptr) {
+        throw std::runtime_error("A read is already in progress.");
+    }
+
+    if (b.is_read_only()) {
+        throw std::runtime_error("Buffer is read only.");
+    }
+
+    if (!b.has_remaining()) {
+        throw std::runtime_error("Buffer is full.");
+    }
+
+    prepare_io(socket.get(), b, true);
+
+    socket->m_read_buffer = &b;
+}
+
+void Selector::submit_write(std::shared_ptr<Socket> socket, ByteBuffer& b) {
+    if (socket->m_write_buffer != nullptr) {
+        throw std::runtime_error("A write is already in progress.");
+    }
+
+    if (!b.has_remaining()) {
+        throw std::runtime_error("Buffer is empty.");
+    }
+
+    prepare_io(socket.get(), b, false);
+
+    socket->m_write_buffer = &b;
+}
+
+void Selector::submit_accept(std::shared_ptr<Socket> server) {
+    if (server->m_async_accept) {
+        return;
+    }
+
+    server->m_async_accept = true;
+
+    prepare_accept(server.get());
+}
+
+void Selector::register_buffers(const std::vector<ByteBuffer*>& buffers) {
+    if (!m_ring->m_buffers.empty()) {
+        m_ring->register_op(IORING_UNREGISTER_BUFFERS, nullptr, 0);
+        m_ring->m_buffers.clear();
+    }
+
+    if (buffers.empty()) {
+        return;
+    }
+
+    std::vector<struct iovec> iov;
+
+    for (auto b : buffers) {
+        iov.push_back({ b->array(), b->capacity() });
+    }
+
+    if (m_ring->register_op(IORING_REGISTER_BUFFERS, iov.data(), (unsigned) iov.size()) < 0) {
+        throw std::system_error(errno, std::generic_category(), "IORING_REGISTER_BUFFERS failed");
+    }
+
+    m_ring->m_buffers = buffers;
+}
+#endif
+
+Timer::~Timer() {
+    if (m_list != nullptr) {
+        TimerWheel::unlink(this);
+    }
+}
+
+/*
+* Returns the index of the lowest set bit. The value must not be zero.
+*/
+static int lowest_bit(uint64_t value) {
+#ifdef _MSC_VER
+    unsigned long index;
+
+    _BitScanForward64(&index, value);
+
+    return (int) index;
+#else
+    return __builtin_ctzll(value);
+#endif
+}
+
+constexpr std::chrono::microseconds TimerWheel::TICK;
+
+TimerWheel::TimerWheel() : m_epoch(std::chrono::steady_clock::now()) {
+    for (int level = 0; level < LEVELS; ++level) {
+        for (int slot = 0; slot < SLOTS; ++slot) {
+            m_slots[level][slot].wheel = this;
+            m_slots[level][slot].index = level * SLOTS + slot;
+        }
+    }
+}
+
+TimerWheel::~TimerWheel() {
+    //Detach the timers that are still scheduled
+    for (auto& level : m_slots) {
+        for (auto& list : level) {
+            while (list.head != nullptr) {
+                unlink(list.head);
+            }
+        }
+    }
+}
+
+/*
+* Returns the current time in ticks.
+*/
+uint64_t TimerWheel::clock() {
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_epoch);
+
+    return elapsed.count() / TICK.count();
+}
+
+/*
+* Converts a duration to ticks, rounding up.
+*/
+uint64_t TimerWheel::to_ticks(std::chrono::microseconds duration) {
+    if (duration.count() <= 0) {
+        return 0;
+    }
+
+    return (duration.count() + TICK.count() - 1) / TICK.count();
+}
+
+/*
+* Returns the tick when a timer started now with the given delay
+* should expire. The current tick has already partly elapsed, so one
+* more tick is added to make sure the timer never expires early.
+*/
+uint64_t TimerWheel::deadline(std::chrono::microseconds delay) {
+    return clock() + to_ticks(delay) + 1;
+}
+
+/*
+* Returns the time left until the given tick. Zero if it has passed.
+*/
+std::chrono::microseconds TimerWheel::time_until(uint64_t tick) {
+    auto target = m_epoch + tick * TICK;
+    auto left = std::chrono::ceil<std::chrono::microseconds>(target - std::chrono::steady_clock::now());
+
+    return left.count() > 0 ? left : std::chrono::microseconds::zero();
+}
+
+void TimerWheel::push(TimerList& list, Timer* t) {
+    t->m_prev = nullptr;
+    t->m_next = list.head;
+
+    if (list.head != nullptr) {
+        list.head->m_prev = t;
+    }
+
+    list.head = t;
+    t->m_list = &list;
+
+    if (list.wheel != nullptr) {
+        list.wheel->m_occupied[list.index / SLOTS] |= (uint64_t) 1 << (list.index % SLOTS);
+    }
+}
+
+void TimerWheel::unlink(Timer* t) {
+    TimerList* list = t->m_list;
+
+    if (t->m_prev != nullptr) {
+        t->m_prev->m_next = t->m_next;
+    }
+    else {
+        list->head = t->m_next;
+    }
+
+    if (t->m_next != nullptr) {
+        t->m_next->m_prev = t->m_prev;
+    }
+
+    if (list->head == nullptr && list->wheel != nullptr) {
+        list->wheel->m_occupied[list->index / SLOTS] &= ~((uint64_t) 1 << (list->index % SLOTS));
+    }
+
+    t->m_next = nullptr;
+    t->m_prev = nullptr;
+    t->m_list = nullptr;
+}
+
+/*
+* Puts a timer in the level where the expiration and the current time
+* first agree on all the higher order bits. Timers beyond the range of
+* the wheel are parked at its far end and placed again when they get there.
+*/
+void TimerWheel::place(Timer* t) {
+    uint64_t expires = t->m_expires;
+    const int range_bits = SLOT_BITS * LEVELS;
+
+    if ((expires >> range_bits) != (m_now >> range_bits)) {
+        expires = ((m_now >> range_bits) << range_bits) | (((uint64_t) 1 << range_bits) - 1);
+    }
+
+    int level = 0;
+
+    while (level < LEVELS - 1 && (expires >> (SLOT_BITS * (level + 1))) != (m_now >> (SLOT_BITS * (level + 1)))) {
+        ++level;
+    }
+
+    int slot = (int) ((expires >> (SLOT_BITS * level)) & (SLOTS - 1));
+
+    push(m_slots[level][slot], t);
+}
+
+/*
+* Schedules a timer to expire at the given tick. The earliest
+* a timer can expire is the next tick.
+*/
+void TimerWheel::add(Timer* t, uint64_t expires) {
+    if (t->m_list != nullptr) {
+        unlink(t);
+    }
+
+    t->m_expires = std::max(expires, m_now + 1);
+
+    place(t);
+}
+
+/*
+* Returns the earliest tick when a timer expires or has to move
+* to a lower level. UINT64_MAX if there are no timers.
+*/
+uint64_t TimerWheel::next_expiration() {
+    uint64_t next = UINT64_MAX;
+
+    for (int level = 0; level < LEVELS; ++level) {
+        if (m_occupied[level] == 0) {
+            continue;
+        }
+
+        int shift = SLOT_BITS * level;
+        int slot = lowest_bit(m_occupied[level]);
+        uint64_t tick = ((m_now >> (shift + SLOT_BITS)) << (shift + SLOT_BITS)) | ((uint64_t) slot << shift);
+
+        next = std::min(next, tick);
+    }
+
+    return next;
+}
+
+/*
+* Moves the wheel forward to the given tick. The expired
+* timers are moved to the expired list.
+*/
+void TimerWheel::advance(uint64_t tick, TimerList& expired) {
+    while (m_now < tick) {
+        uint64_t next = next_expiration();
+
+        if (next > tick) {
+            //Nothing happens in between
+            m_now = tick;
+
+            break;
+        }
+
+        m_now = next;
+
+        /*
+        * Move the timers down from the slots we have reached. Start at the top
+        * since timers from a higher level may land in a slot of a lower level
+        * that is due right now.
+        */
+        for (int level = LEVELS - 1; level > 0; --level) {
+            int shift = SLOT_BITS * level;
+
+            if ((m_now & (((uint64_t) 1 << shift) - 1)) != 0) {
+                continue;
+            }
+
+            TimerList& list = m_slots[level][(m_now >> shift) & (SLOTS - 1)];
+
+            while (list.head != nullptr) {
+                Timer* t = list.head;
+
+                unlink(t);
+                place(t);
+            }
+        }
+
+        TimerList& list = m_slots[0][m_now & (SLOTS - 1)];
+
+        while (list.head != nullptr) {
+            Timer* t = list.head;
+
+            unlink(t);
+
+            if (t->m_expires > m_now) {
+                //Was beyond the range of the wheel
+                place(t);
+            }
+            else {
+                push(expired, t);
+            }
+        }
+    }
+}
+
+/*
+* The producers link nodes in at the head. The consumer walks from the
+* tail. The stub node keeps the list from ever becoming empty, so
+* producers never have to touch the tail.
+*/
+TaskQueue::TaskQueue() : m_head(&m_stub), m_tail(&m_stub) {
+}
+
+TaskQueue::~TaskQueue() {
+    //Tasks that never ran are discarded
+    std::function<void()> task;
+
+    while (pop(task)) {
+    }
+}
+
+void TaskQueue::push(Node* n) {
+    n->next.store(nullptr, std::memory_order_relaxed);
+
+    Node* prev = m_head.exchange(n, std::memory_order_acq_rel);
+
+    prev->next.store(n, std::memory_order_release);
+}
+
+void TaskQueue::push(std::function<void()> task) {
+    Node* n = new Node();
+
+    n->task = std::move(task);
+
+    push(n);
+}
+
+/*
+* Removes the oldest task. Returns false if there is none. It may also return
+* false while a producer is in the middle of a push. The producer will then
+* wake up the consumer when it is done.
+*/
+bool TaskQueue::pop(std::function<void()>& task) {
+    Node* tail = m_tail;
+    Node* next = tail->next.load(std::memory_order_acquire);
+
+    if (tail == &m_stub) {
+        if (next == nullptr) {
+            return false;
+        }
+
+        m_tail = next;
+        tail = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+
+    if (next == nullptr) {
+        if (tail != m_head.load(std::memory_order_acquire)) {
+            //A producer has not linked its node yet
+            return false;
+        }
+
+        //Put the stub back so that the last node can be removed
+        push(&m_stub);
+
+        next = tail->next.load(std::memory_order_acquire);
+
+        if (next == nullptr) {
+            return false;
+        }
+    }
+
+    m_tail = next;
+    task = std::move(tail->task);
+
+    delete tail;
+
+    return true;
+}
+
+/*
+* A descriptor that becomes readable when another thread wants
+* to wake up the selector. Linux uses an eventfd. Windows can only
+* select() sockets, so a UDP socket that sends to itself is used there.
+* Other systems use a pipe.
+*/
+struct Wakeup {
+    SOCKET m_read_fd = INVALID_SOCKET;
+    SOCKET m_write_fd = INVALID_SOCKET;
+
+    Wakeup() {
+#if defined(__linux__)
+        m_read_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        if (m_read_fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "eventfd() failed");
+        }
+
+        m_write_fd = m_read_fd;
+#elif defined(_WIN32)
+        m_read_fd = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+        if (m_read_fd == INVALID_SOCKET) {
+            throw std::runtime_error("Failed to create a socket.");
+        }
+
+        struct sockaddr_in addr {};
+        int addr_len = sizeof(addr);
+
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        if (::bind(m_read_fd, (struct sockaddr*) &addr, sizeof(addr)) == SOCKET_ERROR ||
+            ::getsockname(m_read_fd, (struct sockaddr*) &addr, &addr_len) == SOCKET_ERROR ||
+            ::connect(m_read_fd, (struct sockaddr*) &addr, addr_len) == SOCKET_ERROR) {
+            ::closesocket(m_read_fd);
+
+            throw std::runtime_error("Failed to set up the wakeup socket.");
+        }
+
+        set_nonblocking(m_read_fd);
+
+        m_write_fd = m_read_fd;
+#else
+        int fds[2];
+
+        if (::pipe(fds) < 0) {
+            throw std::system_error(errno, std::generic_category(), "pipe() failed");
+        }
+
+        m_read_fd = fds[0];
+        m_write_fd = fds[1];
+
+        set_nonblocking(m_read_fd);
+        set_nonblocking(m_write_fd);
+#endif
+    }
+
+    ~Wakeup() {
+#ifdef _WIN32
+        ::closesocket(m_read_fd);
+#else
+        ::close(m_read_fd);
+
+        if (m_write_fd != m_read_fd) {
+            ::close(m_write_fd);
+        }
+#endif
+    }
+
+    void signal() {
+#if defined(__linux__)
+        uint64_t one = 1;
+
+        (void) !::write(m_write_fd, &one, sizeof(one));
+#elif defined(_WIN32)
+        char c = 0;
+
+        ::send(m_write_fd, &c, 1, 0);
+#else
+        char c = 0;
+
+        (void) !::write(m_write_fd, &c, 1);
+#endif
+    }
+
+    //Resets the descriptor to not readable
+    void clear() {
+#if defined(__linux__)
+        uint64_t count;
+
+        (void) !::read(m_read_fd, &count, sizeof(count));
+#elif defined(_WIN32)
+        char buff[64];
+
+        while (::recv(m_read_fd, buff, sizeof(buff), 0) > 0) {
+        }
+#else
+        char buff[64];
+
+        while (::read(m_read_fd, buff, sizeof(buff)) > 0) {
+        }
+#endif
+    }
+};
+
+#ifdef VELAR_HAS_COROUTINES
+/*
+* Frames share the size classes of the buffers. Being cache line aligned
+* they meet any alignment the compiler may need for a frame.
+*/
+void* FramePool::allocate(size_t size) {
+    return BufferPool::allocate(size);
+}
+
+void FramePool::deallocate(void* p, size_t size) {
+    BufferPool::deallocate((char*) p, size);
+}
+
+/*
+* Called when a task has run to completion. Control goes back to the coroutine
+* awaiting the task, if any. A spawned task is destroyed here.
+*/
+std::coroutine_handle<> TaskPromiseBase::finish(std::coroutine_handle<> self) noexcept {
+    if (m_continuation) {
+        return m_continuation;
+    }
+
+    if (m_selector != nullptr) {
+        m_selector->coroutine_finished(std::coroutine_handle<TaskPromise<void>>::from_address(self.address()));
+    }
+
+    return std::noop_coroutine();
+}
+
+void IoAwaiter::await_suspend(std::coroutine_handle<> h) {
+    Socket* s = m_socket.get();
+
+    if (s->m_selector == nullptr || s->m_canceled) {
+        throw std::runtime_error("Socket is not registered with a selector.");
+    }
+
+    IoAwaiter*& slot = m_is_write ? s->m_write_awaiter : s->m_read_awaiter;
+
+    if (slot != nullptr) {
+        throw std::runtime_error("Another coroutine is waiting for the socket.");
+    }
+
+    m_handle = h;
+    slot = this;
+
+    if (s->is_connection_pending() || s->is_report_acceptable()) {
+        //These are always reported
+        return;
+    }
+
+    if (m_is_write) {
+        m_was_reporting = s->is_report_writable();
+        s->report_writable(true);
+    }
+    else {
+        m_was_reporting = s->is_report_readable();
+        s->report_readable(true);
+    }
+}
+
+bool ReadAwaiter::try_complete() {
+    m_result = m_socket->read(m_buffer);
+
+    return m_result != 0;
+}
+
+void ReadAwaiter::fail() {
+    m_result = -1;
+}
+
+bool WriteAwaiter::try_complete() {
+    while (m_buffer.has_remaining()) {
+        int bytes_written = m_socket->write(m_buffer);
+
+        if (bytes_written < 0) {
+            m_result = -1;
+
+            return true;
+        }
+
+        if (bytes_written == 0) {
+            //Wait for room in the send buffer
+            return false;
+        }
+
+        m_result += bytes_written;
+    }
+
+    return true;
+}
+
+void WriteAwaiter::fail() {
+    m_result = -1;
+}
+
+bool AcceptAwaiter::try_complete() {
+    Selector* sel = m_socket->m_selector;
+
+    if (sel == nullptr) {
+        return true;
+    }
+
+#ifdef VELAR_USE_IO_URING
+    if (m_socket->m_accepted_fd != INVALID_SOCKET) {
+        m_client = sel->accept(m_socket, nullptr);
+
+        return true;
+    }
+#endif
+
+    SOCKET client_fd = sel->accept_fd(m_socket.get());
+
+    if (client_fd == INVALID_SOCKET) {
+        return false;
+    }
+
+    m_client = std::make_shared<Socket>(client_fd);
+
+    sel->add_socket(m_client);
+
+    return true;
+}
+
+void AcceptAwaiter::fail() {
+    m_client = nullptr;
+}
+
+bool ConnectAwaiter::try_complete() {
+    if (m_socket->is_connection_pending()) {
+        return false;
+    }
+
+    m_failed = m_socket->is_connection_failed();
+
+    return true;
+}
+
+void ConnectAwaiter::fail() {
+    m_failed = true;
+}
+
+std::shared_ptr<Socket> ConnectAwaiter::await_resume() {
+    if (m_failed) {
+        if (m_socket->m_selector != nullptr) {
+            m_socket->m_selector->cancel_socket(m_socket);
+        }
+
+        throw std::runtime_error("Failed to connect.");
+    }
+
+    return std::move(m_socket);
+}
+
+void Selector::spawn(Task<void> task) {
+    auto h = task.m_handle;
+
+    task.m_handle = nullptr;
+
+    h.promise().m_selector = this;
+    h.promise().m_slot = m_coroutines.size();
+
+    m_coroutines.push_back(h);
+
+    h.resume();
+
+    if (m_coroutine_error) {
+        auto error = m_coroutine_error;
+
+        m_coroutine_error = nullptr;
+
+        std::rethrow_exception(error);
+    }
+}
+
+void Selector::coroutine_finished(std::coroutine_handle<TaskPromise<void>> h) {
+    auto& promise = h.promise();
+
+    //Fill the hole with the last coroutine in the list
+    auto last = m_coroutines.back();
+
+    m_coroutines[promise.m_slot] = last;
+    last.promise().m_slot = promise.m_slot;
+    m_coroutines.pop_back();
+
+    if (promise.m_error && !m_coroutine_error) {
+        m_coroutine_error = promise.m_error;
+    }
+
+    h.destroy();
+}
+
+/*
+* Resumes the coroutines whose sockets are ready. Returns the number
+* of coroutines resumed.
+*/
+int Selector::resume_awaiters() {
+    int num_resumed = 0;
+
+    if (!m_failed_awaiters.empty()) {
+        std::vector<IoAwaiter*> failed;
+
+        failed.swap(m_failed_awaiters);
+
+        for (auto a : failed) {
+            a->fail();
+            a->m_handle.resume();
+
+            ++num_resumed;
+        }
+    }
+
+    for (size_t i = 0; i < m_ready.size(); ++i) {
+        //Hold on to the socket in case the coroutine drops it
+        std::shared_ptr<Socket> s = m_ready[i];
+
+        if (s->m_read_awaiter != nullptr && (s->is_readable() || s->is_acceptable())) {
+            IoAwaiter* a = s->m_read_awaiter;
+
+            if (a->try_complete()) {
+                s->m_read_awaiter = nullptr;
+
+                if (!s->is_report_acceptable()) {
+                    s->report_readable(a->m_was_reporting);
+                }
+
+                a->m_handle.resume();
+
+                ++num_resumed;
+            }
+        }
+
+        if (s->m_write_awaiter != nullptr && !s->m_canceled &&
+            (s->is_writable() || s->is_connection_success() || s->is_connection_failed())) {
+            IoAwaiter* a = s->m_write_awaiter;
+
+            if (a->try_complete()) {
+                s->m_write_awaiter = nullptr;
+
+                if (s->is_report_writable() != a->m_was_reporting) {
+                    s->report_writable(a->m_was_reporting);
+                }
+
+                a->m_handle.resume();
+
+                ++num_resumed;
+            }
+        }
+    }
+
+    if (m_coroutine_error) {
+        auto error = m_coroutine_error;
+
+        m_coroutine_error = nullptr;
+
+        std::rethrow_exception(error);
+    }
+
+    return num_resumed;
+}
+
+/*
+* The coroutines waiting for a canceled socket are resumed with
+* an error by the next select().
+*/
+void Selector::cancel_awaiters(Socket* s) {
+    if (s->m_read_awaiter != nullptr) {
+        m_failed_awaiters.push_back(s->m_read_awaiter);
+        s->m_read_awaiter = nullptr;
+    }
+
+    if (s->m_write_awaiter != nullptr) {
+        m_failed_awaiters.push_back(s->m_write_awaiter);
+        s->m_write_awaiter = nullptr;
+    }
+}
+#endif
+
+Selector::Selector() {
+    m_wakeup = std::make_unique<Wakeup>();
+
+#ifdef VELAR_USE_EPOLL
+    m_epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+
+    if (m_epoll_fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "epoll_create1() failed");
+    }
+
+    //The wakeup descriptor is told apart from the sockets by a null pointer
+    struct epoll_event ev {};
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+
+    if (::epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wakeup->m_read_fd, &ev) < 0) {
+        int error = errno;
+
+        ::close(m_epoll_fd);
+
+        throw std::system_error(error, std::generic_category(), "epoll_ctl() failed");
+    }
+#endif
+
+#ifdef VELAR_USE_IO_URING
+    try {
+        m_ring = std::make_unique<IoUring>(IO_URING_ENTRIES);
+    }
+    catch (...) {
+        ::close(m_epoll_fd);
+
+        throw;
+    }
+#endif
+}
+
+Selector::~Selector() {
+    if (m_resolver_link) {
+        //Lookups that are still running will find nobody to report to
+        std::lock_guard<std::mutex> guard(m_resolver_link->m_lock);
+
+        m_resolver_link->m_selector = nullptr;
+    }
+
+#ifdef VELAR_HAS_COROUTINES
+    /*
+    * Destroy the coroutines that have not finished. The awaiters live in
+    * their frames, so the sockets must forget about them first.
+    */
+    for (auto& s : m_sockets) {
+        s->m_read_awaiter = nullptr;
+        s->m_write_awaiter = nullptr;
+    }
+    for (auto& s : m_new_sockets) {
+        s->m_read_awaiter = nullptr;
+        s->m_write_awaiter = nullptr;
+    }
+
+    m_failed_awaiters.clear();
+
+    while (!m_coroutines.empty()) {
+        auto h = m_coroutines.back();
+
+        m_coroutines.pop_back();
+
+        h.destroy();
+    }
+#endif
+
+    admit_sockets();
+
+    /*
+    * Sockets may outlive the selector if the application holds on to them.
+    * Make sure they no longer refer back to us.
+    */
+    for (auto& s : m_sockets) {
+        s->m_selector = nullptr;
+    }
+
+#ifdef VELAR_USE_IO_URING
+    /*
+    * Operations in flight and the registered file table hold references
+    * to the sockets. The kernel drops them asynchronously after the ring is
+    * closed. That may leave a listening socket open for a while. So we
+    * cancel everything and wait for it before closing the ring.
+    */
+    for (auto& s : m_sockets) {
+        if (s->m_pending_ops > 0) {
+            cancel_io(s.get());
+
+            m_draining_sockets.push_back(s);
+        }
+        else {
+            release_file_slot(s.get());
+        }
+    }
+
+    for (int i = 0; i < 100 && !m_draining_sockets.empty(); ++i) {
+        struct __kernel_timespec ts {};
+        bool epoll_ready = false;
+
+        ts.tv_nsec = 10000000;
+
+        m_ring->enter(1, &ts);
+
+        complete_io(epoll_ready);
+    }
+
+    m_ring->register_op(IORING_UNREGISTER_FILES, nullptr, 0);
+    m_ring.reset();
+#endif
+
+#ifdef VELAR_USE_EPOLL
+    if (m_epoll_fd >= 0) {
+        ::close(m_epoll_fd);
+
+        m_epoll_fd = -1;
+    }
+#endif
+}
+
+/*
+* Registers a socket with the selector. From now on the selector will
+* report events for the socket until it is cancelled.
+*/
+void Selector::add_socket(std::shared_ptr<Socket> socket) {
+    socket->m_selector = this;
+
+    m_new_sockets.push_back(socket);
+
+    //Register the socket's current interest with the kernel
+    socket->interest_changed();
+}
+
+/*
+* Moves the newly registered sockets into the socket list.
+*/
+void Selector::admit_sockets() {
+    for (auto& s : m_new_sockets) {
+        s->m_slot = m_sockets.size();
+
+        m_sockets.push_back(std::move(s));
+    }
+
+    m_new_sockets.clear();
+}
+
+/*
+* Called by a socket when its reporting flags change. With epoll the
+* socket is queued so that its kernel registration can be updated at the
+* beginning of the next select(). With select() the fd sets are rebuilt
+* every time and there is nothing to do.
+*/
+void Socket::interest_changed() {
+#ifdef VELAR_USE_EPOLL
+    //A socket being resolved is registered when the lookup completes
+    if (m_selector != nullptr && !m_interest_dirty && !m_resolving) {
+        m_interest_dirty = true;
+
+        m_selector->m_dirty_sockets.push_back(this);
+    }
+#endif
+}
+
+void Selector::purge_sokets() {
+    for (auto& s : m_canceled_sockets) {
+#ifdef VELAR_USE_IO_URING
+        if (s->m_pending_ops > 0) {
+            /*
+            * The kernel still refers to the socket and possibly to the
+            * application's buffers. Keep the socket alive until the
+            * canceled operations have completed.
+            */
+            cancel_io(s.get());
+
+            m_draining_sockets.push_back(s);
+        }
+        else {
+            release_file_slot(s.get());
+        }
+#endif
+#ifdef VELAR_USE_EPOLL
+        if (s->m_registered_events != 0) {
+            ::epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, s->fd(), NULL);
+
+            s->m_registered_events = 0;
+        }
+#endif
+        s->m_selector = nullptr;
+
+        cancel_deadlines(s.get());
+
+        /*
+        * Fill the hole with the last socket in the list.
+        */
+        size_t slot = s->m_slot;
+
+        if (slot != m_sockets.size() - 1) {
+            m_sockets[slot] = std::move(m_sockets.back());
+            m_sockets[slot]->m_slot = slot;
+        }
+
+        m_sockets.pop_back();
     }
 
     m_canceled_sockets.clear();
 }
 
-int Selector::select(long timeout) {
-    fd_set read_fd_set, write_fd_set, except_fd_set;
-    struct timeval t;
+/*
+* Adds a socket that has an event to report to the ready list.
+* A socket can have more than one event but is listed only once.
+*/
+void Selector::add_ready(Socket* s) {
+    if (!s->m_in_ready_list) {
+        s->m_in_ready_list = true;
+
+        m_ready.push_back(s->shared_from_this());
+    }
+}
+
+/*
+* Resets the status flags of the sockets reported by the
+* last select() and empties the ready list.
+*/
+void Selector::clear_ready() {
+    for (auto& s : m_ready) {
+        s->m_in_ready_list = false;
+
+        s->set_acceptable(false);
+        s->set_readable(false);
+        s->set_writable(false);
+        s->set_connection_success(false);
+        s->set_read_complete(false);
+        s->set_write_complete(false);
+        s->set_idle_timeout(false);
+        s->set_read_timeout(false);
+        s->set_connect_timeout(false);
+        s->set_write_queue_drained(false);
+        s->set_write_failed(false);
+        s->set_connection_reused(false);
+    }
+
+    m_ready.clear();
+}
+
+/*
+* Returns true if the socket has an event the application can see.
+*/
+static bool has_events(Socket* s) {
+    return s->is_acceptable() ||
+        s->is_readable() ||
+        s->is_writable() ||
+        s->is_connection_success() ||
+        s->is_connection_failed() ||
+        s->is_read_complete() ||
+        s->is_write_complete() ||
+        s->is_idle_timeout() ||
+        s->is_read_timeout() ||
+        s->is_connect_timeout() ||
+        s->is_write_queue_drained() ||
+        s->is_write_failed();
+}
+
+/*
+* Takes the sockets that have nothing left to report out of the ready
+* list. These are relayed sockets and sockets whose only event was the
+* writable event asked for by the write queue. select() has handled
+* their events. Returns the number of sockets taken out.
+*/
+int Selector::drop_hidden_ready() {
+    size_t num_kept = 0;
+
+    for (size_t i = 0; i < m_ready.size(); ++i) {
+        Socket* s = m_ready[i].get();
+
+        if (!has_events(s)) {
+            s->m_in_ready_list = false;
+
+            continue;
+        }
+
+        if (num_kept != i) {
+            m_ready[num_kept] = std::move(m_ready[i]);
+        }
+
+        ++num_kept;
+    }
+
+    int num_dropped = (int) (m_ready.size() - num_kept);
+
+    m_ready.resize(num_kept);
+
+    return num_dropped;
+}
+
+int Selector::select(long timeout) {
+    if (timeout > 0) {
+        return select(std::chrono::microseconds(std::chrono::seconds(timeout)));
+    }
+    else {
+        //Wait indefinitely
+        return select(std::chrono::microseconds(-1));
+    }
+}
+
+int Selector::select(std::chrono::microseconds timeout) {
+    /*
+    * Only the sockets that had events last time can have their
+    * status flags set. Reset them before waiting again. This must
+    * happen before the tasks run since they may report events.
+    */
+    clear_ready();
+
+    int num_tasks = run_tasks();
+
+    /*
+    * Don't wait past the next timer expiration.
+    */
+    uint64_t next = m_timers.next_expiration();
+
+    if (next != UINT64_MAX) {
+        auto until_next = m_timers.time_until(next);
+
+        if (timeout.count() < 0 || until_next < timeout) {
+            timeout = until_next;
+        }
+    }
+
+    //Sockets left with data by drain() and reused connections are ready now
+    if (!m_pending_drains.empty() || !m_pending_reuses.empty()) {
+        timeout = std::chrono::microseconds::zero();
+    }
+
+#ifdef VELAR_USE_EPOLL
+    int num_events = select_epoll(timeout);
+#else
+    int num_events = select_fd_set(timeout);
+#endif
+
+    if (num_events < 0) {
+        return num_events;
+    }
+
+    num_events += report_pending_drains();
+    num_events += report_pending_reuses();
+
+    /*
+    * Move the data of the relays whose sockets have become ready.
+    * These events are not reported to the application.
+    */
+    for (size_t i = 0; i < m_ready.size(); ++i) {
+        Socket* s = m_ready[i].get();
+
+        if (s->m_relay && (s->is_readable() || s->is_writable())) {
+            s->set_readable(false);
+            s->set_writable(false);
+
+            pump_relay(s->m_relay);
+        }
+    }
+
+    //Run the tasks that have woken us up
+    num_tasks += run_tasks();
+
+    settle_races();
+
+    /*
+    * Write the queued data of the sockets that have become writable.
+    * The application only sees the writable event if it asked for it.
+    */
+    for (auto& s : m_ready) {
+        if (s->m_queued_bytes == 0 || !s->is_writable() || s->m_canceled) {
+            continue;
+        }
+
+        bool app_writable = !s->m_queue_writable;
+
+        if (s->flush_write_queue() < 0) {
+            s->set_write_failed(true);
+        }
+
+        s->update_write_queue();
+        s->set_writable(app_writable);
+    }
+
+#ifdef VELAR_HAS_COROUTINES
+    num_events += resume_awaiters();
+#endif
+
+    uint64_t now = m_timers.clock();
+
+    /*
+    * Record activity for the sockets with idle or read deadlines.
+    */
+    for (auto& s : m_ready) {
+        if (s->m_idle_timeout > 0) {
+            s->m_last_activity = now;
+        }
+        if (s->m_read_timeout > 0 && (s->is_readable() || s->is_read_complete())) {
+            s->m_last_read = now;
+        }
+    }
+
+    //Don't count the events that were handled here
+    num_events = std::max(num_events - drop_hidden_ready(), 0);
+
+    return num_events + num_tasks + expire_timers();
+}
+
+/*
+* One direction of a relay. Data read from one socket waits in a pipe, or a
+* buffer where splice() is not available, until the other socket takes it.
+* A full pipe stops the reading, so the sender is slowed down by TCP flow
+* control instead of the data piling up in memory.
+*/
+struct RelayDirection {
+    Socket* m_from;
+    Socket* m_to;
+#ifdef __linux__
+    int m_pipe[2] = { -1, -1 };
+    size_t m_capacity = 0;
+    size_t m_buffered = 0;
+#else
+    PooledByteBuffer m_buffer{ 65536 };
+#endif
+    //The source has stopped sending
+    bool m_eof = false;
+    //The destination has been told that no more data is coming
+    bool m_shut_down = false;
+
+    RelayDirection(Socket* from, Socket* to) : m_from(from), m_to(to) {
+#ifdef __linux__
+        if (::pipe2(m_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+            throw std::system_error(errno, std::generic_category(), "pipe2() failed");
+        }
+
+        //A larger pipe needs fewer system calls. It's fine if the system won't allow it.
+        ::fcntl(m_pipe[1], F_SETPIPE_SZ, 1024 * 1024);
+
+        int capacity = ::fcntl(m_pipe[1], F_GETPIPE_SZ);
+
+        m_capacity = capacity > 0 ? capacity : 65536;
+#endif
+    }
+
+    ~RelayDirection() {
+#ifdef __linux__
+        for (int fd : m_pipe) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+#endif
+    }
+
+    size_t buffered() {
+#ifdef __linux__
+        return m_buffered;
+#else
+        return m_buffer.position();
+#endif
+    }
+
+    bool wants_read() {
+#ifdef __linux__
+        return !m_eof && m_buffered < m_capacity;
+#else
+        return !m_eof && m_buffer.has_remaining();
+#endif
+    }
+
+    bool wants_write() {
+        return buffered() > 0;
+    }
+
+    /*
+    * Reads from the source. Returns the number of bytes read
+    * or -1 if the source has failed.
+    */
+    int fill() {
+#ifdef __linux__
+        ssize_t n = ::splice(m_from->fd(), NULL, m_pipe[1], NULL, m_capacity - m_buffered, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (n < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+
+        if (n == 0) {
+            m_eof = true;
+        }
+
+        m_buffered += n;
+
+        return (int) n;
+#else
+        int n = m_from->read(m_buffer);
+
+        if (n < 0) {
+            /*
+            * A graceful close can't be told apart from a failure here.
+            * Treat it as the end of the data.
+            */
+            m_eof = true;
+
+            return 0;
+        }
+
+        return n;
+#endif
+    }
+
+    /*
+    * Writes to the destination. Returns the number of bytes
+    * written or -1 if the destination has failed.
+    */
+    int flush() {
+#ifdef __linux__
+        ssize_t n = ::splice(m_pipe[0], NULL, m_to->fd(), NULL, m_buffered, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (n < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+
+        m_buffered -= n;
+
+        return (int) n;
+#else
+        m_buffer.flip();
+
+        int n = m_to->write(m_buffer);
+
+        m_buffer.compact();
+
+        return n;
+#endif
+    }
+
+    void shut_down() {
+#ifdef _WIN32
+        ::shutdown(m_to->fd(), SD_SEND);
+#else
+        ::shutdown(m_to->fd(), SHUT_WR);
+#endif
+
+        m_shut_down = true;
+    }
+};
+
+struct Relay {
+    RelayDirection m_forward;
+    RelayDirection m_backward;
+    std::function<void()> m_on_close;
+
+    Relay(Socket* a, Socket* b) : m_forward(a, b), m_backward(b, a) {
+    }
+};
+
+void Selector::start_relay(std::shared_ptr<Socket> a, std::shared_ptr<Socket> b, std::function<void()> on_close) {
+    if (a == b) {
+        throw std::invalid_argument("A socket can't be relayed to itself.");
+    }
+
+    if (a->m_relay || b->m_relay) {
+        throw std::runtime_error("Socket is already relaying.");
+    }
+
+    for (Socket* s : { a.get(), b.get() }) {
+        if (s->m_resolving || s->is_connection_pending()) {
+            throw std::invalid_argument("Socket is not connected yet.");
+        }
+
+        //The relay would send ahead of the queued data
+        if (s->m_queued_bytes > 0) {
+            throw std::invalid_argument("Socket has data queued by send().");
+        }
+    }
+
+    auto relay = std::make_shared<Relay>(a.get(), b.get());
+
+    relay->m_on_close = std::move(on_close);
+
+    a->m_relay = relay;
+    b->m_relay = relay;
+
+    //Data may already be waiting
+    pump_relay(relay);
+}
+
+/*
+* Moves data in both directions until neither can make progress, then
+* asks for the events that would let it continue. The number of rounds
+* is limited so that a busy relay doesn't hold up the other sockets.
+*/
+void Selector::pump_relay(std::shared_ptr<Relay> relay) {
+    RelayDirection* directions[] = { &relay->m_forward, &relay->m_backward };
+    bool progress = true;
+
+    for (int round = 0; round < 16 && progress; ++round) {
+        progress = false;
+
+        for (auto d : directions) {
+            if (d->wants_read()) {
+                int n = d->fill();
+
+                if (n < 0) {
+                    close_relay(relay);
+
+                    return;
+                }
+
+                progress = progress || n > 0;
+            }
+
+            if (d->wants_write()) {
+                int n = d->flush();
+
+                if (n < 0) {
+                    close_relay(relay);
+
+                    return;
+                }
+
+                progress = progress || n > 0;
+            }
+
+            //Pass the end of the data on once everything before it has been
+            if (d->m_eof && !d->wants_write() && !d->m_shut_down) {
+                d->shut_down();
+            }
+        }
+    }
+
+    if (relay->m_forward.m_shut_down && relay->m_backward.m_shut_down) {
+        close_relay(relay);
+
+        return;
+    }
+
+    for (auto d : directions) {
+        d->m_from->report_readable(d->wants_read());
+        d->m_to->report_writable(d->wants_write());
+    }
+}
+
+void Selector::close_relay(std::shared_ptr<Relay> relay) {
+    Socket* sockets[] = { relay->m_forward.m_from, relay->m_forward.m_to };
+
+    if (!sockets[0]->m_relay) {
+        //Already closed
+        return;
+    }
+
+    for (auto s : sockets) {
+        s->m_relay = nullptr;
+        s->report_readable(false);
+        s->report_writable(false);
+    }
+
+    for (auto s : sockets) {
+        cancel_socket(s->shared_from_this());
+    }
+
+    if (relay->m_on_close) {
+        relay->m_on_close();
+    }
+}
+
+/*
+* An edge triggered socket that still has data will not be reported by
+* the kernel again. Report the ones that drain() stopped early.
+*/
+int Selector::report_pending_drains() {
+    int num_events = 0;
+
+    for (auto& s : m_pending_drains) {
+        s->m_drain_pending = false;
+
+        if (s->m_canceled || s->m_selector != this || !s->is_report_readable()) {
+            continue;
+        }
+
+        s->set_readable(true);
+
+        add_ready(s.get());
+
+        ++num_events;
+    }
+
+    m_pending_drains.clear();
+
+    return num_events;
+}
+
+/*
+* A connection taken from a ConnectionPool is already open. It is reported
+* as connected by the next select(), the same as one from start_client().
+*/
+void Selector::report_reused(std::shared_ptr<Socket> socket) {
+    m_pending_reuses.push_back(std::move(socket));
+}
+
+int Selector::report_pending_reuses() {
+    int num_events = 0;
+
+    for (auto& s : m_pending_reuses) {
+        if (s->m_canceled || s->m_selector != this) {
+            continue;
+        }
+
+        s->set_connection_success(true);
+        s->set_connection_reused(true);
+
+        add_ready(s.get());
+
+        ++num_events;
+    }
+
+    m_pending_reuses.clear();
+
+    return num_events;
+}
+
+int Selector::dispatch() {
+    int num_calls = 0;
+
+    /*
+    * Handlers may add sockets to the ready list of a later select(), but not this one.
+    * They are kept in m_new_sockets until then. So looping by index is safe.
+    */
+    for (size_t i = 0; i < m_ready.size(); ++i) {
+        //Hold on to both in case the handler drops them
+        std::shared_ptr<Socket> s = m_ready[i];
+        std::shared_ptr<SocketHandler> h = s->m_handler;
+
+        if (!h) {
+            continue;
+        }
+
+        if (s->is_connection_success()) {
+            h->on_connected(*this, s);
+            ++num_calls;
+        }
+        if (s->is_connection_failed() && !s->m_canceled) {
+            h->on_error(*this, s);
+            ++num_calls;
+        }
+        if ((s->is_idle_timeout() || s->is_read_timeout()) && !s->m_canceled) {
+            h->on_timeout(*this, s);
+            ++num_calls;
+        }
+        if (s->is_acceptable() && !s->m_canceled) {
+            h->on_accept(*this, s);
+            ++num_calls;
+        }
+        if (s->is_readable() && !s->m_canceled) {
+            h->on_readable(*this, s);
+            ++num_calls;
+        }
+        if (s->is_read_complete() && !s->m_canceled) {
+            h->on_read_complete(*this, s);
+            ++num_calls;
+        }
+        if (s->is_writable() && !s->m_canceled) {
+            h->on_writable(*this, s);
+            ++num_calls;
+        }
+        if (s->is_write_complete() && !s->m_canceled) {
+            h->on_write_complete(*this, s);
+            ++num_calls;
+        }
+        if (s->is_write_queue_drained() && !s->m_canceled) {
+            h->on_write_queue_drained(*this, s);
+            ++num_calls;
+        }
+        if (s->is_write_failed() && !s->m_canceled) {
+            h->on_error(*this, s);
+            ++num_calls;
+        }
+    }
+
+    return num_calls;
+}
+
+/*
+* Runs the tasks posted from other threads. Returns the number of tasks run.
+*/
+int Selector::run_tasks() {
+    int num_tasks = 0;
+    std::function<void()> task;
+
+    /*
+    * Clear the flag before looking at the queue. A task posted after
+    * this point will send a new wakeup.
+    */
+    m_wakeup_pending.store(false, std::memory_order_seq_cst);
+
+    while (m_tasks.pop(task)) {
+        ++num_tasks;
+
+        task();
+    }
+
+    return num_tasks;
+}
+
+void Selector::post(std::function<void()> task) {
+    m_tasks.push(std::move(task));
+
+    wakeup();
+}
+
+void Selector::wakeup() {
+    //Only the first of many wakeups needs to signal
+    if (!m_wakeup_pending.exchange(true, std::memory_order_seq_cst)) {
+        m_wakeup->signal();
+    }
+}
+
+/*
+* Processes the expired timers. Socket deadlines are reported through the
+* socket's status flags and the ready list. For other timers the callback
+* is called. Returns the number of timers that have expired.
+*/
+int Selector::expire_timers() {
+    TimerList expired;
+    uint64_t now = m_timers.clock();
+    int num_expired = 0;
+
+    m_timers.advance(now, expired);
+
+    try {
+        while (expired.head != nullptr) {
+            Timer* t = expired.head;
+
+            TimerWheel::unlink(t);
+
+            if (t->m_socket == nullptr) {
+                if (t->m_period > 0) {
+                    m_timers.add(t, t->m_expires + t->m_period);
+                }
+
+                ++num_expired;
+
+                t->m_callback();
+
+                continue;
+            }
+
+            Socket* s = t->m_socket;
+
+            if (t->m_deadline == Socket::IS_CONNECT_TIMEOUT) {
+                if (!s->is_connection_pending()) {
+                    //The connection has completed in time
+                    continue;
+                }
+
+                if (s->m_race) {
+                    //Give up on all the attempts
+                    finish_race(s->m_race, nullptr);
+                }
+                else if (s->m_resolving) {
+                    //The lookup result will be ignored
+                    s->m_resolving = false;
+                    s->m_selector = nullptr;
+                }
+
+                s->set_connection_pending(false);
+                s->set_connection_failed(true);
+                s->set_connect_timeout(true);
+            }
+            else {
+                bool is_idle = t->m_deadline == Socket::IS_IDLE_TIMEOUT;
+                uint64_t timeout = is_idle ? s->m_idle_timeout : s->m_read_timeout;
+                uint64_t due = (is_idle ? s->m_last_activity : s->m_last_read) + timeout;
+
+                if (due > now) {
+                    //There was activity since the timer was set
+                    m_timers.add(t, due);
+
+                    continue;
+                }
+
+                //Report again if the socket stays idle
+                m_timers.add(t, now + timeout);
+
+                if (is_idle) {
+                    s->set_idle_timeout(true);
+                }
+                else {
+                    s->set_read_timeout(true);
+                }
+            }
+
+            add_ready(s);
+
+            ++num_expired;
+        }
+    }
+    catch (...) {
+        //Don't lose the timers that have not been processed yet
+        while (expired.head != nullptr) {
+            Timer* t = expired.head;
+
+            TimerWheel::unlink(t);
+
+            m_timers.add(t, now);
+        }
+
+        throw;
+    }
+
+    return num_expired;
+}
+
+void Selector::schedule(Timer& timer, std::chrono::microseconds delay, std::function<void()> callback, std::chrono::microseconds period) {
+    timer.m_callback = std::move(callback);
+    timer.m_socket = nullptr;
+    timer.m_period = period.count() > 0 ? m_timers.to_ticks(period) : 0;
+
+    m_timers.add(&timer, m_timers.deadline(delay));
+}
+
+void Selector::cancel_timer(Timer& timer) {
+    if (timer.m_list != nullptr) {
+        TimerWheel::unlink(&timer);
+    }
+}
+
+void Selector::set_idle_timeout(std::shared_ptr<Socket> socket, std::chrono::microseconds timeout) {
+    Timer& t = socket->m_idle_timer;
+
+    //Activity is recorded in whole ticks, add one to not time out early
+    socket->m_idle_timeout = timeout.count() > 0 ? m_timers.to_ticks(timeout) + 1 : 0;
+
+    if (socket->m_idle_timeout == 0) {
+        cancel_timer(t);
+
+        return;
+    }
+
+    socket->m_last_activity = m_timers.clock();
+
+    t.m_socket = socket.get();
+    t.m_deadline = Socket::IS_IDLE_TIMEOUT;
+
+    m_timers.add(&t, socket->m_last_activity + socket->m_idle_timeout);
+}
+
+void Selector::set_read_timeout(std::shared_ptr<Socket> socket, std::chrono::microseconds timeout) {
+    Timer& t = socket->m_read_timer;
+
+    //Activity is recorded in whole ticks, add one to not time out early
+    socket->m_read_timeout = timeout.count() > 0 ? m_timers.to_ticks(timeout) + 1 : 0;
+
+    if (socket->m_read_timeout == 0) {
+        cancel_timer(t);
+
+        return;
+    }
+
+    socket->m_last_read = m_timers.clock();
+
+    t.m_socket = socket.get();
+    t.m_deadline = Socket::IS_READ_TIMEOUT;
+
+    m_timers.add(&t, socket->m_last_read + socket->m_read_timeout);
+}
+
+void Selector::set_connect_timeout(std::shared_ptr<Socket> socket, std::chrono::microseconds timeout) {
+    Timer& t = socket->m_connect_timer;
+
+    if (timeout.count() <= 0) {
+        cancel_timer(t);
+
+        return;
+    }
+
+    t.m_socket = socket.get();
+    t.m_deadline = Socket::IS_CONNECT_TIMEOUT;
+
+    m_timers.add(&t, m_timers.deadline(timeout));
+}
+
+void Selector::cancel_deadlines(Socket* s) {
+    cancel_timer(s->m_idle_timer);
+    cancel_timer(s->m_read_timer);
+    cancel_timer(s->m_connect_timer);
+}
+
+#ifdef VELAR_USE_EPOLL
+/*
+* Brings the kernel's interest list in sync with the reporting flags of
+* the sockets that have changed since the last call. Sockets that no longer
+* want any event are removed from the interest list altogether. Otherwise
+* EPOLLHUP and EPOLLERR, which are always reported, would make epoll_wait()
+* return right away for a socket nobody is listening to.
+*/
+void Selector::update_interest() {
+    for (auto s : m_dirty_sockets) {
+        s->m_interest_dirty = false;
+
+        uint32_t events = 0;
+
+        if (s->is_report_readable() || s->is_report_acceptable()) {
+            events |= EPOLLIN;
+        }
+        if (s->is_report_writable() || s->is_connection_pending()) {
+            events |= EPOLLOUT;
+        }
+        if (events != 0 && s->m_edge_triggered) {
+            events |= EPOLLET;
+        }
+
+        //Modifying the registration makes the kernel report current readiness again
+        bool rearm = s->m_rearm;
+
+        s->m_rearm = false;
+
+        if (events == s->m_registered_events && !(rearm && events != 0)) {
+            continue;
+        }
+
+        struct epoll_event ev {};
+
+        ev.events = events;
+        ev.data.ptr = s;
+
+        int status = 0;
+
+        if (events == 0) {
+            status = ::epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, s->fd(), NULL);
+        }
+        else if (s->m_registered_events == 0) {
+            status = ::epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, s->fd(), &ev);
+        }
+        else {
+            status = ::epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, s->fd(), &ev);
+        }
+
+        if (status < 0) {
+            throw std::system_error(errno, std::generic_category(), "epoll_ctl() failed");
+        }
+
+        s->m_registered_events = events;
+    }
+
+    m_dirty_sockets.clear();
+}
+
+int Selector::select_epoll(std::chrono::microseconds timeout) {
+    admit_sockets();
+
+    //This must happen before the canceled sockets are destroyed
+    update_interest();
+
+    purge_sokets();
+
+    if (m_events.size() < m_sockets.size()) {
+        m_events.resize(m_sockets.size());
+    }
+    else if (m_events.empty()) {
+        m_events.resize(64);
+    }
+
+    /*
+    * epoll_wait() takes milliseconds. Round up so that we never
+    * return before a timer is due.
+    */
+    int epoll_timeout = timeout.count() < 0 ? -1 : (int) ((timeout.count() + 999) / 1000);
+    int num_completions = 0;
+
+#ifdef VELAR_USE_IO_URING
+    /*
+    * Submit all the queued operations and wait for completions in a single
+    * system call. Socket readiness is detected by polling the epoll
+    * descriptor through the ring.
+    */
+    if (!m_ring->m_epoll_armed) {
+        auto sqe = m_ring->get_sqe();
+
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = m_epoll_fd;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = IoUring::EPOLL_DATA;
+
+        m_ring->m_epoll_armed = true;
+    }
+
+    struct __kernel_timespec ts {};
+
+    ts.tv_sec = timeout.count() / 1000000;
+    ts.tv_nsec = (timeout.count() % 1000000) * 1000;
+
+    if (m_ring->enter(1, timeout.count() >= 0 ? &ts : nullptr) < 0) {
+        if (errno == EINTR) {
+            //A signal was handled
+            return -1;
+        }
+        else if (errno != ETIME && errno != EBUSY) {
+            throw std::system_error(errno, std::generic_category(), "io_uring_enter() failed");
+        }
+    }
+
+    bool epoll_ready = false;
+
+    num_completions = complete_io(epoll_ready);
+
+    if (!epoll_ready) {
+        return num_completions;
+    }
+
+    //Collect the readiness events without waiting
+    epoll_timeout = 0;
+#endif
+
+#ifdef VELAR_HAS_EPOLL_PWAIT2
+    /*
+    * epoll_pwait2() has nanosecond resolution which lets
+    * timers expire with sub-millisecond precision.
+    */
+    struct timespec pwait_ts {};
+
+    pwait_ts.tv_sec = timeout.count() / 1000000;
+    pwait_ts.tv_nsec = (timeout.count() % 1000000) * 1000;
+
+    if (epoll_timeout == 0) {
+        pwait_ts = {};
+    }
+
+    int num_events = ::epoll_pwait2(
+        m_epoll_fd,
+        m_events.data(),
+        (int) m_events.size(),
+        epoll_timeout < 0 ? NULL : &pwait_ts,
+        NULL);
+
+    if (num_events < 0 && errno == ENOSYS) {
+        //Old kernel
+        num_events = ::epoll_wait(
+            m_epoll_fd,
+            m_events.data(),
+            (int) m_events.size(),
+            epoll_timeout);
+    }
+#else
+    int num_events = ::epoll_wait(
+        m_epoll_fd,
+        m_events.data(),
+        (int) m_events.size(),
+        epoll_timeout);
+#endif
+
+    if (num_events < 0) {
+        if (errno == EINTR) {
+            //A signal was handled
+            return num_events;
+        }
+        else {
+            throw std::runtime_error("epoll_wait() failed.");
+        }
+    }
+
+    int num_wakeups = 0;
+
+    for (int i = 0; i < num_events; ++i) {
+        auto s = (Socket*) m_events[i].data.ptr;
+        uint32_t events = m_events[i].events;
+
+        if (s == nullptr) {
+            //Woken up by another thread
+            m_wakeup->clear();
+
+            ++num_wakeups;
+
+            continue;
+        }
+
+        if (s->is_connection_pending()) {
+            /*
+            * Test for connect() completion status. A failed connect is
+            * reported as EPOLLERR or EPOLLHUP.
+            */
+            int valopt;
+            socklen_t lon = sizeof(int);
+
+            if (::getsockopt(s->fd(), SOL_SOCKET, SO_ERROR, (void*)(&valopt), &lon) < 0) {
+                throw std::runtime_error("Error in getsockopt().");
+            }
+
+            if (valopt) {
+                s->set_connection_failed(true);
+            }
+            else {
+                s->set_connection_success(true);
+            }
+
+            s->set_connection_pending(false);
+        }
+        else {
+            /*
+            * Errors and hang ups are delivered as readable or writable
+            * events. The subsequent read() or write() will then
+            * report the problem to the application.
+            */
+            bool readable = (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0;
+            bool writable = (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) != 0;
+
+            //For a server socket, readable means new client
+            //waiting to be accepted
+            if (s->is_report_acceptable()) {
+                s->set_acceptable(readable);
+            }
+            else {
+                s->set_readable(readable && s->is_report_readable());
+            }
+
+            s->set_writable(writable && s->is_report_writable());
+        }
+
+        add_ready(s);
+    }
+
+    return num_events - num_wakeups + num_completions;
+}
+#endif
+
+#ifndef VELAR_USE_EPOLL
+void Selector::populate_fd_set(fd_set& read_fd_set, fd_set& write_fd_set, fd_set& except_fd_set) {
+    FD_ZERO(&read_fd_set);
+    FD_ZERO(&write_fd_set);
+    FD_ZERO(&except_fd_set);
+
+    for (auto& s : m_sockets) {
+        if (s->is_report_readable() || s->is_report_acceptable()) {
+            FD_SET(s->fd(), &read_fd_set);
+        }
+        if (s->is_report_writable()) {
+            FD_SET(s->fd(), &write_fd_set);
+        }
+        if (s->is_connection_pending()) {
+            /*
+            * Detecting connect() completion status is platform dependent.
+            * In Winsock, we use exception fd set for error and write fd set for success. 
+            * In BSD socket, we query writable event and then test for SO_ERROR.
+            */
+#ifdef _WIN32
+            FD_SET(s->fd(), &except_fd_set);
+#endif
+            FD_SET(s->fd(), &write_fd_set);
+
+        }
+    }
+}
+
+int Selector::select_fd_set(std::chrono::microseconds timeout) {
+    fd_set read_fd_set, write_fd_set, except_fd_set;
+    struct timeval t;
+
+    t.tv_sec = (long) (timeout.count() / 1000000);
+    t.tv_usec = (long) (timeout.count() % 1000000);
+
+    admit_sockets();
+
+    purge_sokets();
+
+    populate_fd_set(read_fd_set, write_fd_set, except_fd_set);
+
+    FD_SET(m_wakeup->m_read_fd, &read_fd_set);
+
+    int num_events = ::select(
+        FD_SETSIZE,
+        &read_fd_set,
+        &write_fd_set,
+        NULL,
+        timeout.count() >= 0 ? &t : NULL);
+
+#ifdef _WIN32
+    if (num_events == SOCKET_ERROR) {
+        int status = ::WSAGetLastError();
+
+        if (status == WSAEINTR || status == WSAEINPROGRESS) {
+            return num_events;
+        }
+        else {
+            throw std::runtime_error("select() failed.");
+        }
+    }
+#else
+    if (num_events < 0) {
+        if (errno == EINTR) {
+            //A signal was handled
+            return num_events;
+        }
+        else {
+            throw std::runtime_error("select() failed.");
+        }
+    }
+#endif
+
+    if (FD_ISSET(m_wakeup->m_read_fd, &read_fd_set)) {
+        //Woken up by another thread
+        m_wakeup->clear();
+
+        --num_events;
+    }
+
+    if (num_events == 0) {
+        //Timeout
+        return num_events;
+    }
+
+    for (auto& s : m_sockets) {
+        if (s->is_connection_pending()) {
+            /*
+            * Test for connect() completion status.
+            */
+#ifdef _WIN32
+            /*
+            * It appears that both write fd set and except fd set are set for 
+            * the socket for a successful connection. We must test for the
+            * write fd set before except fd set to determine success.
+            */
+            if (FD_ISSET(s->fd(), &write_fd_set)) {
+                s->set_connection_success(true);
+                s->set_connection_pending(false);
+            }
+            else if ((FD_ISSET(s->fd(), &except_fd_set))) {
+                //connect() has failed
+                s->set_connection_failed(true);
+                s->set_connection_pending(false);
+            }
+#else
+            if (FD_ISSET(s->fd(), &write_fd_set)) {
+                int valopt;
+                socklen_t lon = sizeof(int);
+
+                if (::getsockopt(s->fd(), SOL_SOCKET, SO_ERROR, (void*)(&valopt), &lon) < 0) {
+                    throw std::runtime_error("Error in getsockopt().");
+                }
+
+                if (valopt) {
+                    s->set_connection_failed(true);
+                    s->set_connection_pending(false);
+                }
+                else {
+                    s->set_connection_success(true);
+                    s->set_connection_pending(false);
+                }
+            }
+#endif
+            if (s->is_connection_pending()) {
+                //Still connecting. Other sockets had events.
+                continue;
+            }
+
+            add_ready(s.get());
+        }
+        else {
+            /*
+            * The success flag is not reset here. clear_ready() has done that
+            * and a client whose host name was just resolved has set it again.
+            */
+
+            //For a server socket, readable means new client
+            //waiting to be accepted
+            if (s->is_report_acceptable()) {
+                s->set_acceptable((FD_ISSET(s->fd(), &read_fd_set)));
+            } else {
+                s->set_readable((FD_ISSET(s->fd(), &read_fd_set)));
+            }
+            
+            s->set_writable((FD_ISSET(s->fd(), &write_fd_set)));
+
+            if (s->is_acceptable() || s->is_readable() || s->is_writable()) {
+                add_ready(s.get());
+            }
+        }
+    }
+
+    return num_events;
+}
+#endif
+
+/*
+* Removes this socket from the set of sockets monitored by the selector.
+* The socket will be eventually closed and destroyed.
+*/
+void Selector::cancel_socket(std::shared_ptr<Socket> socket) {
+    if (socket->m_selector != this || socket->m_canceled) {
+        return;
+    }
+
+    socket->m_canceled = true;
+
+    if (socket->m_relay) {
+        //The other socket goes with it
+        close_relay(socket->m_relay);
+    }
+
+    if (socket->m_resolving) {
+        //Not registered yet. The lookup result will be ignored.
+        if (socket->m_race) {
+            finish_race(socket->m_race, nullptr);
+        }
+
+        socket->m_resolving = false;
+        socket->m_selector = nullptr;
+
+#ifdef VELAR_HAS_COROUTINES
+        cancel_awaiters(socket.get());
+#endif
+
+        return;
+    }
+
+    m_canceled_sockets.push_back(socket);
+
+#ifdef VELAR_HAS_COROUTINES
+    cancel_awaiters(socket.get());
+#endif
+}
+
+Socket::Socket(SOCKET fd) : m_fd(fd) {
+
+}
+
+Socket::Socket(int domain, int type, int protocol) : m_fd(INVALID_SOCKET) {
+    m_fd = ::socket(domain, type, protocol);
+
+    if (m_fd == INVALID_SOCKET) {
+        throw std::runtime_error("Failed to create a socket.");
+    }
+
+    m_io_flag.reset();
+}
+
+Socket::~Socket() {
+#ifdef VELAR_USE_IO_URING
+    if (m_accepted_fd != INVALID_SOCKET) {
+        //A client accepted by io_uring that was never handed over
+        ::close(m_accepted_fd);
+
+        m_accepted_fd = INVALID_SOCKET;
+    }
+#endif
+
+    if (m_fd != INVALID_SOCKET) {
+#ifdef _WIN32
+        ::closesocket(m_fd);
+#else
+        ::close(m_fd);
+#endif
+
+        m_fd = INVALID_SOCKET;
+    }
+}
+
+DatagramClientSocket::DatagramClientSocket(addrinfo* res) : 
+    server_address(res),
+    Socket(res->ai_family, res->ai_socktype, res->ai_protocol)
+{
+}
+
+DatagramClientSocket::DatagramClientSocket() :
+    Socket(INVALID_SOCKET),
+    server_address(NULL)
+{
+}
+
+/*
+* Creates the file descriptor for a socket whose server address has just been resolved.
+* The address is shared with the resolver's result.
+*/
+void DatagramClientSocket::open(std::shared_ptr<addrinfo> res) {
+    m_fd = ::socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+
+    if (m_fd == INVALID_SOCKET) {
+        throw std::runtime_error("Failed to create a socket.");
+    }
+
+    set_nonblocking(m_fd);
+
+    m_resolved_address = res;
+    server_address = res.get();
+}
+
+DatagramClientSocket::~DatagramClientSocket() {
+    if (server_address != NULL && !m_resolved_address) {
+        ::freeaddrinfo(server_address);
+
+        server_address = NULL;
+    }
+}
+
+/*
+* Writes data from the buffer to the address and port that
+* this socket was constructed with. The buffer's position is
+* moved forward by the number of bytes written. The limit
+* remains unchanged. If not all the data could be written,
+* calling has_remaining() on the buffer will return true.
+*/
+int DatagramClientSocket::sendto(ByteBuffer& b) {
+    if (server_address == NULL) {
+        throw std::runtime_error("The server address is not resolved yet.");
+    }
+
+    return sendto(b, server_address->ai_addr, server_address->ai_addrlen);
+}
+
+/*
+* After the first time sendto() is called for a UDP socket it
+* gets implicitly bound to the destination server's address and port.
+* You can then call recvfrom(). This will receive data from the server where the
+* original sendto() request was sent.
+* 
+* The position of the buffer is moved forward by the number of bytes received.
+* Limit is left unchanged. You should flip() the buffer before reading
+* from it.
+*/
+int DatagramClientSocket::recvfrom(ByteBuffer& b) {
+    return recvfrom(b, nullptr, nullptr);
+}
+
+#ifdef VELAR_HAS_SPAN
+int DatagramClientSocket::sendto(std::span<ByteBuffer* const> buffers) {
+    if (server_address == NULL) {
+        throw std::runtime_error("The server address is not resolved yet.");
+    }
+
+    return sendto(buffers, server_address->ai_addr, server_address->ai_addrlen);
+}
+
+int DatagramClientSocket::recvfrom(std::span<ByteBuffer* const> buffers) {
+    return recvfrom(buffers, nullptr, nullptr);
+}
+#endif
+
+/*
+* Reads data from this socket into the supplied ByteBuffer at the current position of the buffer.
+* Upon a successful read the position of the buffer is incremented but limit remains unchanged.
+* Before you retrieve data from the buffer you should call flip().
+* 
+* When you try to read from a socket many things can happen. Winsock and BSD socket deal with
+* these situations slightly differently. Here we normalize the situations by returning an 
+* uniform value for both platforms. Here are the possible cases:
+* 
+* - Read was successful. In this case, the number of bytes read, a positive number, is returned.
+* - An attempted read would lead to blocking. In this case 0 is returned.
+* - The other party has disconnected gracefully, meaning they have closed their end of the socket. In this
+* case a negative value is returned.
+* - The other party has disconnected ungracefully, meaning somehow the connection was severed. In this case,
+* we return a negative value.
+* 
+* If a negative value is returned, then applications should treat the socket as unusuable. 
+* They should cancel the socket.
+*/
+int Socket::read(ByteBuffer& b) {
+    if (b.is_read_only()) {
+        throw std::runtime_error("Buffer is read only.");
+    }
+
+    if (!b.has_remaining()) {
+        throw std::runtime_error("Buffer is full.");
+    }
+
+#ifdef _WIN32
+    int bytes_read = ::recv(
+        m_fd,
+        b.array() + b.position(),
+        b.remaining(),
+        0);
+
+    if (bytes_read == SOCKET_ERROR) {
+        int err = ::WSAGetLastError();
+
+        if (err == WSAECONNRESET) {
+            //Ungraceful disconnect by the other party
+            return -1;
+        }
+
+        if (err == WSAEWOULDBLOCK) {
+            //Not an error really.
+            return 0;
+        }
+        else {
+            //A real error has taken place.
+            return -1;
+        }
+    }
+#else
+    int bytes_read = ::read(
+        m_fd,
+        b.array() + b.position(),
+        b.remaining());
+
+    if (bytes_read < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            //Not an error really.
+            return 0;
+        }
+        else {
+            //A real error has taken place.
+            return -1;
+        }
+    }
+#endif
+
+    if (bytes_read == 0) {
+        /*
+        * The other party has disconnected:
+        * Gracefully in Windows.
+        * Gracefully or ungracefully in Linux.
+        */
+        return -1;
+    }
+
+    if (bytes_read < 0) {
+        //This should have been handled above already.
+        throw std::runtime_error("Invalid state.");
+    }
+
+    //Forward the position
+    b.position(b.position() + bytes_read);
+
+    return bytes_read;
+}
+
+
+int Socket::recvfrom(ByteBuffer& b, sockaddr* from, int* from_len) {
+    if (b.is_read_only()) {
+        throw std::runtime_error("Buffer is read only.");
+    }
+
+    if (!b.has_remaining()) {
+        throw std::runtime_error("Buffer is full.");
+    }
+
+#ifdef _WIN32
+    int bytes_read = ::recvfrom(
+        m_fd,
+        b.array() + b.position(),
+        b.remaining(),
+        0,
+        from,
+        from_len);
+
+    if (bytes_read == SOCKET_ERROR) {
+        int err = ::WSAGetLastError();
+
+        if (err == WSAECONNRESET) {
+            //Ungraceful disconnect by the other party
+            return -1;
+        } else if (err == WSAEWOULDBLOCK) {
+            //Not an error really.
+            return 0;
+        }
+        else if (err == WSAEMSGSIZE) {
+            /*
+            * A partial read took place. In Windows this is an error.
+            * But in Linux it is not an error.
+            * 
+            * We make our recvfrom()
+            * behave the same way as in Linux by returning the number of bytes 
+            * saved in the buffer.
+            */
+            
+            bytes_read = b.remaining();
+        }
+        else {
+            //A real error has taken place.
+            return -1;
+        }
+    }
+#else
+    int bytes_read = ::recvfrom(
+        m_fd,
+        b.array() + b.position(),
+        b.remaining(),
+        0,
+        from,
+        (socklen_t*) 
+        from_len);
+
+    if (bytes_read < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            //Not an error really.
+            return 0;
+        }
+        else {
+            //A real error has taken place.
+            return -1;
+        }
+    }
+#endif
+
+    if (bytes_read == 0) {
+        /*
+        * The other party has disconnected:
+        * Gracefully in Windows.
+        * Gracefully or ungracefully in Linux.
+        */
+        return -1;
+    }
+
+    if (bytes_read < 0) {
+        //This should have been handled above already.
+        throw std::runtime_error("Invalid state.");
+    }
+
+    //Forward the position
+    b.position(b.position() + bytes_read);
+
+    return bytes_read;
+}
+
+/*
+* Writes any remaining data from this ByteBuffer into the socket.
+* Upon a successful write the position of the buffer is incremented by the
+* number of bytes actually written. The limit remains unchanged.
+* This way, the buffer keeps track of how much data was sent and how much is yet to be sent.
+* In a nonblocking socket it is common that not all the data can be sent at the same time.
+* You can call write() for the same buffer repetedly until all the data is fully sent.
+*
+* When you try to write to a socket many things can happen. Winsock and BSD socket deal with
+* these situations slightly differently. Here we normalize the situations by returning an
+* uniform value for both platforms. Here are the possible cases:
+*
+* - Write was successful. In this case, the number of bytes written, a positive number, is returned.
+* - An attempted write would lead to blocking. In this case 0 is returned.
+* - The other party has disconnected gracefully, meaning they have closed their end of the socket. In this
+* case a negative value is returned.
+* - The other party has disconnected ungracefully, meaning somehow the connection was severed. In this case,
+* we return a negative value.
+*
+* If a negative value is returned, then applications should treat the socket as unusuable.
+* They should cancel the socket.
+*/
+int Socket::write(ByteBuffer& b) {
+    if (!b.has_remaining()) {
+        throw std::runtime_error("Buffer is empty.");
+    }
+
+#ifdef _WIN32
+    int bytes_written = ::send(
+        m_fd,
+        b.array() + b.position(),
+        b.remaining(),
+        0);
+
+    if (bytes_written == SOCKET_ERROR) {
+        int err = ::WSAGetLastError();
+
+        if (err == WSAECONNRESET) {
+            //Ungraceful disconnect
+            return -1;
+        }
+
+        if (err == WSAEWOULDBLOCK) {
+            //Not a real error
+            return 0;
+        }
+        else {
+            //A real error has taken place.
+            return -1;
+        }
+    }
+#else
+    int bytes_written = ::write(
+        m_fd,
+        b.array() + b.position(),
+        b.remaining());
+
+    if (bytes_written < 0) {
+        if (errno == EAGAIN && errno == EWOULDBLOCK) {
+            //Not a real error
+            return 0;
+        }
+        else {
+            //A real error has taken place.
+            return -1;
+        }
+    }
+#endif
+
+    if (bytes_written == 0) {
+        /*
+        * The other party has disconnected:
+        * Gracefully in Windows.
+        * Gracefully or ungracefully in Linux.
+        */
+        return -1;
+    }
+
+    if (bytes_written < 0) {
+        //This should have been handled above already.
+        throw std::runtime_error("Invalid state.");
+    }
+
+    //Forward the position
+    b.position(b.position() + bytes_written);
+
+    return bytes_written;
+}
+
+/*
+* read() returns zero only when the socket would block, so the loops
+* here and in the drain() template end at the first empty read.
+*/
+DrainResult Socket::drain(ByteBuffer& b, size_t budget) {
+    return drain(b, budget, nullptr);
+}
+
+DrainResult Socket::drain(ChainedByteBuffer& b, size_t budget) {
+    DrainResult result;
+
+    while (result.bytes_read < budget) {
+        int n = read(b, std::min(budget - result.bytes_read, (size_t) 65536));
+
+        if (n < 0) {
+            result.closed = true;
+
+            return result;
+        }
+
+        if (n == 0) {
+            return result;
+        }
+
+        result.bytes_read += n;
+    }
+
+    result.more = true;
+
+    drain_stopped();
+
+    return result;
+}
+
+/*
+* With edge triggered events the kernel won't report the data left
+* unread. The selector reports the socket again instead.
+*/
+void Socket::drain_stopped() {
+    if (m_edge_triggered && m_selector != nullptr && !m_drain_pending) {
+        m_drain_pending = true;
 
-    t.tv_sec = timeout;
-    t.tv_usec = 0;
+        m_selector->m_pending_drains.push_back(shared_from_this());
+    }
+}
 
-    purge_sokets();
+FileRegion::FileRegion(const char* file_name, uint64_t offset, uint64_t length) : m_offset(offset) {
+#ifdef _WIN32
+    m_file = ::CreateFileA(
+        file_name,
+        GENERIC_READ,
+        FILE_SHARE_READ,
+        NULL,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+        NULL);
 
-    populate_fd_set(read_fd_set, write_fd_set, except_fd_set);
+    if (m_file == INVALID_HANDLE_VALUE) {
+        throw std::system_error(::GetLastError(), std::system_category(), "CreateFileA failed.");
+    }
 
-    int num_events = ::select(
-        FD_SETSIZE,
-        &read_fd_set,
-        &write_fd_set,
-        NULL,
-        timeout > 0 ? &t : NULL);
+    LARGE_INTEGER size;
+
+    if (!::GetFileSizeEx(m_file, &size)) {
+        DWORD err = ::GetLastError();
+
+        ::CloseHandle(m_file);
+
+        throw std::system_error(err, std::system_category(), "GetFileSizeEx failed.");
+    }
+
+    uint64_t file_size = size.QuadPart;
+#else
+    m_file = ::open(file_name, O_RDONLY | O_CLOEXEC);
+
+    if (m_file < 0) {
+        throw std::system_error(errno, std::generic_category(), "open() failed");
+    }
+
+    struct stat sbuf;
+
+    if (::fstat(m_file, &sbuf) == -1) {
+        int err = errno;
+
+        ::close(m_file);
 
+        throw std::system_error(err, std::generic_category(), "fstat() failed");
+    }
+
+    uint64_t file_size = sbuf.st_size;
+#endif
+
+    if (offset > file_size) {
 #ifdef _WIN32
-    if (num_events == SOCKET_ERROR) {
-        int status = ::WSAGetLastError();
+        ::CloseHandle(m_file);
+#else
+        ::close(m_file);
+#endif
 
-        if (status == WSAEINTR || status == WSAEINPROGRESS) {
-            return num_events;
+        throw std::out_of_range("Offset is past the end of the file.");
+    }
+
+    m_end = offset + std::min(length, file_size - offset);
+}
+
+FileRegion::~FileRegion() {
+#ifdef _WIN32
+    if (m_file != INVALID_HANDLE_VALUE) {
+        ::CloseHandle(m_file);
+    }
+#else
+    if (m_file >= 0) {
+        ::close(m_file);
+    }
+#endif
+}
+
+/*
+* sendfile() moves the data from the page cache to the socket in the kernel.
+* Where it is not available a bounded chunk is read with pread() or
+* ReadFile() and written. Only the bytes accepted by the socket count, so
+* the rest is read again next time.
+*/
+int Socket::transfer_from(FileRegion& file) {
+    if (!file.has_remaining()) {
+        throw std::runtime_error("File region is empty.");
+    }
+
+    if (m_queued_bytes > 0) {
+        //The file would go out ahead of the queued data
+        throw std::runtime_error("Data queued by send() has not been written yet.");
+    }
+
+    //Large enough to fill a socket buffer with few system calls
+    size_t count = (size_t) std::min(file.remaining(), (uint64_t) 1 << 30);
+    int64_t bytes_sent = 0;
+
+#if defined(__linux__)
+    off_t offset = (off_t) file.m_offset;
+
+    bytes_sent = ::sendfile(m_fd, file.m_file, &offset, count);
+
+    if (bytes_sent < 0) {
+        //Not a real error if the socket is full
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+#elif defined(__APPLE__)
+    off_t len = (off_t) count;
+
+    if (::sendfile(file.m_file, m_fd, (off_t) file.m_offset, &len, NULL, 0) < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            //A real error has taken place.
+            return -1;
         }
-        else {
-            throw std::runtime_error("select() failed.");
+
+        //A partial send is reported as EAGAIN with len set
+        if (len == 0) {
+            return 0;
         }
     }
+
+    bytes_sent = len;
 #else
-    if (num_events < 0) {
-        if (errno == EINTR) {
-            //A signal was handled
-            return num_events;
+    char chunk[65536];
+    size_t chunk_size = std::min(count, sizeof(chunk));
+
+#ifdef _WIN32
+    OVERLAPPED ov{};
+    DWORD num_read = 0;
+
+    ov.Offset = (DWORD) file.m_offset;
+    ov.OffsetHigh = (DWORD) (file.m_offset >> 32);
+
+    if (!::ReadFile(file.m_file, chunk, (DWORD) chunk_size, &num_read, &ov)) {
+        return -1;
+    }
+#else
+    ssize_t num_read = ::pread(file.m_file, chunk, chunk_size, (off_t) file.m_offset);
+
+    if (num_read < 0) {
+        return -1;
+    }
+#endif
+
+    if (num_read == 0) {
+        //The file has become shorter since the region was created
+        return -1;
+    }
+
+    WrappedByteBuffer b(chunk, num_read);
+    int n = write(b);
+
+    if (n <= 0) {
+        return n;
+    }
+
+    bytes_sent = n;
+#endif
+
+    if (bytes_sent == 0) {
+        //The file has become shorter since the region was created
+        return -1;
+    }
+
+    file.m_offset += bytes_sent;
+
+    return (int) bytes_sent;
+}
+
+int Socket::send(std::string_view data) {
+    return send(data.data(), data.size(), nullptr);
+}
+
+int Socket::send(std::shared_ptr<const SharedPayload> payload) {
+    if (!payload) {
+        throw std::invalid_argument("Payload is null.");
+    }
+
+    std::string_view data = payload->data();
+
+    return send(data.data(), data.size(), std::move(payload));
+}
+
+/*
+* Writes right away only if nothing is queued, so that the data goes out
+* in order, and the connection is established. What is left is queued,
+* sharing the payload if there is one and copying the data otherwise.
+*/
+int Socket::send(const char* data, size_t length, std::shared_ptr<const SharedPayload> payload) {
+    size_t written = 0;
+
+    if (m_write_queue.empty() && length > 0 && !m_resolving && !is_connection_pending()) {
+        WrappedByteBuffer b(const_cast<char*>(data), length, length, 0, true);
+        int n = write(b);
+
+        if (n < 0) {
+            return -1;
+        }
+
+        written = n;
+    }
+
+    if (written < length) {
+        size_t rest = length - written;
+
+        if (payload) {
+            m_write_queue.push_back({ std::move(payload), written });
         }
         else {
-            throw std::runtime_error("select() failed.");
+            m_write_queue.push_back({ std::make_shared<SharedPayload>(std::string_view(data + written, rest)), 0 });
+        }
+
+        m_queued_bytes += rest;
+
+        if (m_queued_bytes >= m_high_watermark) {
+            m_write_queue_full = true;
         }
+
+        update_write_queue();
     }
-#endif
 
-    if (num_events == 0) {
-        //Timeout
-        return num_events;
+    return (int) written;
+}
+
+/*
+* Writes queued data until the socket can't take any more. Returns the
+* number of bytes written or -1 if the connection was lost, in which case
+* the queue is emptied.
+*/
+int Socket::flush_write_queue() {
+    int total = 0;
+
+    while (!m_write_queue.empty()) {
+        auto& w = m_write_queue.front();
+        size_t size = w.payload->size();
+        WrappedByteBuffer b(const_cast<char*>(w.payload->data().data()), size, size, w.offset, true);
+        int n = write(b);
+
+        if (n < 0) {
+            m_write_queue.clear();
+            m_queued_bytes = 0;
+            m_write_queue_full = false;
+
+            return -1;
+        }
+
+        if (n == 0) {
+            break;
+        }
+
+        total += n;
+        w.offset += n;
+        m_queued_bytes -= n;
+
+        if (w.offset < size) {
+            //The socket's send buffer is full
+            break;
+        }
+
+        m_write_queue.pop_front();
+    }
+
+    return total;
+}
+
+/*
+* Asks for writable events while data is queued and checks the low watermark.
+*/
+void Socket::update_write_queue() {
+    if (m_queued_bytes > 0 && !is_report_writable()) {
+        m_queue_writable = true;
+
+        report_writable(true);
+    }
+    else if (m_queued_bytes == 0 && m_queue_writable) {
+        m_queue_writable = false;
+
+        report_writable(false);
+    }
+
+    if (m_write_queue_full && m_queued_bytes <= m_low_watermark) {
+        m_write_queue_full = false;
+
+        set_write_queue_drained(true);
+    }
+}
+
+void Socket::set_write_watermarks(size_t low, size_t high) {
+    if (low > high) {
+        throw std::invalid_argument("Low watermark is greater than high watermark.");
+    }
+
+    m_low_watermark = low;
+    m_high_watermark = high;
+    m_write_queue_full = m_queued_bytes >= high;
+}
+
+int Socket::sendto(ByteBuffer& b, const struct sockaddr* to, int to_len) {
+    if (!b.has_remaining()) {
+        throw std::runtime_error("Buffer is empty.");
     }
 
-    for (auto& s : m_sockets) {
-        if (s->is_connection_pending()) {
-            /*
-            * Test for connect() completion status.
-            */
 #ifdef _WIN32
-            /*
-            * It appears that both write fd set and except fd set are set for 
-            * the socket for a successful connection. We must test for the
-            * write fd set before except fd set to determine success.
-            */
-            if (FD_ISSET(s->fd(), &write_fd_set)) {
-                s->set_connection_success(true);
-                s->set_connection_pending(false);
-            }
-            else if ((FD_ISSET(s->fd(), &except_fd_set))) {
-                //connect() has failed
-                s->set_connection_failed(true);
-                s->set_connection_pending(false);
-            }
-#else
-            if (FD_ISSET(s->fd(), &write_fd_set)) {
-                int valopt;
-                socklen_t lon = sizeof(int);
+    int bytes_written = ::sendto(
+        m_fd,
+        b.array() + b.position(),
+        b.remaining(),
+        0,
+        to,
+        to_len);
 
-                if (::getsockopt(s->fd(), SOL_SOCKET, SO_ERROR, (void*)(&valopt), &lon) < 0) {
-                    throw std::runtime_error("Error in getsockopt().");
-                }
+    if (bytes_written == SOCKET_ERROR) {
+        int err = ::WSAGetLastError();
 
-                if (valopt) {
-                    s->set_connection_failed(true);
-                    s->set_connection_pending(false);
-                }
-                else {
-                    s->set_connection_success(true);
-                    s->set_connection_pending(false);
-                }
-            }
-#endif
-            if (s->is_connection_pending()) {
-                //This should not happen.
-                throw std::runtime_error("Invalid state.");
-            }
+        if (err == WSAECONNRESET) {
+            //Ungraceful disconnect
+            return -1;
+        }
+
+        if (err == WSAEWOULDBLOCK) {
+            //Not a real error
+            return 0;
         }
         else {
-            s->set_connection_success(false);
+            //A real error has taken place.
+            return -1;
+        }
+    }
+#else
+    int bytes_written = ::sendto(
+        m_fd,
+        b.array() + b.position(),
+        b.remaining(),
+        0,
+        to,
+        to_len);
 
-            //For a server socket, readable means new client
-            //waiting to be accepted
-            if (s->is_report_acceptable()) {
-                s->set_acceptable((FD_ISSET(s->fd(), &read_fd_set)));
-            } else {
-                s->set_readable((FD_ISSET(s->fd(), &read_fd_set)));
-            }
-            
-            s->set_writable((FD_ISSET(s->fd(), &write_fd_set)));
+    if (bytes_written < 0) {
+        if (errno == EAGAIN && errno == EWOULDBLOCK) {
+            //Not a real error
+            return 0;
+        }
+        else {
+            //A real error has taken place.
+            return -1;
         }
     }
+#endif
+
+    if (bytes_written == 0) {
+        /*
+        * The other party has disconnected:
+        * Gracefully in Windows.
+        * Gracefully or ungracefully in Linux.
+        */
+        return -1;
+    }
 
-    return num_events;
+    if (bytes_written < 0) {
+        //This should have been handled above already.
+        throw std::runtime_error("Invalid state.");
+    }
+
+    //Forward the position
+    b.position(b.position() + bytes_written);
+
+    return bytes_written;
 }
 
 /*
-* Removes this socket from the set of sockets monitored by the selector.
-* The socket will be eventually closed and destroyed.
+* Scatter/gather I/O. The remaining part of each buffer is described by
+* an I/O vector. At most MAX_IO_VECTORS buffers are used by one call. The
+* rest are left for the next call the same way as a partial write.
 */
-void Selector::cancel_socket(std::shared_ptr<Socket> socket) {
-    m_canceled_sockets.insert(socket);
-}
+#ifdef _WIN32
+using IoVector = WSABUF;
+#else
+using IoVector = struct iovec;
+#endif
 
-Socket::Socket(SOCKET fd) : m_fd(fd) {
+static const size_t MAX_IO_VECTORS = 64;
 
+static void set_io_vector(IoVector& v, char* data, size_t length) {
+#ifdef _WIN32
+    v.buf = data;
+    v.len = (ULONG) length;
+#else
+    v.iov_base = data;
+    v.iov_len = length;
+#endif
 }
 
-Socket::Socket(int domain, int type, int protocol) : m_fd(INVALID_SOCKET) {
-    m_fd = ::socket(domain, type, protocol);
+/*
+* Reads into the free space at the end of the last segment and into new
+* segments added after it. Segments that received no data are removed.
+*/
+int Socket::read(ChainedByteBuffer& b, size_t max_bytes) {
+    if (max_bytes == 0) {
+        throw std::invalid_argument("Nothing to read.");
+    }
 
-    if (m_fd == INVALID_SOCKET) {
-        throw std::runtime_error("Failed to create a socket.");
+    IoVector iov[MAX_IO_VECTORS];
+    size_t count = 0, total = 0;
+
+    if (!b.m_segments.empty() && b.m_segments.back().end < b.m_segment_size) {
+        auto& last = b.m_segments.back();
+        size_t n = std::min(b.m_segment_size - last.end, max_bytes);
+
+        set_io_vector(iov[count++], last.data + last.end, n);
+
+        total += n;
     }
 
-    m_io_flag.reset();
-}
+    while (total < max_bytes && count < MAX_IO_VECTORS) {
+        b.add_segment();
+
+        size_t n = std::min(b.m_segment_size, max_bytes - total);
+
+        set_io_vector(iov[count++], b.m_segments.back().data, n);
+
+        total += n;
+    }
 
-Socket::~Socket() {
-    if (m_fd != INVALID_SOCKET) {
 #ifdef _WIN32
-        ::closesocket(m_fd);
+    DWORD num_bytes = 0, flags = 0;
+    int bytes_read = 0;
+
+    if (::WSARecv(m_fd, iov, (DWORD) count, &num_bytes, &flags, NULL, NULL) == SOCKET_ERROR) {
+        int err = ::WSAGetLastError();
+
+        //Not an error really if the call would block
+        bytes_read = err == WSAEWOULDBLOCK ? 0 : -1;
+    }
+    else {
+        //Zero means the other party has disconnected
+        bytes_read = num_bytes > 0 ? (int) num_bytes : -1;
+    }
 #else
-        ::close(m_fd);
+    int bytes_read = ::readv(m_fd, iov, (int) count);
+
+    if (bytes_read < 0) {
+        //Not an error really if the call would block
+        bytes_read = (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    else if (bytes_read == 0) {
+        //The other party has disconnected
+        bytes_read = -1;
+    }
 #endif
 
-        m_fd = INVALID_SOCKET;
+    //Hand the bytes read to the segments in order
+    size_t remaining = bytes_read > 0 ? bytes_read : 0;
+
+    for (auto& seg : b.m_segments) {
+        if (seg.end == b.m_segment_size) {
+            continue;
+        }
+
+        size_t n = std::min(remaining, b.m_segment_size - seg.end);
+
+        seg.end += n;
+        remaining -= n;
+        b.m_size += n;
+    }
+
+    while (!b.m_segments.empty() && b.m_segments.back().end == 0) {
+        BufferPool::deallocate(b.m_segments.back().data, b.m_segment_size);
+
+        b.m_segments.pop_back();
     }
+
+    return bytes_read;
 }
 
-DatagramClientSocket::DatagramClientSocket(addrinfo* res) : 
-    server_address(res),
-    Socket(res->ai_family, res->ai_socktype, res->ai_protocol)
-{
+int Socket::write(ChainedByteBuffer& b) {
+    if (b.empty()) {
+        throw std::runtime_error("Buffer is empty.");
+    }
+
+    IoVector iov[MAX_IO_VECTORS];
+    size_t count = std::min(b.m_segments.size(), MAX_IO_VECTORS);
+
+    for (size_t i = 0; i < count; ++i) {
+        auto& seg = b.m_segments[i];
+
+        set_io_vector(iov[i], seg.data + seg.begin, seg.end - seg.begin);
+    }
+
+#ifdef _WIN32
+    DWORD num_bytes = 0;
+
+    if (::WSASend(m_fd, iov, (DWORD) count, &num_bytes, 0, NULL, NULL) == SOCKET_ERROR) {
+        int err = ::WSAGetLastError();
+
+        //Not a real error if the call would block
+        return err == WSAEWOULDBLOCK ? 0 : -1;
+    }
+
+    int bytes_written = (int) num_bytes;
+#else
+    int bytes_written = ::writev(m_fd, iov, (int) count);
+
+    if (bytes_written < 0) {
+        //Not a real error if the call would block
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+#endif
+
+    if (bytes_written == 0) {
+        //The other party has disconnected
+        return -1;
+    }
+
+    b.consume(bytes_written);
+
+    return bytes_written;
 }
 
-DatagramClientSocket::~DatagramClientSocket() {
-    if (server_address != NULL) {
-        ::freeaddrinfo(server_address);
+#ifdef VELAR_HAS_SPAN
 
-        server_address = NULL;
+static void check_not_read_only(std::span<ByteBuffer* const> buffers) {
+    for (auto b : buffers) {
+        if (b->is_read_only()) {
+            throw std::runtime_error("Buffer is read only.");
+        }
     }
 }
 
-/*
-* Writes data from the buffer to the address and port that
-* this socket was constructed with. The buffer's position is
-* moved forward by the number of bytes written. The limit
-* remains unchanged. If not all the data could be written,
-* calling has_remaining() on the buffer will return true.
-*/
-int DatagramClientSocket::sendto(ByteBuffer& b) {
-    return sendto(b, server_address->ai_addr, server_address->ai_addrlen);
+static size_t to_io_vectors(std::span<ByteBuffer* const> buffers, IoVector* iov) {
+    size_t count = 0;
+
+    for (auto b : buffers) {
+        if (count == MAX_IO_VECTORS) {
+            break;
+        }
+
+        if (!b->has_remaining()) {
+            continue;
+        }
+
+        set_io_vector(iov[count], b->array() + b->position(), b->remaining());
+
+        ++count;
+    }
+
+    return count;
 }
 
 /*
-* After the first time sendto() is called for a UDP socket it
-* gets implicitly bound to the destination server's address and port.
-* You can then call recvfrom(). This will receive data from the server where the
-* original sendto() request was sent.
-* 
-* The position of the buffer is moved forward by the number of bytes received.
-* Limit is left unchanged. You should flip() the buffer before reading
-* from it.
+* Moves the positions of the buffers forward by a total of num_bytes,
+* filling or draining one buffer before moving on to the next.
 */
-int DatagramClientSocket::recvfrom(ByteBuffer& b) {
-    return recvfrom(b, nullptr, nullptr);
+static void advance_buffers(std::span<ByteBuffer* const> buffers, size_t num_bytes) {
+    for (auto b : buffers) {
+        if (num_bytes == 0) {
+            break;
+        }
+
+        size_t n = std::min(num_bytes, b->remaining());
+
+        b->position(b->position() + n);
+
+        num_bytes -= n;
+    }
 }
 
-/*
-* Reads data from this socket into the supplied ByteBuffer at the current position of the buffer.
-* Upon a successful read the position of the buffer is incremented but limit remains unchanged.
-* Before you retrieve data from the buffer you should call flip().
-* 
-* When you try to read from a socket many things can happen. Winsock and BSD socket deal with
-* these situations slightly differently. Here we normalize the situations by returning an 
-* uniform value for both platforms. Here are the possible cases:
-* 
-* - Read was successful. In this case, the number of bytes read, a positive number, is returned.
-* - An attempted read would lead to blocking. In this case 0 is returned.
-* - The other party has disconnected gracefully, meaning they have closed their end of the socket. In this
-* case a negative value is returned.
-* - The other party has disconnected ungracefully, meaning somehow the connection was severed. In this case,
-* we return a negative value.
-* 
-* If a negative value is returned, then applications should treat the socket as unusuable. 
-* They should cancel the socket.
-*/
-int Socket::read(ByteBuffer& b) {
-    if (!b.has_remaining()) {
+int Socket::read(std::span<ByteBuffer* const> buffers) {
+    check_not_read_only(buffers);
+
+    IoVector iov[MAX_IO_VECTORS];
+    size_t count = to_io_vectors(buffers, iov);
+
+    if (count == 0) {
         throw std::runtime_error("Buffer is full.");
     }
 
 #ifdef _WIN32
-    int bytes_read = ::recv(
-        m_fd,
-        b.array() + b.position(),
-        b.remaining(),
-        0);
+    DWORD num_bytes = 0, flags = 0;
 
-    if (bytes_read == SOCKET_ERROR) {
+    if (::WSARecv(m_fd, iov, (DWORD) count, &num_bytes, &flags, NULL, NULL) == SOCKET_ERROR) {
         int err = ::WSAGetLastError();
 
-        if (err == WSAECONNRESET) {
-            //Ungraceful disconnect by the other party
-            return -1;
-        }
-
         if (err == WSAEWOULDBLOCK) {
             //Not an error really.
             return 0;
         }
         else {
-            //A real error has taken place.
+            //A real error has taken place or an ungraceful disconnect.
             return -1;
         }
     }
+
+    int bytes_read = (int) num_bytes;
 #else
-    int bytes_read = ::read(
-        m_fd,
-        b.array() + b.position(),
-        b.remaining());
+    int bytes_read = ::readv(m_fd, iov, (int) count);
 
     if (bytes_read < 0) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
@@ -997,76 +5679,109 @@ int Socket::read(ByteBuffer& b) {
 #endif
 
     if (bytes_read == 0) {
-        /*
-        * The other party has disconnected:
-        * Gracefully in Windows.
-        * Gracefully or ungracefully in Linux.
-        */
+        //The other party has disconnected
         return -1;
     }
 
-    if (bytes_read < 0) {
-        //This should have been handled above already.
-        throw std::runtime_error("Invalid state.");
+    advance_buffers(buffers, bytes_read);
+
+    return bytes_read;
+}
+
+int Socket::write(std::span<ByteBuffer* const> buffers) {
+    IoVector iov[MAX_IO_VECTORS];
+    size_t count = to_io_vectors(buffers, iov);
+
+    if (count == 0) {
+        throw std::runtime_error("Buffer is empty.");
     }
 
-    //Forward the position
-    b.position(b.position() + bytes_read);
+#ifdef _WIN32
+    DWORD num_bytes = 0;
 
-    return bytes_read;
+    if (::WSASend(m_fd, iov, (DWORD) count, &num_bytes, 0, NULL, NULL) == SOCKET_ERROR) {
+        int err = ::WSAGetLastError();
+
+        if (err == WSAEWOULDBLOCK) {
+            //Not a real error
+            return 0;
+        }
+        else {
+            //A real error has taken place or an ungraceful disconnect.
+            return -1;
+        }
+    }
+
+    int bytes_written = (int) num_bytes;
+#else
+    int bytes_written = ::writev(m_fd, iov, (int) count);
+
+    if (bytes_written < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            //Not a real error
+            return 0;
+        }
+        else {
+            //A real error has taken place.
+            return -1;
+        }
+    }
+#endif
+
+    if (bytes_written == 0) {
+        //The other party has disconnected
+        return -1;
+    }
+
+    advance_buffers(buffers, bytes_written);
+
+    return bytes_written;
 }
 
+int Socket::recvfrom(std::span<ByteBuffer* const> buffers, sockaddr* from, int* from_len) {
+    check_not_read_only(buffers);
 
-int Socket::recvfrom(ByteBuffer& b, sockaddr* from, int* from_len) {
-    if (!b.has_remaining()) {
+    IoVector iov[MAX_IO_VECTORS];
+    size_t count = to_io_vectors(buffers, iov);
+
+    if (count == 0) {
         throw std::runtime_error("Buffer is full.");
     }
 
 #ifdef _WIN32
-    int bytes_read = ::recvfrom(
-        m_fd,
-        b.array() + b.position(),
-        b.remaining(),
-        0,
-        from,
-        from_len);
+    DWORD num_bytes = 0, flags = 0;
+    int bytes_read = 0;
 
-    if (bytes_read == SOCKET_ERROR) {
+    if (::WSARecvFrom(m_fd, iov, (DWORD) count, &num_bytes, &flags, from, from_len, NULL, NULL) == SOCKET_ERROR) {
         int err = ::WSAGetLastError();
 
-        if (err == WSAECONNRESET) {
-            //Ungraceful disconnect by the other party
-            return -1;
-        } else if (err == WSAEWOULDBLOCK) {
+        if (err == WSAEWOULDBLOCK) {
             //Not an error really.
             return 0;
         }
         else if (err == WSAEMSGSIZE) {
-            /*
-            * A partial read took place. In Windows this is an error.
-            * But in Linux it is not an error.
-            * 
-            * We make our recvfrom()
-            * behave the same way as in Linux by returning the number of bytes 
-            * saved in the buffer.
-            */
-            
-            bytes_read = b.remaining();
+            //A partial read. Report the bytes stored like Linux does.
+            for (size_t i = 0; i < count; ++i) {
+                bytes_read += (int) iov[i].len;
+            }
         }
         else {
             //A real error has taken place.
             return -1;
         }
     }
-#else
-    int bytes_read = ::recvfrom(
-        m_fd,
-        b.array() + b.position(),
-        b.remaining(),
-        0,
-        from,
-        (socklen_t*) 
-        from_len);
+    else {
+        bytes_read = (int) num_bytes;
+    }
+#else
+    struct msghdr msg {};
+
+    msg.msg_name = from;
+    msg.msg_namelen = from_len != NULL ? (socklen_t) *from_len : 0;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+
+    int bytes_read = ::recvmsg(m_fd, &msg, 0);
 
     if (bytes_read < 0) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
@@ -1078,70 +5793,36 @@ int Socket::recvfrom(ByteBuffer& b, sockaddr* from, int* from_len) {
             return -1;
         }
     }
+
+    if (from_len != NULL) {
+        *from_len = (int) msg.msg_namelen;
+    }
 #endif
 
     if (bytes_read == 0) {
-        /*
-        * The other party has disconnected:
-        * Gracefully in Windows.
-        * Gracefully or ungracefully in Linux.
-        */
+        //Same as recvfrom(ByteBuffer&)
         return -1;
     }
 
-    if (bytes_read < 0) {
-        //This should have been handled above already.
-        throw std::runtime_error("Invalid state.");
-    }
-
-    //Forward the position
-    b.position(b.position() + bytes_read);
+    advance_buffers(buffers, bytes_read);
 
     return bytes_read;
 }
 
-/*
-* Writes any remaining data from this ByteBuffer into the socket.
-* Upon a successful write the position of the buffer is incremented by the
-* number of bytes actually written. The limit remains unchanged.
-* This way, the buffer keeps track of how much data was sent and how much is yet to be sent.
-* In a nonblocking socket it is common that not all the data can be sent at the same time.
-* You can call write() for the same buffer repetedly until all the data is fully sent.
-*
-* When you try to write to a socket many things can happen. Winsock and BSD socket deal with
-* these situations slightly differently. Here we normalize the situations by returning an
-* uniform value for both platforms. Here are the possible cases:
-*
-* - Write was successful. In this case, the number of bytes written, a positive number, is returned.
-* - An attempted write would lead to blocking. In this case 0 is returned.
-* - The other party has disconnected gracefully, meaning they have closed their end of the socket. In this
-* case a negative value is returned.
-* - The other party has disconnected ungracefully, meaning somehow the connection was severed. In this case,
-* we return a negative value.
-*
-* If a negative value is returned, then applications should treat the socket as unusuable.
-* They should cancel the socket.
-*/
-int Socket::write(ByteBuffer& b) {
-    if (!b.has_remaining()) {
+int Socket::sendto(std::span<ByteBuffer* const> buffers, const struct sockaddr* to, int to_len) {
+    IoVector iov[MAX_IO_VECTORS];
+    size_t count = to_io_vectors(buffers, iov);
+
+    if (count == 0) {
         throw std::runtime_error("Buffer is empty.");
     }
 
 #ifdef _WIN32
-    int bytes_written = ::send(
-        m_fd,
-        b.array() + b.position(),
-        b.remaining(),
-        0);
+    DWORD num_bytes = 0;
 
-    if (bytes_written == SOCKET_ERROR) {
+    if (::WSASendTo(m_fd, iov, (DWORD) count, &num_bytes, 0, to, to_len, NULL, NULL) == SOCKET_ERROR) {
         int err = ::WSAGetLastError();
 
-        if (err == WSAECONNRESET) {
-            //Ungraceful disconnect
-            return -1;
-        }
-
         if (err == WSAEWOULDBLOCK) {
             //Not a real error
             return 0;
@@ -1151,14 +5832,20 @@ int Socket::write(ByteBuffer& b) {
             return -1;
         }
     }
+
+    int bytes_written = (int) num_bytes;
 #else
-    int bytes_written = ::write(
-        m_fd,
-        b.array() + b.position(),
-        b.remaining());
+    struct msghdr msg {};
+
+    msg.msg_name = (void*) to;
+    msg.msg_namelen = (socklen_t) to_len;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+
+    int bytes_written = ::sendmsg(m_fd, &msg, 0);
 
     if (bytes_written < 0) {
-        if (errno == EAGAIN && errno == EWOULDBLOCK) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
             //Not a real error
             return 0;
         }
@@ -1170,93 +5857,348 @@ int Socket::write(ByteBuffer& b) {
 #endif
 
     if (bytes_written == 0) {
-        /*
-        * The other party has disconnected:
-        * Gracefully in Windows.
-        * Gracefully or ungracefully in Linux.
-        */
+        //Same as sendto(ByteBuffer&)
         return -1;
     }
 
-    if (bytes_written < 0) {
-        //This should have been handled above already.
-        throw std::runtime_error("Invalid state.");
+    advance_buffers(buffers, bytes_written);
+
+    return bytes_written;
+}
+#endif
+
+/*
+* Pins the calling thread to a CPU core. This is only a hint. Failures are ignored.
+*/
+static void pin_thread(size_t core) {
+#if defined(_WIN32)
+    ::SetThreadAffinityMask(::GetCurrentThread(), (DWORD_PTR) 1 << (core % (sizeof(DWORD_PTR) * 8)));
+#elif defined(__linux__)
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(core % CPU_SETSIZE, &cpus);
+
+    ::pthread_setaffinity_np(::pthread_self(), sizeof(cpus), &cpus);
+#else
+    (void) core;
+#endif
+}
+
+EventLoopGroup::EventLoopGroup(unsigned int num_loops) {
+    if (num_loops == 0) {
+        num_loops = std::max(1u, std::thread::hardware_concurrency());
     }
 
-    //Forward the position
-    b.position(b.position() + bytes_written);
+    for (unsigned int i = 0; i < num_loops; ++i) {
+        auto loop = std::make_unique<EventLoop>();
 
-    return bytes_written;
+        loop->index = i;
+
+        m_loops.push_back(std::move(loop));
+    }
 }
 
-int Socket::sendto(ByteBuffer& b, const struct sockaddr* to, int to_len) {
-    if (!b.has_remaining()) {
-        throw std::runtime_error("Buffer is empty.");
+EventLoopGroup::~EventLoopGroup() {
+    stop();
+
+    for (auto& t : m_threads) {
+        if (t.joinable()) {
+            t.join();
+        }
+    }
+}
+
+void EventLoopGroup::start(int port, std::function<void(EventLoop&)> on_select, std::function<void(EventLoop&)> on_start) {
+    if (!m_threads.empty()) {
+        throw std::runtime_error("Event loop group is already started.");
     }
 
+    for (auto& loop : m_loops) {
 #ifdef _WIN32
-    int bytes_written = ::sendto(
-        m_fd,
-        b.array() + b.position(),
-        b.remaining(),
-        0,
-        to,
-        to_len);
+        //Windows can not bind more than one socket to the same port
+        if (loop->index > 0) {
+            continue;
+        }
+#endif
+        loop->server = loop->selector.start_server(port, nullptr);
+    }
 
-    if (bytes_written == SOCKET_ERROR) {
-        int err = ::WSAGetLastError();
+    for (auto& loop : m_loops) {
+        EventLoop* l = loop.get();
 
-        if (err == WSAECONNRESET) {
-            //Ungraceful disconnect
-            return -1;
+        m_threads.emplace_back([this, l, on_select, on_start]() mutable {
+            run(*l, on_start, on_select);
+        });
+    }
+}
+
+void EventLoopGroup::run(EventLoop& loop, std::function<void(EventLoop&)>& on_start, std::function<void(EventLoop&)>& on_select) {
+    pin_thread(loop.index);
+
+    try {
+        if (on_start) {
+            on_start(loop);
         }
 
-        if (err == WSAEWOULDBLOCK) {
-            //Not a real error
-            return 0;
+        while (!is_stopping()) {
+            //stop() wakes us up
+            int n = loop.selector.select(std::chrono::microseconds(-1));
+
+            if (n < 0) {
+                //Interrupted by a signal
+                continue;
+            }
+
+            on_select(loop);
         }
-        else {
-            //A real error has taken place.
-            return -1;
+    }
+    catch (...) {
+        bool expected = false;
+
+        //Keep the first error only
+        if (m_has_error.compare_exchange_strong(expected, true)) {
+            m_error = std::current_exception();
+        }
+
+        stop();
+    }
+}
+
+void EventLoopGroup::stop() {
+    m_stopping.store(true, std::memory_order_release);
+
+    for (auto& loop : m_loops) {
+        loop->selector.wakeup();
+    }
+}
+
+void EventLoopGroup::join() {
+    for (auto& t : m_threads) {
+        if (t.joinable()) {
+            t.join();
         }
     }
+
+    if (m_error) {
+        auto error = m_error;
+
+        m_error = nullptr;
+
+        std::rethrow_exception(error);
+    }
+}
+
+/*
+* Checks that an idle connection can be used for a new request. The server
+* may have closed it, or sent something nobody asked for, while it sat in
+* the pool. Neither can be told apart from a healthy connection without
+* looking at the socket.
+*/
+static bool is_connection_reusable(SOCKET fd) {
+    char ch;
+
+#ifdef _WIN32
+    int status = ::recv(fd, &ch, 1, MSG_PEEK);
+
+    if (status == SOCKET_ERROR) {
+        return ::WSAGetLastError() == WSAEWOULDBLOCK;
+    }
 #else
-    int bytes_written = ::sendto(
-        m_fd,
-        b.array() + b.position(),
-        b.remaining(),
-        0,
-        to,
-        to_len);
+    ssize_t status = ::recv(fd, &ch, 1, MSG_PEEK);
 
-    if (bytes_written < 0) {
-        if (errno == EAGAIN && errno == EWOULDBLOCK) {
-            //Not a real error
-            return 0;
+    if (status < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+#endif
+
+    //Zero means the server has closed the connection
+    return false;
+}
+
+/*
+* Handles the events of the idle connections of a pool. Any event
+* means the connection is no longer of use.
+*/
+struct IdleConnectionHandler : public SocketHandler {
+    ConnectionPool* m_pool;
+
+    IdleConnectionHandler(ConnectionPool* pool) : m_pool(pool) {}
+
+    void on_readable(Selector& /*sel*/, const std::shared_ptr<Socket>& socket) override {
+        m_pool->evict(socket);
+    }
+
+    void on_timeout(Selector& /*sel*/, const std::shared_ptr<Socket>& socket) override {
+        m_pool->evict(socket);
+    }
+};
+
+ConnectionPool::ConnectionPool(Selector& sel, size_t max_per_host, size_t max_idle, std::chrono::microseconds idle_timeout) :
+    m_selector(sel),
+    m_max_per_host(max_per_host),
+    m_max_idle(max_idle),
+    m_idle_timeout(idle_timeout),
+    m_idle_handler(std::make_shared<IdleConnectionHandler>(this)) {
+
+}
+
+ConnectionPool::~ConnectionPool() {
+    for (auto& [key, host] : m_hosts) {
+        for (auto& conn : host.idle) {
+            conn.socket->m_handler = nullptr;
+
+            m_selector.cancel_socket(conn.socket);
         }
-        else {
-            //A real error has taken place.
-            return -1;
+    }
+}
+
+std::shared_ptr<Socket> ConnectionPool::acquire(const char* address, int port, std::shared_ptr<SocketAttachment> attachment) {
+    Host& host = m_hosts[std::string(address) + ":" + std::to_string(port)];
+
+    //Reuse the most recently used connection. It is the least likely to have been closed.
+    while (!host.idle.empty()) {
+        IdleConnection conn = std::move(host.idle.back());
+
+        host.idle.pop_back();
+        --m_num_idle;
+
+        auto& socket = conn.socket;
+
+        if (socket->m_canceled) {
+            continue;
         }
+
+        if (!is_connection_reusable(socket->fd())) {
+            m_selector.cancel_socket(socket);
+
+            continue;
+        }
+
+        socket->m_handler = std::move(conn.handler);
+        socket->m_attachment = std::move(attachment);
+
+        m_selector.set_idle_timeout(socket, std::chrono::microseconds::zero());
+
+        socket->report_readable(false);
+
+        m_selector.report_reused(socket);
+
+        return socket;
     }
-#endif
 
-    if (bytes_written == 0) {
-        /*
-        * The other party has disconnected:
-        * Gracefully in Windows.
-        * Gracefully or ungracefully in Linux.
-        */
-        return -1;
+    forget_closed(host);
+
+    if (host.open.size() >= m_max_per_host) {
+        return nullptr;
     }
 
-    if (bytes_written < 0) {
-        //This should have been handled above already.
-        throw std::runtime_error("Invalid state.");
+    auto socket = m_selector.start_client(address, port, attachment);
+
+    host.open.push_back(socket.get());
+    m_open[socket.get()] = { &host, socket };
+
+    return socket;
+}
+
+void ConnectionPool::release(std::shared_ptr<Socket> socket) {
+    if (socket->m_selector != &m_selector || socket->m_canceled || socket->m_handler == m_idle_handler) {
+        return;
     }
 
-    //Forward the position
-    b.position(b.position() + bytes_written);
+    Host* host = find_host(socket.get());
 
-    return bytes_written;
+    if (host == nullptr ||
+        socket->is_connection_pending() ||
+        socket->is_connection_failed() ||
+        m_num_idle >= m_max_idle ||
+        !is_connection_reusable(socket->fd())) {
+        m_selector.cancel_socket(socket);
+
+        return;
+    }
+
+    socket->m_attachment = nullptr;
+    socket->report_writable(false);
+    //Readable while idle means closed by the server
+    socket->report_readable(true);
+
+    m_selector.set_idle_timeout(socket, m_idle_timeout);
+
+    host->idle.push_back({ socket, std::move(socket->m_handler) });
+    ++m_num_idle;
+
+    socket->m_handler = m_idle_handler;
+}
+
+bool ConnectionPool::handle_idle(const std::shared_ptr<Socket>& socket) {
+    if (socket->m_handler != m_idle_handler) {
+        return false;
+    }
+
+    if (socket->is_readable() || socket->is_idle_timeout()) {
+        evict(socket);
+    }
+
+    return true;
+}
+
+/*
+* Finds the host a connection handed out by acquire() belongs to.
+* The weak pointer tells a live connection apart from a new socket
+* that happens to have the address of a closed one.
+*/
+ConnectionPool::Host* ConnectionPool::find_host(const Socket* socket) {
+    auto it = m_open.find(socket);
+
+    if (it == m_open.end() || it->second.socket.lock().get() != socket) {
+        return nullptr;
+    }
+
+    return it->second.host;
+}
+
+/*
+* Stops counting the connections to a host that have been closed.
+*/
+void ConnectionPool::forget_closed(Host& host) {
+    host.open.erase(std::remove_if(host.open.begin(), host.open.end(), [this, &host](const Socket* p) {
+        auto it = m_open.find(p);
+
+        if (it == m_open.end() || it->second.host != &host) {
+            //Evicted, or the address now belongs to a connection to another host
+            return true;
+        }
+
+        auto socket = it->second.socket.lock();
+
+        if (!socket || socket->m_canceled) {
+            m_open.erase(it);
+
+            return true;
+        }
+
+        return false;
+    }), host.open.end());
+}
+
+void ConnectionPool::evict(const std::shared_ptr<Socket>& socket) {
+    Host* host = find_host(socket.get());
+
+    if (host != nullptr) {
+        auto it = std::find_if(host->idle.begin(), host->idle.end(), [&socket](const IdleConnection& conn) {
+            return conn.socket == socket;
+        });
+
+        if (it != host->idle.end()) {
+            host->idle.erase(it);
+            --m_num_idle;
+        }
+
+        m_open.erase(socket.get());
+    }
+
+    socket->m_handler = nullptr;
+
+    m_selector.cancel_socket(socket);
 }
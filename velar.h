@@ -2,10 +2,20 @@
 
 #include <stdexcept>
 #include <bitset>
-#include <set>
+#include <vector>
 #include <string_view>
 #include <memory>
+#include <functional>
+#include <chrono>
 #include <cstring>
+#include <cstdint>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <string>
+#include <unordered_map>
+#include <deque>
+#include <type_traits>
 
 #ifdef _WIN32
 //This header adds support for ipv6 and
@@ -24,12 +34,53 @@ using SOCKET = int;
 
 #endif
 
+/*
+* On Linux the Selector uses epoll(7) by default. Interest is registered
+* with the kernel once and only updated when a socket's reporting flags change.
+* Define VELAR_USE_SELECT to fall back to the portable select() implementation.
+*/
+#if defined(__linux__) && !defined(VELAR_USE_SELECT)
+#define VELAR_USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+/*
+* Define VELAR_USE_IO_URING to enable the io_uring completion engine on Linux.
+* It lets the Selector perform reads, writes and accepts on behalf of the
+* application. See Selector::submit_read().
+*/
+#if defined(VELAR_USE_IO_URING) && !defined(VELAR_USE_EPOLL)
+#error "VELAR_USE_IO_URING requires the epoll backend on Linux."
+#endif
+
+/*
+* The coroutine API is available when the compiler supports C++20 coroutines.
+*/
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define VELAR_HAS_COROUTINES
+#include <coroutine>
+#include <optional>
+#endif
+
+/*
+* Scatter/gather I/O takes a std::span of buffers when the standard library has it.
+*/
+#if __has_include(<span>)
+#include <span>
+#endif
+
+#ifdef __cpp_lib_span
+#define VELAR_HAS_SPAN
+#endif
+
 struct ByteBuffer {
 protected:
 	char *m_array = NULL;
 	size_t m_position = 0;
 	size_t m_capacity = 0;
 	size_t m_limit = 0;
+	//put() and reads from sockets are refused
+	bool m_read_only = false;
 
 public:
 	ByteBuffer() {}
@@ -70,6 +121,14 @@ public:
 		return m_capacity;
 	}
 
+	/**
+	 * @brief Checks if the memory of the buffer must not be changed. put(), compact()
+	 * and reading from a socket into the buffer throw std::runtime_error.
+	 */
+	bool is_read_only() {
+		return m_read_only;
+	}
+
 	void position(size_t pos) {
 		if (pos > m_limit) {
 			throw std::out_of_range("Position is greater than limit.");
@@ -116,6 +175,44 @@ public:
 		m_position = 0;
 	}
 
+	/**
+	 * @brief Moves the data that has not been read yet to the start of the buffer
+	 * and gets the buffer ready for writing after it.
+	 * 
+	 * Call this instead of clear() when a partly read buffer is to be filled again.
+	 * The position is set to the number of bytes moved and the limit to the capacity.
+	 * 
+	 * It is virtual so that code that only has a ByteBuffer&, such as Socket::drain(),
+	 * gets the copy free compact() of a RingByteBuffer. It is called once per read,
+	 * not per byte, so the indirect call costs little next to the memmove() it saves.
+	 */
+	virtual void compact();
+
+	/**
+	 * @brief Returns a buffer that shares the remaining data of this buffer.
+	 * 
+	 * No data is copied. The new buffer starts at the current position and its
+	 * capacity and limit are the number of bytes remaining. Its position and limit
+	 * are independent of this buffer's.
+	 * 
+	 * The returned buffer does not own the memory. It must not be used after this
+	 * buffer is destroyed, or after compact() is called on a RingByteBuffer.
+	 */
+	struct WrappedByteBuffer slice();
+	/**
+	 * @brief Returns a buffer that shares length bytes starting at offset.
+	 * The offset is counted from the start of the buffer, not the position.
+	 */
+	struct WrappedByteBuffer slice(size_t offset, size_t length);
+	/**
+	 * @brief Returns a buffer that shares all of this buffer's memory. Its position and
+	 * limit start out the same as this buffer's but change independently.
+	 * 
+	 * The same lifetime rules as for slice() apply. Views of a read only buffer
+	 * are read only.
+	 */
+	struct WrappedByteBuffer duplicate();
+
 	//Disable copying
 	ByteBuffer(const ByteBuffer&) = delete;
 	ByteBuffer& operator=(const ByteBuffer&) = delete;
@@ -139,6 +236,10 @@ public:
 	~StaticByteBuffer() {}
 };
 
+/**
+ * @brief A buffer of a size chosen at run time. The memory comes from the
+ * BufferPool and goes back to it when the buffer is destroyed.
+ */
 struct HeapByteBuffer : ByteBuffer {
 	HeapByteBuffer(size_t sz);
 	~HeapByteBuffer();
@@ -146,6 +247,12 @@ struct HeapByteBuffer : ByteBuffer {
 
 struct WrappedByteBuffer : ByteBuffer {
 	WrappedByteBuffer(char* data, size_t length);
+	/**
+	 * @brief Wraps the memory with the given limit and position already set.
+	 * 
+	 * @param read_only Set it for memory that must not be changed. See ByteBuffer::is_read_only().
+	 */
+	WrappedByteBuffer(char* data, size_t length, size_t limit, size_t position, bool read_only = false);
 	~WrappedByteBuffer() {}
 };
 
@@ -164,188 +271,1960 @@ public:
 	~MappedByteBuffer();
 };
 
+/**
+ * @brief A buffer whose memory is mapped twice, back to back, so that data that
+ * runs past the end continues at the start. 
+ * 
+ * compact() moves the start of the buffer to the unread data instead of copying
+ * the data. Stream data can then be read and parsed in pieces without ever being
+ * moved, and the buffer always looks contiguous to read() and write().
+ * 
+ * Because the start moves, array() changes with compact(). Do not use the buffer
+ * with Selector::register_buffers().
+ */
+struct RingByteBuffer : ByteBuffer {
+private:
+	//Start of the first of the two mappings
+	char* m_base = NULL;
+#ifdef _WIN32
+	HANDLE map_handle = NULL;
+#endif
+	void cleanup();
 
-struct SocketAttachment {};
+public:
+	/**
+	 * @brief Creates the buffer. The size is rounded up to a multiple of the page size,
+	 * or of the allocation granularity on Windows.
+	 */
+	RingByteBuffer(size_t sz);
+	~RingByteBuffer();
+
+	void compact() override;
+};
+
+/**
+ * @brief Recycles the memory of PooledByteBuffer objects.
+ * 
+ * Blocks are grouped in power of two size classes from 64 bytes to 1 MB. Each
+ * thread keeps its own free lists, so a buffer released and acquired again by
+ * the same thread involves no locking and no call to the system allocator.
+ * Larger blocks and alignments above the page size are not pooled. The same
+ * free lists hold the coroutine frames of the FramePool.
+ */
+struct BufferPool {
+	static constexpr size_t CACHE_LINE = 64;
+	static constexpr size_t PAGE = 4096;
+
+	/**
+	 * @brief Owns a block from the pool and gives it back when destroyed.
+	 * A lease can be moved but not copied.
+	 */
+	struct Lease {
+	private:
+		char* m_data = nullptr;
+		size_t m_size = 0;
+		size_t m_alignment = CACHE_LINE;
+
+	public:
+		Lease() = default;
+		Lease(char* data, size_t size, size_t alignment) : m_data(data), m_size(size), m_alignment(alignment) {}
+		Lease(Lease&& other) noexcept : m_data(other.m_data), m_size(other.m_size), m_alignment(other.m_alignment) {
+			other.m_data = nullptr;
+			other.m_size = 0;
+		}
+		Lease& operator=(Lease&& other) noexcept {
+			if (this != &other) {
+				reset();
+
+				m_data = other.m_data;
+				m_size = other.m_size;
+				m_alignment = other.m_alignment;
+
+				other.m_data = nullptr;
+				other.m_size = 0;
+			}
+
+			return *this;
+		}
+		Lease(const Lease&) = delete;
+		Lease& operator=(const Lease&) = delete;
+		~Lease() {
+			reset();
+		}
+
+		char* data() const {
+			return m_data;
+		}
+		size_t size() const {
+			return m_size;
+		}
+		explicit operator bool() const {
+			return m_data != nullptr;
+		}
+		/**
+		 * @brief Gives the block back to the pool now.
+		 */
+		void reset() {
+			if (m_data != nullptr) {
+				BufferPool::deallocate(m_data, m_size, m_alignment);
+
+				m_data = nullptr;
+				m_size = 0;
+			}
+		}
+	};
+
+	/**
+	 * @brief Returns a block of at least size bytes.
+	 * 
+	 * @param size Size of the block.
+	 * @param alignment Alignment of the block, a power of two. Blocks are always at
+	 * least cache line aligned.
+	 */
+	static char* allocate(size_t size, size_t alignment = CACHE_LINE);
+	/**
+	 * @brief Gives back a block. The size and alignment must be the same as were
+	 * passed to allocate(). The block can be released by any thread.
+	 */
+	static void deallocate(char* p, size_t size, size_t alignment = CACHE_LINE);
+	/**
+	 * @brief Returns a block of at least size bytes that goes back to the pool
+	 * when the lease is destroyed.
+	 * 
+	 * @param size Size of the block.
+	 * @param alignment Alignment of the block, a power of two.
+	 */
+	static Lease acquire(size_t size, size_t alignment = CACHE_LINE);
+	/**
+	 * @brief Frees the blocks cached by the calling thread.
+	 */
+	static void trim();
+	/**
+	 * @brief Returns the number of blocks cached by the calling thread.
+	 */
+	static size_t cached_count();
+};
 
-struct Socket {
+/**
+ * @brief A buffer whose memory comes from the BufferPool, like HeapByteBuffer,
+ * with a choice of alignment. The memory goes back to the pool when the
+ * buffer is destroyed.
+ */
+struct PooledByteBuffer : ByteBuffer {
 private:
-	std::bitset<9> m_io_flag;
-	SOCKET m_fd;
-	std::shared_ptr<SocketAttachment> m_attachment;
+	size_t m_alignment;
 
 public:
+	PooledByteBuffer(size_t sz, size_t alignment = BufferPool::CACHE_LINE);
+	~PooledByteBuffer();
+};
 
-	enum IOFlag {
-		REPORT_ACCEPTABLE,
-		REPORT_READABLE,
-		REPORT_WRITABLE,
-		IS_ACCEPTABLE,
-		IS_READABLE,
-		IS_WRITABLE,
-		IS_CONN_PENDING,
-		IS_CONN_FAILED,
-		IS_CONN_SUCCESS
-	};
+/**
+ * @brief A message that is written to many sockets without being copied for each one.
+ * 
+ * The data is copied once, into memory from the BufferPool, and never changes after
+ * that. Share the payload with std::shared_ptr and give each socket a PayloadCursor.
+ * The memory is freed when the last cursor and pointer are gone.
+ */
+struct SharedPayload {
+private:
+	char* m_data;
+	size_t m_size;
 
-	Socket(int domain, int type, int protocol);
-	Socket(SOCKET fd);
-	virtual ~Socket();
+public:
+	SharedPayload(std::string_view data);
+	~SharedPayload();
 
-	SOCKET fd() {
-		return m_fd;
+	std::string_view data() const {
+		return std::string_view(m_data, m_size);
 	}
 
-	void report_accpeptable(bool flag) {
-		m_io_flag.set(IOFlag::REPORT_ACCEPTABLE, flag);
+	size_t size() const {
+		return m_size;
 	}
 
-	void report_readable(bool flag) {
-		m_io_flag.set(IOFlag::REPORT_READABLE, flag);
-	}
+	//Disable copying
+	SharedPayload(const SharedPayload&) = delete;
+	SharedPayload& operator=(const SharedPayload&) = delete;
+};
 
-	void report_writable(bool flag) {
-		m_io_flag.set(IOFlag::REPORT_WRITABLE, flag);
-	}
+/**
+ * @brief Reads a SharedPayload with a position of its own. Pass it to Socket::write()
+ * like any other buffer. The cursor keeps the payload alive.
+ * 
+ * The payload is shared by all its cursors, so the cursor is read only. put(),
+ * compact() and reading from a socket into it throw std::runtime_error.
+ */
+struct PayloadCursor : ByteBuffer {
+private:
+	std::shared_ptr<const SharedPayload> m_payload;
 
-	bool is_report_acceptable() {
-		return m_io_flag.test(IOFlag::REPORT_ACCEPTABLE);
-	}
+public:
+	PayloadCursor(std::shared_ptr<const SharedPayload> payload);
+	~PayloadCursor() {}
 
-	bool is_report_readable() {
-		return m_io_flag.test(IOFlag::REPORT_READABLE);
+	const std::shared_ptr<const SharedPayload>& payload() {
+		return m_payload;
 	}
 
-	bool is_report_writable() {
-		return m_io_flag.test(IOFlag::REPORT_WRITABLE);
-	}
+	void compact() override;
+};
 
-	void set_acceptable(bool flag) {
-		m_io_flag.set(IOFlag::IS_ACCEPTABLE, flag);
-	}
+/**
+ * @brief A buffer that grows as data is added to it, for messages whose size is not
+ * known up front.
+ * 
+ * The data is held in a chain of fixed size segments taken from the BufferPool.
+ * Growing adds a segment and never copies the data already stored. Data is read
+ * from the front and written at the back, so there is no flip() or clear().
+ * Socket::read() and Socket::write() move data in and out of all the segments
+ * with a single system call.
+ */
+struct ChainedByteBuffer {
+	static constexpr size_t DEFAULT_SEGMENT_SIZE = 4096;
 
-	void set_readable(bool flag) {
-		m_io_flag.set(IOFlag::IS_READABLE, flag);
-	}
+private:
+	struct Segment {
+		char* data;
+		//The data between begin and end has not been read yet
+		size_t begin;
+		size_t end;
+	};
 
-	void set_writable(bool flag) {
-		m_io_flag.set(IOFlag::IS_WRITABLE, flag);
-	}
+	std::deque<Segment> m_segments;
+	size_t m_segment_size;
+	size_t m_size = 0;
 
-	bool is_readable() {
-		return m_io_flag.test(IOFlag::IS_READABLE);
-	}
+	void add_segment();
 
-	bool is_writable() {
-		return m_io_flag.test(IOFlag::IS_WRITABLE);
-	}
+	friend struct Socket;
 
-	bool is_acceptable() {
-		return m_io_flag.test(IOFlag::IS_ACCEPTABLE);
-	}
+public:
+	/**
+	 * @brief Creates an empty buffer. No memory is taken until data is added.
+	 * 
+	 * @param segment_size Size of each segment.
+	 */
+	ChainedByteBuffer(size_t segment_size = DEFAULT_SEGMENT_SIZE);
+	~ChainedByteBuffer();
 
-	void set_connection_pending(bool flag) {
-		m_io_flag.set(IOFlag::IS_CONN_PENDING, flag);
-	}
+	void put(const char* from, size_t length);
+	void put(std::string_view sv);
+	void put(char byte);
 
-	bool is_connection_pending() {
-		return m_io_flag.test(IOFlag::IS_CONN_PENDING);
-	}
+	/**
+	 * @brief Copies length bytes from the front of the buffer and removes them.
+	 * Throws std::out_of_range if the buffer has fewer bytes.
+	 */
+	void get(char* to, size_t length);
+	/**
+	 * @brief Removes length bytes from the front of the buffer without copying them.
+	 * Segments that have been fully read go back to the pool.
+	 */
+	void consume(size_t length);
+	/**
+	 * @brief Removes all the data and gives all the segments back to the pool.
+	 */
+	void clear();
 
-	void set_connection_failed(bool flag) {
-		m_io_flag.set(IOFlag::IS_CONN_FAILED, flag);
+	/**
+	 * @brief Returns the number of bytes that have not been read yet.
+	 */
+	size_t size() {
+		return m_size;
 	}
 
-	bool is_connection_failed() {
-		return m_io_flag.test(IOFlag::IS_CONN_FAILED);
+	bool empty() {
+		return m_size == 0;
 	}
 
-	void set_connection_success(bool flag) {
-		m_io_flag.set(IOFlag::IS_CONN_SUCCESS, flag);
-	}
+	/**
+	 * @brief Returns the number of segments that hold data.
+	 */
+	size_t segment_count();
+	/**
+	 * @brief Shares the unread data of a segment. No data is copied. The view is
+	 * valid until the data is consumed.
+	 */
+	std::string_view segment(size_t index);
 
-	bool is_connection_success() {
-		return m_io_flag.test(IOFlag::IS_CONN_SUCCESS);
-	}
+	//Disable copying
+	ChainedByteBuffer(const ChainedByteBuffer&) = delete;
+	ChainedByteBuffer& operator=(const ChainedByteBuffer&) = delete;
+};
+
+/**
+ * @brief A part of a file to be sent by Socket::transfer_from(). Like the position of
+ * a ByteBuffer, the offset moves forward as the data is sent.
+ */
+struct FileRegion {
+private:
+#ifdef _WIN32
+	HANDLE m_file = INVALID_HANDLE_VALUE;
+#else
+	int m_file = -1;
+#endif
+	uint64_t m_offset;
+	uint64_t m_end;
 
+	friend struct Socket;
+
+public:
 	/**
-	 * @brief Sets the socket attachment. The attachment is a shared pointer to a SocketAttachment object.
-	 * It can be used to store additional information about the socket.
+	 * @brief Opens the file for reading.
 	 * 
-	 * @param a A shared pointer to a SocketAttachment object.
+	 * @param file_name Name of the file.
+	 * @param offset Where in the file to start.
+	 * @param length Number of bytes to send. It is cut short at the end of the file.
 	 */
-	void attachment(std::shared_ptr<SocketAttachment>& a) {
-		m_attachment = a;
-	}
+	FileRegion(const char* file_name, uint64_t offset = 0, uint64_t length = UINT64_MAX);
+	~FileRegion();
 
-	template<class T>
-	std::shared_ptr<T> attachment() {
-		return std::static_pointer_cast<T>(m_attachment);
+	uint64_t offset() {
+		return m_offset;
 	}
 
-	int read(ByteBuffer& b);
-	int write(ByteBuffer& b);
-	int recvfrom(ByteBuffer& b, sockaddr* from, int* from_len);
-	int sendto(ByteBuffer& b, const struct sockaddr* to, int to_len);
+	uint64_t remaining() {
+		return m_end - m_offset;
+	}
 
-	bool operator<(const Socket& other) const {
-		return m_fd < other.m_fd;
+	bool has_remaining() {
+		return m_offset < m_end;
 	}
 
 	//Disable copying
-	Socket(const Socket&) = delete;
-	Socket& operator=(const Socket&) = delete;
+	FileRegion(const FileRegion&) = delete;
+	FileRegion& operator=(const FileRegion&) = delete;
+};
 
-	// Disable moving
-	Socket(Socket&&) = delete;
-	Socket& operator=(Socket&&) = delete;
+
+struct SocketAttachment {};
+
+struct Socket;
+struct TimerWheel;
+
+/*
+* A list of timers. Timers are linked directly to each other,
+* so adding and removing them does not allocate any memory.
+*/
+struct TimerList {
+	struct Timer* head = nullptr;
+	TimerWheel* wheel = nullptr;
+	//Position of this list in the wheel. Negative if not part of a wheel.
+	int index = -1;
 };
 
 /*
-* A socket class that remembers the destination server's
-* address and port. This makes it easy to call sendto().
+* A one-shot or periodic timer managed by a Selector. The application owns the
+* timer object. It must outlive the schedule, or be destroyed, which cancels it.
+* See Selector::schedule().
 */
-struct DatagramClientSocket : public Socket {
-	addrinfo *server_address;
+struct Timer {
+private:
+	Timer* m_next = nullptr;
+	Timer* m_prev = nullptr;
+	TimerList* m_list = nullptr;
+	//Expiration and period in ticks of the timer wheel
+	uint64_t m_expires = 0;
+	uint64_t m_period = 0;
+	std::function<void()> m_callback;
+
+	/*
+	* Timers used for socket deadlines report to
+	* the socket instead of calling a callback.
+	*/
+	Socket* m_socket = nullptr;
+	int m_deadline = 0;
+
+	friend struct TimerWheel;
+	friend struct Selector;
 
-	DatagramClientSocket(addrinfo* addr);
-	~DatagramClientSocket();
+public:
+	Timer() {}
+	~Timer();
 
-	int sendto(ByteBuffer& b);
-	using Socket::sendto;
+	bool is_scheduled() {
+		return m_list != nullptr;
+	}
 
-	int recvfrom(ByteBuffer& b);
-	using Socket::recvfrom;
+	//Disable copying
+	Timer(const Timer&) = delete;
+	Timer& operator=(const Timer&) = delete;
 };
 
-struct Selector {
+/*
+* A hierarchical timing wheel. Each of the LEVELS levels has SLOTS slots.
+* A slot in level n spans SLOTS^n ticks. Timers far in the future sit in the
+* higher levels and move down as their time approaches. Adding, removing and
+* expiring a timer are all O(1). A bitmap of occupied slots per level lets
+* the wheel find the next expiration without scanning.
+*/
+struct TimerWheel {
+	static const int LEVELS = 6;
+	static const int SLOTS = 64;
+	static const int SLOT_BITS = 6;
+
+	//Resolution of the timers
+	static constexpr std::chrono::microseconds TICK{ 100 };
+
 private:
-	void purge_sokets();
-	void populate_fd_set(fd_set& read_fd_set, fd_set& write_fd_set, fd_set& except_fd_set);
-	std::set<std::shared_ptr<Socket>> m_canceled_sockets;
-	std::set<std::shared_ptr<Socket>> m_sockets;
+	TimerList m_slots[LEVELS][SLOTS];
+	uint64_t m_occupied[LEVELS] = {};
+	uint64_t m_now = 0;
+	std::chrono::steady_clock::time_point m_epoch;
+
+	void place(Timer* t);
 
 public:
+	TimerWheel();
+	~TimerWheel();
 
-	std::shared_ptr<Socket> start_udp_server(int port, std::shared_ptr<SocketAttachment> attachment);
-	std::shared_ptr<Socket> start_multicast_server(const char* group_address, int port, std::shared_ptr<SocketAttachment> attachment);
-	/**
-	 * @brief Starts a TCP server on the specified port with the given socket attachment.
-	 * 
-	 * This function initializes and starts a TCP server that listens on the specified port.
-	 * It sets the attachment of the server's socket to the provided socket attachment.
-	 * 
-	 * @param port The port number on which the server will listen for incoming connections.
-	 * @param attachment A shared pointer to a SocketAttachment object that will be set as the server's attachment.
-	 * @return A shared pointer to a Socket object representing the started server.
-	 */
-	std::shared_ptr<Socket> start_server(int port, std::shared_ptr<SocketAttachment> attachment);
-	std::shared_ptr<Socket> start_client(const char* address, int port, std::shared_ptr<SocketAttachment> attachment);
-	std::shared_ptr<DatagramClientSocket> start_udp_client(const char* address, int port, std::shared_ptr<SocketAttachment> attachment);
-	std::shared_ptr<Socket> accept(std::shared_ptr<Socket> server, std::shared_ptr<SocketAttachment> attachment);
-	int select(long timeout=0);
-	void cancel_socket(std::shared_ptr<Socket> socket);
+	uint64_t clock();
+	uint64_t to_ticks(std::chrono::microseconds duration);
+	uint64_t deadline(std::chrono::microseconds delay);
+	std::chrono::microseconds time_until(uint64_t tick);
 
-	const std::set<std::shared_ptr<Socket>>& sockets() {
-		return m_sockets;
-	}
+	void add(Timer* t, uint64_t expires);
+	uint64_t next_expiration();
+	void advance(uint64_t tick, TimerList& expired);
+
+	static void push(TimerList& list, Timer* t);
+	static void unlink(Timer* t);
+
+	//Disable copying
+	TimerWheel(const TimerWheel&) = delete;
+	TimerWheel& operator=(const TimerWheel&) = delete;
+};
+
+/*
+* A lock-free queue of tasks with many producers and a single consumer.
+* Any thread can push. Only the thread that owns the queue can pop.
+* Each push allocates one node, and no locks are taken.
+*/
+struct TaskQueue {
+private:
+	struct Node {
+		std::atomic<Node*> next{ nullptr };
+		std::function<void()> task;
+	};
+
+	//Producers add to the head, the consumer removes from the tail
+	std::atomic<Node*> m_head;
+	Node* m_tail;
+	Node m_stub;
+
+	void push(Node* n);
+
+public:
+	TaskQueue();
+	~TaskQueue();
+
+	void push(std::function<void()> task);
+	bool pop(std::function<void()>& task);
+
+	//Disable copying
+	TaskQueue(const TaskQueue&) = delete;
+	TaskQueue& operator=(const TaskQueue&) = delete;
+};
+
+struct Selector;
+struct IoUring;
+struct Wakeup;
+struct ResolverLink;
+struct ConnectRace;
+struct Relay;
+struct IdleConnectionHandler;
+
+/**
+ * @brief Results of host name lookups are kept in a cache shared by all selectors,
+ * so repeated connections to the same server skip the lookup.
+ */
+struct DnsCache {
+	/**
+	 * @brief Sets how long lookup results are kept. Applies to results stored from now on.
+	 * 
+	 * @param ttl How long an address is kept. Zero disables caching.
+	 * @param negative_ttl How long a name that does not exist is remembered. Zero disables it.
+	 */
+	static void set_ttl(std::chrono::seconds ttl, std::chrono::seconds negative_ttl = std::chrono::seconds(5));
+	/**
+	 * @brief Forgets all lookup results.
+	 */
+	static void clear();
+	/**
+	 * @brief Returns the number of names in the cache.
+	 */
+	static size_t size();
+};
+
+#ifdef VELAR_HAS_COROUTINES
+/*
+* Coroutine frames are allocated from the per thread free lists of the
+* BufferPool. A connection that is opened and closed over and over reuses
+* the same frames instead of going to the heap each time.
+*/
+struct FramePool {
+	static void* allocate(size_t size);
+	static void deallocate(void* p, size_t size);
+};
+
+template<class T> struct Task;
+
+struct TaskPromiseBase {
+	//The coroutine that is awaiting this one
+	std::coroutine_handle<> m_continuation;
+	std::exception_ptr m_error;
+	//Set for a task started by Selector::spawn(). It then owns the frame.
+	Selector* m_selector = nullptr;
+	size_t m_slot = 0;
+
+	static void* operator new(size_t size) {
+		return FramePool::allocate(size);
+	}
+
+	static void operator delete(void* p, size_t size) {
+		FramePool::deallocate(p, size);
+	}
+
+	struct FinalAwaiter {
+		bool await_ready() noexcept {
+			return false;
+		}
+
+		template<class P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+			return h.promise().finish(h);
+		}
+
+		void await_resume() noexcept {}
+	};
+
+	//Tasks start running when they are awaited or spawned
+	std::suspend_always initial_suspend() noexcept {
+		return {};
+	}
+
+	FinalAwaiter final_suspend() noexcept {
+		return {};
+	}
+
+	void unhandled_exception() {
+		m_error = std::current_exception();
+	}
+
+	std::coroutine_handle<> finish(std::coroutine_handle<> self) noexcept;
+};
+
+template<class T>
+struct TaskPromise : TaskPromiseBase {
+	std::optional<T> m_value;
+
+	Task<T> get_return_object();
+
+	template<class U>
+	void return_value(U&& value) {
+		m_value.emplace(std::forward<U>(value));
+	}
+};
+
+template<>
+struct TaskPromise<void> : TaskPromiseBase {
+	Task<void> get_return_object();
+
+	void return_void() {}
+};
+
+/**
+ * @brief A coroutine that runs on a Selector. It can co_await the socket
+ * operations and other tasks.
+ * 
+ * A task does not start until it is awaited by another task or started
+ * by Selector::spawn().
+ */
+template<class T = void>
+struct [[nodiscard]] Task {
+	using promise_type = TaskPromise<T>;
+
+private:
+	std::coroutine_handle<promise_type> m_handle;
+
+	friend struct Selector;
+
+public:
+	explicit Task(std::coroutine_handle<promise_type> h) : m_handle(h) {
+	}
+
+	Task(Task&& other) noexcept : m_handle(other.m_handle) {
+		other.m_handle = nullptr;
+	}
+
+	Task& operator=(Task&& other) noexcept {
+		if (this != &other) {
+			if (m_handle) {
+				m_handle.destroy();
+			}
+
+			m_handle = other.m_handle;
+			other.m_handle = nullptr;
+		}
+
+		return *this;
+	}
+
+	~Task() {
+		if (m_handle) {
+			m_handle.destroy();
+		}
+	}
+
+	bool await_ready() noexcept {
+		return false;
+	}
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+		m_handle.promise().m_continuation = caller;
+
+		//Start the task right away
+		return m_handle;
+	}
+
+	T await_resume() {
+		auto& promise = m_handle.promise();
+
+		if (promise.m_error) {
+			std::rethrow_exception(promise.m_error);
+		}
+
+		if constexpr (!std::is_void_v<T>) {
+			return std::move(*promise.m_value);
+		}
+	}
+
+	//Disable copying
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+};
+
+template<class T>
+Task<T> TaskPromise<T>::get_return_object() {
+	return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+	return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+/*
+* A coroutine waiting for a socket to become ready. The Selector keeps
+* a pointer to it in the socket and resumes the coroutine once the
+* operation completes.
+*/
+struct IoAwaiter {
+	std::shared_ptr<Socket> m_socket;
+	std::coroutine_handle<> m_handle;
+	//Waits for writability instead of readability
+	bool m_is_write = false;
+	//The reporting flag to restore when done
+	bool m_was_reporting = false;
+
+	IoAwaiter(std::shared_ptr<Socket> socket, bool is_write) : m_socket(std::move(socket)), m_is_write(is_write) {
+	}
+
+	virtual ~IoAwaiter() = default;
+
+	//Attempts the operation. Returns true when it is done.
+	virtual bool try_complete() = 0;
+	//Called when the socket is canceled while waiting
+	virtual void fail() = 0;
+
+	bool await_ready() {
+		return try_complete();
+	}
+
+	void await_suspend(std::coroutine_handle<> h);
+};
+
+struct ReadAwaiter : IoAwaiter {
+	ByteBuffer& m_buffer;
+	int m_result = 0;
+
+	ReadAwaiter(std::shared_ptr<Socket> socket, ByteBuffer& b) : IoAwaiter(std::move(socket), false), m_buffer(b) {
+	}
+
+	bool try_complete() override;
+	void fail() override;
+
+	int await_resume() {
+		return m_result;
+	}
+};
+
+struct WriteAwaiter : IoAwaiter {
+	ByteBuffer& m_buffer;
+	int m_result = 0;
+
+	WriteAwaiter(std::shared_ptr<Socket> socket, ByteBuffer& b) : IoAwaiter(std::move(socket), true), m_buffer(b) {
+	}
+
+	bool try_complete() override;
+	void fail() override;
+
+	int await_resume() {
+		return m_result;
+	}
+};
+
+struct AcceptAwaiter : IoAwaiter {
+	std::shared_ptr<Socket> m_client;
+
+	AcceptAwaiter(std::shared_ptr<Socket> server) : IoAwaiter(std::move(server), false) {
+	}
+
+	bool try_complete() override;
+	void fail() override;
+
+	std::shared_ptr<Socket> await_resume() {
+		return std::move(m_client);
+	}
+};
+
+struct ConnectAwaiter : IoAwaiter {
+	bool m_failed = false;
+
+	ConnectAwaiter(std::shared_ptr<Socket> client) : IoAwaiter(std::move(client), true) {
+	}
+
+	bool try_complete() override;
+	void fail() override;
+
+	std::shared_ptr<Socket> await_resume();
+};
+#endif
+
+/**
+ * @brief Receives the events of the sockets it is set for. Override only the
+ * methods for the events you care about.
+ * 
+ * Selector::dispatch() calls the handlers after select(). A single handler
+ * object can serve any number of sockets.
+ */
+struct SocketHandler {
+	virtual ~SocketHandler() = default;
+
+	/**
+	 * @brief A client is waiting to be accepted by the server.
+	 */
+	virtual void on_accept(Selector& /*sel*/, const std::shared_ptr<Socket>& /*server*/) {}
+	virtual void on_readable(Selector& /*sel*/, const std::shared_ptr<Socket>& /*socket*/) {}
+	virtual void on_writable(Selector& /*sel*/, const std::shared_ptr<Socket>& /*socket*/) {}
+	/**
+	 * @brief The connection started by Selector::start_client() has completed.
+	 */
+	virtual void on_connected(Selector& /*sel*/, const std::shared_ptr<Socket>& /*socket*/) {}
+	/**
+	 * @brief The connection started by Selector::start_client() has failed or timed out,
+	 * or writing the data queued by Socket::send() has failed.
+	 * The socket is of no further use and should be canceled.
+	 */
+	virtual void on_error(Selector& /*sel*/, const std::shared_ptr<Socket>& /*socket*/) {}
+	/**
+	 * @brief An idle or read deadline has passed. Check is_idle_timeout() and is_read_timeout().
+	 */
+	virtual void on_timeout(Selector& /*sel*/, const std::shared_ptr<Socket>& /*socket*/) {}
+	/**
+	 * @brief A read or write submitted to the io_uring engine has completed.
+	 */
+	virtual void on_read_complete(Selector& /*sel*/, const std::shared_ptr<Socket>& /*socket*/) {}
+	virtual void on_write_complete(Selector& /*sel*/, const std::shared_ptr<Socket>& /*socket*/) {}
+	/**
+	 * @brief The write queue has gone down to the low watermark. See Socket::set_write_watermarks().
+	 */
+	virtual void on_write_queue_drained(Selector& /*sel*/, const std::shared_ptr<Socket>& /*socket*/) {}
+};
+
+/**
+ * @brief The outcome of Socket::drain().
+ */
+struct DrainResult {
+	//Total number of bytes read
+	size_t bytes_read = 0;
+	//The connection was closed by the other party or has failed
+	bool closed = false;
+	//Reading stopped at the byte budget or a full buffer. More data may be waiting.
+	bool more = false;
+};
+
+struct Socket : public std::enable_shared_from_this<Socket> {
+private:
+	std::bitset<32> m_io_flag;
+	SOCKET m_fd;
+	std::shared_ptr<SocketAttachment> m_attachment;
+	std::shared_ptr<SocketHandler> m_handler;
+
+#ifdef VELAR_HAS_COROUTINES
+	//Coroutines waiting for this socket to become readable and writable
+	IoAwaiter* m_read_awaiter = nullptr;
+	IoAwaiter* m_write_awaiter = nullptr;
+#endif
+
+	/*
+	* Bookkeeping used by the Selector that owns this socket.
+	*/
+	Selector* m_selector = nullptr;
+	uint32_t m_registered_events = 0;
+	bool m_interest_dirty = false;
+	bool m_in_ready_list = false;
+	bool m_canceled = false;
+	//Events are reported once per change of readiness. See set_edge_triggered().
+	bool m_edge_triggered = false;
+	//The kernel is to check the readiness again with the next select()
+	bool m_rearm = false;
+	//drain() stopped before the socket would block
+	bool m_drain_pending = false;
+	//The address is being resolved. The socket has no file descriptor yet.
+	bool m_resolving = false;
+	//Connection attempts to the resolved addresses that race each other
+	std::shared_ptr<ConnectRace> m_race;
+	//Set while the selector relays data between this socket and another one
+	std::shared_ptr<Relay> m_relay;
+	//Index of this socket in the selector's socket list
+	size_t m_slot = 0;
+
+	/*
+	* Deadlines. The idle and read timers are not moved on every event.
+	* Instead, the time of the last activity is recorded and checked
+	* when the timer expires.
+	*/
+	Timer m_idle_timer;
+	Timer m_read_timer;
+	Timer m_connect_timer;
+	uint64_t m_idle_timeout = 0;
+	uint64_t m_read_timeout = 0;
+	uint64_t m_last_activity = 0;
+	uint64_t m_last_read = 0;
+
+#ifdef VELAR_USE_IO_URING
+	/*
+	* State of the operations submitted to the io_uring engine.
+	*/
+	ByteBuffer* m_read_buffer = nullptr;
+	ByteBuffer* m_write_buffer = nullptr;
+	int m_read_result = 0;
+	int m_write_result = 0;
+	int m_pending_ops = 0;
+	int m_file_slot = -1;
+	bool m_async_accept = false;
+	SOCKET m_accepted_fd = INVALID_SOCKET;
+#endif
+
+	/*
+	* Data given to send() that could not be written right away. It is
+	* written by select() as soon as the socket becomes writable.
+	*/
+	struct PendingWrite {
+		std::shared_ptr<const SharedPayload> payload;
+		size_t offset;
+	};
+
+	std::deque<PendingWrite> m_write_queue;
+	size_t m_queued_bytes = 0;
+	size_t m_low_watermark = 0;
+	size_t m_high_watermark = SIZE_MAX;
+	bool m_write_queue_full = false;
+	//Writable reporting was turned on by the write queue, not the application
+	bool m_queue_writable = false;
+
+	int send(const char* data, size_t length, std::shared_ptr<const SharedPayload> payload);
+	void drain_stopped();
+	int flush_write_queue();
+	void update_write_queue();
+
+	void interest_changed();
+
+	friend struct Selector;
+	friend struct DatagramClientSocket;
+	friend struct ConnectionPool;
+#ifdef VELAR_HAS_COROUTINES
+	friend struct IoAwaiter;
+	friend struct AcceptAwaiter;
+	friend struct ConnectAwaiter;
+#endif
+
+public:
+
+	enum IOFlag {
+		REPORT_ACCEPTABLE,
+		REPORT_READABLE,
+		REPORT_WRITABLE,
+		IS_ACCEPTABLE,
+		IS_READABLE,
+		IS_WRITABLE,
+		IS_CONN_PENDING,
+		IS_CONN_FAILED,
+		IS_CONN_SUCCESS,
+		IS_READ_COMPLETE,
+		IS_WRITE_COMPLETE,
+		IS_IDLE_TIMEOUT,
+		IS_READ_TIMEOUT,
+		IS_CONNECT_TIMEOUT,
+		IS_WRITE_QUEUE_DRAINED,
+		IS_WRITE_FAILED,
+		IS_CONN_REUSED
+	};
+
+	Socket(int domain, int type, int protocol);
+	Socket(SOCKET fd);
+	virtual ~Socket();
+
+	SOCKET fd() {
+		return m_fd;
+	}
+
+	void report_accpeptable(bool flag) {
+		m_io_flag.set(IOFlag::REPORT_ACCEPTABLE, flag);
+		interest_changed();
+	}
+
+	void report_readable(bool flag) {
+		m_io_flag.set(IOFlag::REPORT_READABLE, flag);
+		interest_changed();
+	}
+
+	void report_writable(bool flag) {
+		m_io_flag.set(IOFlag::REPORT_WRITABLE, flag);
+		interest_changed();
+	}
+
+	bool is_report_acceptable() {
+		return m_io_flag.test(IOFlag::REPORT_ACCEPTABLE);
+	}
+
+	bool is_report_readable() {
+		return m_io_flag.test(IOFlag::REPORT_READABLE);
+	}
+
+	bool is_report_writable() {
+		return m_io_flag.test(IOFlag::REPORT_WRITABLE);
+	}
+
+	void set_acceptable(bool flag) {
+		m_io_flag.set(IOFlag::IS_ACCEPTABLE, flag);
+	}
+
+	void set_readable(bool flag) {
+		m_io_flag.set(IOFlag::IS_READABLE, flag);
+	}
+
+	void set_writable(bool flag) {
+		m_io_flag.set(IOFlag::IS_WRITABLE, flag);
+	}
+
+	bool is_readable() {
+		return m_io_flag.test(IOFlag::IS_READABLE);
+	}
+
+	bool is_writable() {
+		return m_io_flag.test(IOFlag::IS_WRITABLE);
+	}
+
+	bool is_acceptable() {
+		return m_io_flag.test(IOFlag::IS_ACCEPTABLE);
+	}
+
+	void set_connection_pending(bool flag) {
+		m_io_flag.set(IOFlag::IS_CONN_PENDING, flag);
+		interest_changed();
+	}
+
+	bool is_connection_pending() {
+		return m_io_flag.test(IOFlag::IS_CONN_PENDING);
+	}
+
+	void set_connection_failed(bool flag) {
+		m_io_flag.set(IOFlag::IS_CONN_FAILED, flag);
+	}
+
+	bool is_connection_failed() {
+		return m_io_flag.test(IOFlag::IS_CONN_FAILED);
+	}
+
+	void set_connection_success(bool flag) {
+		m_io_flag.set(IOFlag::IS_CONN_SUCCESS, flag);
+	}
+
+	bool is_connection_success() {
+		return m_io_flag.test(IOFlag::IS_CONN_SUCCESS);
+	}
+
+	void set_connection_reused(bool flag) {
+		m_io_flag.set(IOFlag::IS_CONN_REUSED, flag);
+	}
+
+	/**
+	 * @brief Checks if the connection reported by is_connection_success() is an
+	 * idle connection handed out again by a ConnectionPool.
+	 */
+	bool is_connection_reused() {
+		return m_io_flag.test(IOFlag::IS_CONN_REUSED);
+	}
+
+	void set_read_complete(bool flag) {
+		m_io_flag.set(IOFlag::IS_READ_COMPLETE, flag);
+	}
+
+	/**
+	 * @brief Checks if a read submitted with Selector::submit_read() has completed.
+	 * 
+	 * @return true if the read completed during the last select(). The outcome
+	 * is available from read_result().
+	 */
+	bool is_read_complete() {
+		return m_io_flag.test(IOFlag::IS_READ_COMPLETE);
+	}
+
+	void set_write_complete(bool flag) {
+		m_io_flag.set(IOFlag::IS_WRITE_COMPLETE, flag);
+	}
+
+	/**
+	 * @brief Checks if a write submitted with Selector::submit_write() has completed.
+	 * 
+	 * @return true if the write completed during the last select(). The outcome
+	 * is available from write_result().
+	 */
+	bool is_write_complete() {
+		return m_io_flag.test(IOFlag::IS_WRITE_COMPLETE);
+	}
+
+	void set_idle_timeout(bool flag) {
+		m_io_flag.set(IOFlag::IS_IDLE_TIMEOUT, flag);
+	}
+
+	/**
+	 * @brief Checks if the socket has had no events for the duration set
+	 * by Selector::set_idle_timeout().
+	 */
+	bool is_idle_timeout() {
+		return m_io_flag.test(IOFlag::IS_IDLE_TIMEOUT);
+	}
+
+	void set_read_timeout(bool flag) {
+		m_io_flag.set(IOFlag::IS_READ_TIMEOUT, flag);
+	}
+
+	/**
+	 * @brief Checks if the socket has not become readable within the duration set
+	 * by Selector::set_read_timeout().
+	 */
+	bool is_read_timeout() {
+		return m_io_flag.test(IOFlag::IS_READ_TIMEOUT);
+	}
+
+	void set_connect_timeout(bool flag) {
+		m_io_flag.set(IOFlag::IS_CONNECT_TIMEOUT, flag);
+	}
+
+	/**
+	 * @brief Checks if the connection has failed because it did not complete within
+	 * the duration set by Selector::set_connect_timeout(). is_connection_failed()
+	 * is also true in that case.
+	 */
+	bool is_connect_timeout() {
+		return m_io_flag.test(IOFlag::IS_CONNECT_TIMEOUT);
+	}
+
+	void set_write_queue_drained(bool flag) {
+		m_io_flag.set(IOFlag::IS_WRITE_QUEUE_DRAINED, flag);
+	}
+
+	/**
+	 * @brief Checks if the write queue has gone down to the low watermark after
+	 * reaching the high watermark. More data can be sent now.
+	 */
+	bool is_write_queue_drained() {
+		return m_io_flag.test(IOFlag::IS_WRITE_QUEUE_DRAINED);
+	}
+
+	void set_write_failed(bool flag) {
+		m_io_flag.set(IOFlag::IS_WRITE_FAILED, flag);
+	}
+
+	/**
+	 * @brief Checks if writing the queued data has failed. The queue has been
+	 * emptied and the socket should be canceled.
+	 */
+	bool is_write_failed() {
+		return m_io_flag.test(IOFlag::IS_WRITE_FAILED);
+	}
+
+#ifdef VELAR_USE_IO_URING
+	/*
+	* Outcome of the last completed read or write. The values have
+	* the same meaning as the return value of read() and write().
+	*/
+	int read_result() {
+		return m_read_result;
+	}
+
+	int write_result() {
+		return m_write_result;
+	}
+#endif
+
+	/**
+	 * @brief Reports events only when the socket's readiness changes, not for as long
+	 * as it lasts.
+	 * 
+	 * Once the socket is reported readable it is not reported again until new data
+	 * arrives after it has been read until it would block. The same goes for writable.
+	 * A socket that is not fully read is therefore not reported over and over while
+	 * the application leaves it alone. Use drain() and accept_all() to read until the
+	 * socket would block. If drain() stops at its budget the next select() reports
+	 * the socket readable again. Call rearm() to have it reported again otherwise.
+	 * 
+	 * Only the epoll backend has edge triggered events. With select() events are
+	 * always reported as long as they last, which also meets the above contract.
+	 * Do not use it with the coroutine API or the io_uring engine.
+	 */
+	void set_edge_triggered(bool flag) {
+		m_edge_triggered = flag;
+		interest_changed();
+	}
+
+	bool is_edge_triggered() {
+		return m_edge_triggered;
+	}
+
+	/**
+	 * @brief Makes an edge triggered socket report its current readiness again with
+	 * the next select(), for example after the application has stopped reading
+	 * for a while.
+	 */
+	void rearm() {
+		m_rearm = true;
+		interest_changed();
+	}
+
+	/**
+	 * @brief Sets the socket attachment. The attachment is a shared pointer to a SocketAttachment object.
+	 * It can be used to store additional information about the socket.
+	 * 
+	 * @param a A shared pointer to a SocketAttachment object.
+	 */
+	void attachment(std::shared_ptr<SocketAttachment>& a) {
+		m_attachment = a;
+	}
+
+	template<class T>
+	std::shared_ptr<T> attachment() {
+		return std::static_pointer_cast<T>(m_attachment);
+	}
+
+	/**
+	 * @brief Sets the handler that Selector::dispatch() calls for this socket's events.
+	 * The same handler can be set for many sockets.
+	 */
+	void handler(std::shared_ptr<SocketHandler> h) {
+		m_handler = std::move(h);
+	}
+
+	const std::shared_ptr<SocketHandler>& handler() {
+		return m_handler;
+	}
+
+#ifdef VELAR_HAS_COROUTINES
+	/**
+	 * @brief Reads from the socket into the buffer in a coroutine.
+	 * 
+	 * co_await suspends the coroutine until some data has been read. The result
+	 * has the same meaning as that of read() except that it is never zero.
+	 */
+	ReadAwaiter async_read(ByteBuffer& b) {
+		return ReadAwaiter(shared_from_this(), b);
+	}
+
+	/**
+	 * @brief Writes all the remaining bytes of the buffer in a coroutine.
+	 * 
+	 * co_await suspends the coroutine until the whole buffer has been written.
+	 * The result is the number of bytes written or -1 if the connection was lost.
+	 */
+	WriteAwaiter async_write(ByteBuffer& b) {
+		return WriteAwaiter(shared_from_this(), b);
+	}
+#endif
+
+	int read(ByteBuffer& b);
+	int write(ByteBuffer& b);
+
+	static constexpr size_t DEFAULT_DRAIN_BUDGET = 1024 * 1024;
+
+	/**
+	 * @brief Reads until the socket has no more data, instead of once per select().
+	 * 
+	 * Reading stops when the socket would block, the connection is closed, budget
+	 * bytes have been read or the buffer is full. The budget keeps one busy socket
+	 * from starving the others.
+	 * 
+	 * @param b The buffer to read into.
+	 * @param budget Maximum number of bytes to read.
+	 */
+	DrainResult drain(ByteBuffer& b, size_t budget = DEFAULT_DRAIN_BUDGET);
+	/**
+	 * @brief Same as drain(ByteBuffer&, size_t) but the data is handed to a consumer
+	 * as it arrives.
+	 * 
+	 * The consumer is called with the buffer flipped after every read so that it can
+	 * take the data out. Whatever it leaves unread is kept with compact() and reading
+	 * continues after it. The consumer is a template parameter so that a lambda is
+	 * inlined into the read loop.
+	 * 
+	 * @param consumer Called as consumer(ByteBuffer&). nullptr means no consumer.
+	 */
+	template<class Consumer>
+	DrainResult drain(ByteBuffer& b, size_t budget, Consumer&& consumer) {
+		DrainResult result;
+
+		while (result.bytes_read < budget) {
+			if (!b.has_remaining()) {
+				result.more = true;
+
+				drain_stopped();
+
+				return result;
+			}
+
+			//Don't read past the budget
+			size_t limit = b.limit();
+			size_t left = budget - result.bytes_read;
+
+			b.limit(b.position() + (b.remaining() < left ? b.remaining() : left));
+
+			int n = read(b);
+
+			b.limit(limit);
+
+			if (n < 0) {
+				result.closed = true;
+
+				return result;
+			}
+
+			if (n == 0) {
+				return result;
+			}
+
+			result.bytes_read += n;
+
+			if constexpr (!std::is_same_v<std::decay_t<Consumer>, std::nullptr_t>) {
+				b.flip();
+
+				consumer(b);
+
+				b.compact();
+			}
+		}
+
+		result.more = true;
+
+		drain_stopped();
+
+		return result;
+	}
+	/**
+	 * @brief Reads into a chained buffer until the socket has no more data or budget
+	 * bytes have been read. The buffer grows as needed.
+	 */
+	DrainResult drain(ChainedByteBuffer& b, size_t budget = DEFAULT_DRAIN_BUDGET);
+
+	/**
+	 * @brief Writes data now if possible and queues the rest.
+	 * 
+	 * Data that can't be written right away is copied into the socket's write queue.
+	 * select() writes it as soon as the socket becomes writable, turning writable
+	 * reporting on and off as needed. The application does not see those writable
+	 * events. Do not call write() or report_writable() while data is queued.
+	 * 
+	 * @return The number of bytes written right away, or -1 if the connection was lost.
+	 */
+	int send(std::string_view data);
+	/**
+	 * @brief Same as send(std::string_view) except that the payload is queued
+	 * without being copied.
+	 */
+	int send(std::shared_ptr<const SharedPayload> payload);
+
+	/**
+	 * @brief Returns the number of bytes waiting in the write queue.
+	 */
+	size_t queued_bytes() {
+		return m_queued_bytes;
+	}
+
+	/**
+	 * @brief Sets the watermarks of the write queue for back pressure.
+	 * 
+	 * When the queue reaches the high watermark is_write_queue_full() becomes true and
+	 * the application should stop sending. Once the queue has gone down to the low
+	 * watermark, is_write_queue_full() becomes false and select() reports
+	 * is_write_queue_drained().
+	 */
+	void set_write_watermarks(size_t low, size_t high);
+
+	bool is_write_queue_full() {
+		return m_write_queue_full;
+	}
+	int recvfrom(ByteBuffer& b, sockaddr* from, int* from_len);
+	int sendto(ByteBuffer& b, const struct sockaddr* to, int to_len);
+
+	/**
+	 * @brief Sends a part of a file without copying it through the application.
+	 * 
+	 * On Linux and macOS the kernel sends the file straight from the page cache
+	 * with sendfile(). Elsewhere the file is read into a small buffer first. The
+	 * region's offset is moved forward by the number of bytes sent. When the
+	 * socket can't take any more, call it again once the socket is writable
+	 * until the region has no data remaining.
+	 * 
+	 * Data queued by send() must be written first. An exception is thrown if the
+	 * write queue is not empty.
+	 * 
+	 * @return The same as write(ByteBuffer&). -1 is also returned if the file has
+	 * become shorter than the region.
+	 */
+	int transfer_from(FileRegion& file);
+
+	/**
+	 * @brief Reads into the back of a chained buffer. Segments are added so that up
+	 * to max_bytes can be read with a single system call. The return value has
+	 * the same meaning as that of read(ByteBuffer&).
+	 */
+	int read(ChainedByteBuffer& b, size_t max_bytes = 65536);
+	/**
+	 * @brief Writes data from the front of a chained buffer with a single system call.
+	 * The bytes written are removed from the buffer. Call it again until the buffer
+	 * is empty.
+	 */
+	int write(ChainedByteBuffer& b);
+
+#ifdef VELAR_HAS_SPAN
+	/**
+	 * @brief Reads into several buffers with a single system call.
+	 * 
+	 * The buffers are filled in order. Each buffer's position is moved forward by
+	 * the number of bytes stored in it, so a buffer may be left partly filled.
+	 * Buffers that are already full are skipped. The return value has the same
+	 * meaning as that of read(ByteBuffer&).
+	 */
+	int read(std::span<ByteBuffer* const> buffers);
+	/**
+	 * @brief Writes the remaining data of several buffers with a single system call.
+	 * 
+	 * This sends a header and a body without copying them into one buffer. The
+	 * positions are moved forward the same way as for read(). Call it again with
+	 * the same buffers until the last one has no data remaining.
+	 */
+	int write(std::span<ByteBuffer* const> buffers);
+	/**
+	 * @brief Receives one datagram into several buffers.
+	 */
+	int recvfrom(std::span<ByteBuffer* const> buffers, sockaddr* from, int* from_len);
+	/**
+	 * @brief Sends the remaining data of several buffers as one datagram.
+	 */
+	int sendto(std::span<ByteBuffer* const> buffers, const struct sockaddr* to, int to_len);
+#endif
+
+	bool operator<(const Socket& other) const {
+		return m_fd < other.m_fd;
+	}
+
+	//Disable copying
+	Socket(const Socket&) = delete;
+	Socket& operator=(const Socket&) = delete;
+
+	// Disable moving
+	Socket(Socket&&) = delete;
+	Socket& operator=(Socket&&) = delete;
+};
+
+/*
+* A socket class that remembers the destination server's
+* address and port. This makes it easy to call sendto().
+*/
+struct DatagramClientSocket : public Socket {
+private:
+	//Owns server_address when it came from the resolver threads
+	std::shared_ptr<addrinfo> m_resolved_address;
+
+	void open(std::shared_ptr<addrinfo> addr);
+
+	friend struct Selector;
+
+public:
+	addrinfo *server_address;
+
+	DatagramClientSocket(addrinfo* addr);
+	//Creates a socket whose address is still being resolved
+	DatagramClientSocket();
+	~DatagramClientSocket();
+
+	int sendto(ByteBuffer& b);
+	using Socket::sendto;
+
+	int recvfrom(ByteBuffer& b);
+	using Socket::recvfrom;
+
+#ifdef VELAR_HAS_SPAN
+	int sendto(std::span<ByteBuffer* const> buffers);
+	int recvfrom(std::span<ByteBuffer* const> buffers);
+#endif
+};
+
+struct Selector {
+private:
+	void purge_sokets();
+	void add_socket(std::shared_ptr<Socket> socket);
+	SOCKET accept_fd(Socket* server);
+	void admit_sockets();
+
+	/*
+	* The registered sockets are kept in a dense array. Each socket knows its
+	* own index in the array. That makes insert and cancel O(1) without any
+	* per socket allocation. Sockets registered while the application may be
+	* looping through the array wait in m_new_sockets until the next select().
+	*/
+	std::vector<std::shared_ptr<Socket>> m_sockets;
+	std::vector<std::shared_ptr<Socket>> m_new_sockets;
+	std::vector<std::shared_ptr<Socket>> m_canceled_sockets;
+	//Sockets that had events reported by the last select()
+	std::vector<std::shared_ptr<Socket>> m_ready;
+
+	void add_ready(Socket* s);
+	void clear_ready();
+
+	//Edge triggered sockets that drain() left with data to read
+	std::vector<std::shared_ptr<Socket>> m_pending_drains;
+
+	int report_pending_drains();
+
+	//Connections handed out again by a ConnectionPool
+	std::vector<std::shared_ptr<Socket>> m_pending_reuses;
+
+	void report_reused(std::shared_ptr<Socket> socket);
+	int report_pending_reuses();
+
+	TimerWheel m_timers;
+
+	void cancel_deadlines(Socket* s);
+	int expire_timers();
+
+	/*
+	* Tasks posted from other threads. A single wakeup is sent no
+	* matter how many tasks are posted before the selector gets to them.
+	*/
+	TaskQueue m_tasks;
+	std::atomic<bool> m_wakeup_pending{ false };
+	std::unique_ptr<Wakeup> m_wakeup;
+
+	int run_tasks();
+
+	/*
+	* Host names are resolved by a pool of threads shared by all selectors.
+	* The results come back through post().
+	*/
+	std::shared_ptr<ResolverLink> m_resolver_link;
+
+	void resolve(const char* address, int port, int socktype, std::function<void(std::shared_ptr<struct addrinfo>)> callback);
+	void start_resolving(std::shared_ptr<Socket> socket);
+	void resolve_failed(std::shared_ptr<Socket> socket);
+	void connect_client(std::shared_ptr<Socket>& client, struct addrinfo* res);
+	std::shared_ptr<ConnectRace> start_race(std::shared_ptr<Socket> client, const struct addrinfo* addresses);
+	void race_next(const std::shared_ptr<ConnectRace>& race);
+	void finish_race(std::shared_ptr<ConnectRace> race, std::shared_ptr<Socket> winner);
+	void settle_races();
+
+	void pump_relay(std::shared_ptr<Relay> relay);
+	void close_relay(std::shared_ptr<Relay> relay);
+	int drop_hidden_ready();
+
+#ifdef VELAR_HAS_COROUTINES
+	//Tasks started by spawn() that have not finished yet
+	std::vector<std::coroutine_handle<TaskPromise<void>>> m_coroutines;
+	//Awaiters of canceled sockets. They are resumed by the next select().
+	std::vector<IoAwaiter*> m_failed_awaiters;
+	//The first exception thrown by a spawned task
+	std::exception_ptr m_coroutine_error;
+
+	int resume_awaiters();
+	void cancel_awaiters(Socket* s);
+	void coroutine_finished(std::coroutine_handle<TaskPromise<void>> h);
+
+	friend struct TaskPromiseBase;
+	friend struct IoAwaiter;
+	friend struct AcceptAwaiter;
+#endif
+
+#ifdef VELAR_USE_EPOLL
+	int m_epoll_fd = -1;
+	//Sockets whose reporting flags changed since the last select()
+	std::vector<Socket*> m_dirty_sockets;
+	std::vector<struct epoll_event> m_events;
+
+	void update_interest();
+	int select_epoll(std::chrono::microseconds timeout);
+#endif
+
+#ifdef VELAR_USE_IO_URING
+	std::unique_ptr<IoUring> m_ring;
+	//Canceled sockets that still have operations in flight
+	std::vector<std::shared_ptr<Socket>> m_draining_sockets;
+
+	void prepare_io(Socket* s, ByteBuffer& b, bool is_read);
+	void prepare_accept(Socket* server);
+	void cancel_io(Socket* s);
+	void release_file_slot(Socket* s);
+	int complete_io(bool& epoll_ready);
+#endif
+
+#ifndef VELAR_USE_EPOLL
+	void populate_fd_set(fd_set& read_fd_set, fd_set& write_fd_set, fd_set& except_fd_set);
+	int select_fd_set(std::chrono::microseconds timeout);
+#endif
+
+	friend struct Socket;
+	friend struct ConnectionPool;
+
+public:
+	Selector();
+	~Selector();
+
+	std::shared_ptr<Socket> start_udp_server(int port, std::shared_ptr<SocketAttachment> attachment);
+	std::shared_ptr<Socket> start_multicast_server(const char* group_address, int port, std::shared_ptr<SocketAttachment> attachment);
+	/**
+	 * @brief Starts a TCP server on the specified port with the given socket attachment.
+	 * 
+	 * This function initializes and starts a TCP server that listens on the specified port.
+	 * It sets the attachment of the server's socket to the provided socket attachment.
+	 * 
+	 * @param port The port number on which the server will listen for incoming connections.
+	 * @param attachment A shared pointer to a SocketAttachment object that will be set as the server's attachment.
+	 * @param backlog Maximum number of connections waiting to be accepted. Connection attempts beyond
+	 * this are dropped by the kernel. The kernel may limit the value further.
+	 * @return A shared pointer to a Socket object representing the started server.
+	 */
+	std::shared_ptr<Socket> start_server(int port, std::shared_ptr<SocketAttachment> attachment, int backlog = SOMAXCONN);
+	std::shared_ptr<Socket> start_client(const char* address, int port, std::shared_ptr<SocketAttachment> attachment);
+	/**
+	 * @brief Connects to whichever of the addresses answers first.
+	 * 
+	 * The addresses are tried in order, alternating between ipv6 and ipv4, with a new attempt
+	 * started every 250 milliseconds or as soon as one fails. The first attempt to connect wins
+	 * and the rest are canceled. start_client() with a host name does the same with all the
+	 * addresses the name resolves to.
+	 * 
+	 * @param addresses A list of addresses such as one returned by getaddrinfo(). It is copied.
+	 * @param attachment The attachment of the client socket.
+	 */
+	std::shared_ptr<Socket> start_client(const struct addrinfo* addresses, std::shared_ptr<SocketAttachment> attachment);
+	std::shared_ptr<DatagramClientSocket> start_udp_client(const char* address, int port, std::shared_ptr<SocketAttachment> attachment);
+	std::shared_ptr<Socket> accept(std::shared_ptr<Socket> server, std::shared_ptr<SocketAttachment> attachment);
+	/**
+	 * @brief Accepts all the clients waiting in the server's queue.
+	 * 
+	 * Call this when the server is acceptable instead of accepting one client per select().
+	 * The new sockets have no attachment.
+	 * 
+	 * @param server The server socket.
+	 * @param clients The accepted client sockets are appended to this list.
+	 * @param max_clients Stop after accepting this many clients.
+	 * @return The number of clients accepted.
+	 */
+	size_t accept_all(std::shared_ptr<Socket> server, std::vector<std::shared_ptr<Socket>>& clients, size_t max_clients = SIZE_MAX);
+	/**
+	 * @brief Waits for events on the managed sockets and for timers to expire.
+	 * 
+	 * @param timeout Maximum time to wait in seconds. Zero means wait indefinitely.
+	 * @return The number of events and expired timers. Zero if the timeout elapsed.
+	 * Negative if the wait was interrupted by a signal.
+	 */
+	int select(long timeout=0);
+	/**
+	 * @brief Same as select(long) but with sub-second timeout. A timeout of zero
+	 * checks for events without waiting. A negative timeout waits indefinitely.
+	 */
+	int select(std::chrono::microseconds timeout);
+	/**
+	 * @brief Calls the handlers of the sockets that had events in the last select().
+	 * Only the handler methods for the events that took place are called.
+	 * Sockets without a handler are skipped.
+	 * 
+	 * A handler may accept, start and cancel sockets. Once a socket is canceled
+	 * no more of its handler methods are called.
+	 * 
+	 * @return The number of handler methods called.
+	 */
+	int dispatch();
+
+	/**
+	 * @brief Schedules a timer. The callback is called from select() when the timer expires.
+	 * 
+	 * Scheduling a timer that is already scheduled reschedules it.
+	 * 
+	 * @param timer The timer. It is owned by the application.
+	 * @param delay Time from now when the timer expires.
+	 * @param callback Called when the timer expires.
+	 * @param period If not zero, the timer expires repeatedly with this period.
+	 */
+	void schedule(Timer& timer, std::chrono::microseconds delay, std::function<void()> callback, std::chrono::microseconds period = std::chrono::microseconds::zero());
+	void cancel_timer(Timer& timer);
+
+	/**
+	 * @brief Reports is_idle_timeout() for the socket when it has no events for the given duration.
+	 * The report repeats every time the duration elapses without any activity. Zero disables
+	 * the deadline.
+	 */
+	void set_idle_timeout(std::shared_ptr<Socket> socket, std::chrono::microseconds timeout);
+	/**
+	 * @brief Reports is_read_timeout() for the socket when it does not become readable within
+	 * the given duration. The deadline is moved forward every time the socket is readable.
+	 * Zero disables the deadline.
+	 */
+	void set_read_timeout(std::shared_ptr<Socket> socket, std::chrono::microseconds timeout);
+	/**
+	 * @brief Fails a pending connection if it does not complete within the given duration.
+	 * The socket then reports both is_connection_failed() and is_connect_timeout().
+	 */
+	void set_connect_timeout(std::shared_ptr<Socket> socket, std::chrono::microseconds timeout);
+	void cancel_socket(std::shared_ptr<Socket> socket);
+
+	/**
+	 * @brief Has the selector pass data both ways between two connected sockets.
+	 * 
+	 * On Linux the data is moved with splice() through a pipe and never enters the
+	 * application. Elsewhere it goes through a buffer. select() moves the data as the
+	 * sockets become ready. The application sees no events for the sockets and must not
+	 * read, write or change their reporting flags. When one side stops sending, the
+	 * other side's sending direction is shut down once everything has been passed on.
+	 * 
+	 * The relay is over once both directions are shut down, one of the sockets fails
+	 * or either socket is canceled. Both sockets are then canceled and on_close is called.
+	 * Data that is already waiting is moved right away, so if a socket has already
+	 * been closed on_close may be called before start_relay() returns.
+	 * 
+	 * An std::invalid_argument is thrown if a socket has not finished connecting or
+	 * has data queued by Socket::send().
+	 * 
+	 * @param a A connected socket.
+	 * @param b Another connected socket.
+	 * @param on_close Called when the relay is over. Can be null.
+	 */
+	void start_relay(std::shared_ptr<Socket> a, std::shared_ptr<Socket> b, std::function<void()> on_close = nullptr);
+
+	/**
+	 * @brief Runs a task in the selector's thread. This is the only Selector method
+	 * that can be called from any thread.
+	 * 
+	 * The task is run by the next select(). A select() that is blocked waiting for
+	 * events is woken up right away. Tasks run in the order they were posted.
+	 */
+	void post(std::function<void()> task);
+	/**
+	 * @brief Makes a select() that is blocked in another thread return. It can be
+	 * called from any thread.
+	 */
+	void wakeup();
+
+#ifdef VELAR_HAS_COROUTINES
+	/**
+	 * @brief Starts a coroutine. It runs until its first co_await and is then
+	 * resumed by select() as its sockets become ready.
+	 * 
+	 * The selector owns the coroutine. It is destroyed when it finishes or when
+	 * the selector is destroyed. An exception that escapes the coroutine is
+	 * rethrown by select().
+	 */
+	void spawn(Task<void> task);
+	/**
+	 * @brief Accepts a client in a coroutine. co_await suspends the coroutine until
+	 * a client has connected. The result is the client socket or null if the server
+	 * was canceled.
+	 */
+	AcceptAwaiter async_accept(std::shared_ptr<Socket> server) {
+		return AcceptAwaiter(std::move(server));
+	}
+	/**
+	 * @brief Connects to a server in a coroutine. co_await suspends the coroutine until
+	 * the connection is established. It throws std::runtime_error if the connection fails.
+	 */
+	ConnectAwaiter async_connect(const char* address, int port, std::shared_ptr<SocketAttachment> attachment = nullptr) {
+		return ConnectAwaiter(start_client(address, port, attachment));
+	}
+#endif
+
+#ifdef VELAR_USE_IO_URING
+	/**
+	 * @brief Asks the io_uring engine to read from the socket into the buffer.
+	 * 
+	 * The read is submitted with the next select(). When it completes, the buffer's
+	 * position is moved forward, is_read_complete() becomes true and read_result()
+	 * holds the same value read() would have returned. No readiness event and no
+	 * separate read() call are needed. Only one read can be in flight per socket.
+	 * 
+	 * The buffer must stay valid until the read completes.
+	 * 
+	 * @param socket The socket to read from.
+	 * @param b The buffer to read into, starting at its position.
+	 */
+	void submit_read(std::shared_ptr<Socket> socket, ByteBuffer& b);
+	/**
+	 * @brief Asks the io_uring engine to write the buffer's remaining data to the socket.
+	 * 
+	 * This works the same way as submit_read(). Upon completion is_write_complete()
+	 * becomes true and write_result() has the outcome.
+	 */
+	void submit_write(std::shared_ptr<Socket> socket, ByteBuffer& b);
+	/**
+	 * @brief Lets the io_uring engine accept clients for the server socket.
+	 * 
+	 * When a client is accepted the server socket becomes acceptable. Calling accept()
+	 * then hands over the new client and submits the next accept.
+	 */
+	void submit_accept(std::shared_ptr<Socket> server);
+	/**
+	 * @brief Registers buffers with the kernel so that reads and writes using them
+	 * need no per operation page mapping.
+	 * 
+	 * Registration replaces any previously registered buffers. It must not be done
+	 * while an operation using a registered buffer is in flight. The buffers must
+	 * stay valid until they are unregistered or the selector is destroyed.
+	 */
+	void register_buffers(const std::vector<ByteBuffer*>& buffers);
+#endif
+
+	/**
+	 * @brief Returns all the sockets managed by the selector.
+	 * 
+	 * Sockets created since the last select() are included after
+	 * the next call to select(). This used to be a std::set. The order
+	 * of the sockets is not defined.
+	 */
+	const std::vector<std::shared_ptr<Socket>>& sockets() {
+		return m_sockets;
+	}
+
+	/**
+	 * @brief Returns the sockets that had events reported by the last select().
+	 * 
+	 * Only these sockets can be acceptable, readable, writable or have a
+	 * connection or io_uring completion status to report. Looping through them
+	 * instead of all the sockets makes the cost of processing events grow with
+	 * the number of events, not the number of sockets.
+	 * 
+	 * The list is rebuilt by every call to select().
+	 */
+	const std::vector<std::shared_ptr<Socket>>& ready() {
+		return m_ready;
+	}
+
+	//Disable copying
+	Selector(const Selector&) = delete;
+	Selector& operator=(const Selector&) = delete;
+};
+
+/**
+ * @brief Keeps connections to servers open after use so that later requests to the
+ * same server skip the TCP handshake.
+ * 
+ * Connections are grouped by host name and port. A connection is handed out by
+ * acquire() and given back by release() once the response has been read. While it
+ * is idle the pool watches it, and closes it if the server hangs up. The pool
+ * belongs to a single selector and must not outlive it.
+ */
+struct ConnectionPool {
+private:
+	struct IdleConnection {
+		std::shared_ptr<Socket> socket;
+		//The handler the socket had before it was released
+		std::shared_ptr<SocketHandler> handler;
+	};
+
+	struct Host {
+		//The most recently released connection is at the back
+		std::vector<IdleConnection> idle;
+		//All connections to the host, in use or idle. Used to count them.
+		std::vector<const Socket*> open;
+	};
+
+	struct OpenConnection {
+		Host* host;
+		std::weak_ptr<Socket> socket;
+	};
+
+	Selector& m_selector;
+	size_t m_max_per_host;
+	size_t m_max_idle;
+	std::chrono::microseconds m_idle_timeout;
+	std::unordered_map<std::string, Host> m_hosts;
+	//The host of each connection handed out by acquire()
+	std::unordered_map<const Socket*, OpenConnection> m_open;
+	size_t m_num_idle = 0;
+	std::shared_ptr<IdleConnectionHandler> m_idle_handler;
+
+	Host* find_host(const Socket* socket);
+	void forget_closed(Host& host);
+	void evict(const std::shared_ptr<Socket>& socket);
+
+	friend struct IdleConnectionHandler;
+
+public:
+	/**
+	 * @brief Creates an empty pool.
+	 * 
+	 * @param sel The selector that runs the connections.
+	 * @param max_per_host Maximum number of connections to a host, in use and idle combined.
+	 * @param max_idle Maximum number of idle connections kept for all hosts combined.
+	 * @param idle_timeout Idle connections are closed after this long. Zero keeps them
+	 * until the server closes them.
+	 */
+	ConnectionPool(Selector& sel, size_t max_per_host = 8, size_t max_idle = 64, std::chrono::microseconds idle_timeout = std::chrono::seconds(60));
+	/**
+	 * @brief Closes the idle connections. Connections in use are left alone.
+	 */
+	~ConnectionPool();
+
+	/**
+	 * @brief Hands out a connection to the server.
+	 * 
+	 * An idle connection is reused if there is one. Otherwise a new one is started with
+	 * Selector::start_client(). Either way the socket reports is_connection_success()
+	 * after the next select(), so the application treats both the same. A reused
+	 * connection also reports is_connection_reused().
+	 * 
+	 * @param address Host name or IP address of the server.
+	 * @param port Port number of the server.
+	 * @param attachment The attachment of the socket.
+	 * @return The socket, or null if the host already has max_per_host connections.
+	 */
+	std::shared_ptr<Socket> acquire(const char* address, int port, std::shared_ptr<SocketAttachment> attachment);
+	/**
+	 * @brief Gives a connection back to the pool. Only release a connection that has no
+	 * unread data and no request in progress.
+	 * 
+	 * The socket is canceled instead if it did not come from acquire(), has not
+	 * connected, was closed by the server or the pool already has max_idle connections.
+	 * Its attachment is dropped. The handler is kept and restored by acquire().
+	 */
+	void release(std::shared_ptr<Socket> socket);
+	/**
+	 * @brief Takes care of an idle connection that shows up in Selector::ready().
+	 * 
+	 * Idle connections report readable so that a connection closed by the server is
+	 * noticed. Selector::dispatch() handles them. Applications that loop through
+	 * ready() themselves call this for each socket and skip it if it returns true.
+	 * 
+	 * @return true if the socket is an idle connection of this pool.
+	 */
+	bool handle_idle(const std::shared_ptr<Socket>& socket);
+
+	/**
+	 * @brief Returns the number of idle connections.
+	 */
+	size_t idle_count() {
+		return m_num_idle;
+	}
+
+	//Disable copying
+	ConnectionPool(const ConnectionPool&) = delete;
+	ConnectionPool& operator=(const ConnectionPool&) = delete;
+};
+
+/**
+ * @brief One event loop of an EventLoopGroup. Everything here is only
+ * used by the thread that runs the loop.
+ */
+struct EventLoop {
+	//Position of this loop in the group
+	size_t index = 0;
+	Selector selector;
+	//This loop's own listener. Null if the loop does not accept connections.
+	std::shared_ptr<Socket> server;
+	//Per loop application state, set by the start handler
+	std::shared_ptr<SocketAttachment> state;
+
+	template<class T>
+	std::shared_ptr<T> get_state() {
+		return std::static_pointer_cast<T>(state);
+	}
+};
+
+/**
+ * @brief Runs a Selector in each of several threads.
+ * 
+ * Each loop binds its own listener to the same port with SO_REUSEPORT and the
+ * kernel spreads incoming connections across them. A connection is then handled
+ * entirely by the loop that accepted it, so the loops share no state and need
+ * no locking. On Windows only the first loop gets a listener.
+ */
+struct EventLoopGroup {
+private:
+	std::vector<std::unique_ptr<EventLoop>> m_loops;
+	std::vector<std::thread> m_threads;
+	std::atomic<bool> m_stopping{ false };
+	//The first exception thrown by a loop. Rethrown by join().
+	std::exception_ptr m_error;
+	std::atomic<bool> m_has_error{ false };
+
+	void run(EventLoop& loop, std::function<void(EventLoop&)>& on_start, std::function<void(EventLoop&)>& on_select);
+
+public:
+	/**
+	 * @brief Creates the loops. The threads are not started yet.
+	 * 
+	 * @param num_loops Number of loops. Zero means one per CPU core.
+	 */
+	EventLoopGroup(unsigned int num_loops = 0);
+	/**
+	 * @brief Stops the loops and waits for the threads to end.
+	 */
+	~EventLoopGroup();
+
+	/**
+	 * @brief Starts a TCP server on the port in every loop and runs each loop in its own thread.
+	 * Thread i is pinned to CPU core i.
+	 * 
+	 * The listeners are created before this returns, so a port that can not be bound
+	 * is reported here. The handlers are called from the loop's thread.
+	 * 
+	 * @param port The port number to listen on.
+	 * @param on_select Called after every select() of a loop. It processes the loop's ready sockets.
+	 * @param on_start Optional. Called once by the loop's thread before the first select().
+	 * Use it to set up the loop's state.
+	 */
+	void start(int port, std::function<void(EventLoop&)> on_select, std::function<void(EventLoop&)> on_start = nullptr);
+	/**
+	 * @brief Asks all loops to stop. It can be called from any thread including a loop thread.
+	 */
+	void stop();
+	/**
+	 * @brief Waits for all loop threads to end. If a handler has thrown an exception the
+	 * group is stopped and the exception is rethrown here.
+	 */
+	void join();
+
+	bool is_stopping() {
+		return m_stopping.load(std::memory_order_acquire);
+	}
+
+	size_t size() {
+		return m_loops.size();
+	}
+
+	EventLoop& loop(size_t index) {
+		return *m_loops[index];
+	}
+
+	//Disable copying
+	EventLoopGroup(const EventLoopGroup&) = delete;
+	EventLoopGroup& operator=(const EventLoopGroup&) = delete;
 };